@@ -0,0 +1,197 @@
+/* Blocks of rows for the indexes to keep summaries of, see blocks.h. Each
+   index has its own, told of every row added or deleted before it happens.
+   Blocks that have to change shape are only cut up or dropped when the index
+   next looks, so it can bring its summaries along with them. */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blocks.h"
+
+#define BLOCK_KEY (1LL << 32) // the gap between keys as they are numbered
+
+/* Make room for n blocks and the start after them. */
+void blocksReserve(rowBlocks *b, int n) {
+  if (n < b->cap)
+    return;
+  b->cap = n + 1 + n / 2;
+  b->start = realloc(b->start, sizeof(int) * b->cap);
+  b->key = realloc(b->key, sizeof(long long) * b->cap);
+  b->data = realloc(b->data, (size_t)b->size * b->cap + 1);
+  b->touched = realloc(b->touched, b->cap);
+}
+
+/* Rows from at on were added, deleted or moved in a way the blocks can't
+   follow, so they are laid out again from there. */
+void blocksMoved(rowBlocks *b, int at) {
+  if (at < b->from)
+    b->from = at;
+}
+
+/* Note that the rows of block changed, for blocksTouched. */
+void blocksTouch(rowBlocks *b, int block) {
+  if (b->touched[block])
+    return;
+  b->touched[block] = 1;
+  if (b->nlist == b->listcap) {
+    b->listcap = b->listcap ? b->listcap * 2 : 16;
+    b->list = realloc(b->list, sizeof(int) * b->listcap);
+  }
+  b->list[b->nlist++] = block;
+}
+
+/* The block row y is in, which is the last to start at or before it. */
+int blocksFind(rowBlocks *b, int y) {
+  int lo = 0, hi = b->n - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (b->start[mid] <= y)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+/* The block row y is in, or -1 if it is yet to be laid out. */
+int blocksOf(rowBlocks *b, int y) {
+  if (y < 0 || y >= b->from || b->n == 0 || y >= b->start[b->n])
+    return -1;
+  return blocksFind(b, y);
+}
+
+/* The block with key, or -1. */
+int blocksByKey(rowBlocks *b, long long key) {
+  int lo = 0, hi = b->n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (b->key[mid] < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < b->n && b->key[lo] == key ? lo : -1;
+}
+
+void *blocksData(rowBlocks *b, int block) {
+  return b->data + (size_t)b->size * block;
+}
+
+/* n rows are about to be added at at, or -n deleted from at on. The block
+   they go into or come out of changes size and the ones after it move. */
+void blocksShift(rowBlocks *b, int at, int n) {
+  if (b->from != INT_MAX) {
+    if (at >= b->from || at - n > b->from) { // it's all laid out again anyway
+      blocksMoved(b, at);
+      return;
+    }
+    b->from += n;
+  }
+  if (b->n == 0) { // the first rows
+    blocksReserve(b, 1);
+    b->start[0] = 0;
+    b->start[1] = 0;
+    b->key[0] = 0;
+    b->touched[0] = 0;
+    b->n = 1;
+  }
+  int block = at >= b->start[b->n] ? b->n - 1 : blocksFind(b, at);
+  blocksTouch(b, block);
+  for (int i = block + 1; i <= b->n; i++) {
+    if (n > 0 || b->start[i] >= at - n) {
+      b->start[i] += n;
+    } else { // it starts in the rows deleted
+      b->start[i] = at;
+      blocksTouch(b, i);
+    }
+  }
+}
+
+int blocksCompare(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+/* Lay out the rows from b->from on again, now that there are rows of them in
+   all, and put the blocks touched before them in order for blocksTouched.
+   Returns the first block laid out again, or -1 if none was. */
+int blocksLayout(rowBlocks *b, int rows) {
+  int first = -1;
+  if (b->from != INT_MAX) {
+    int y = 0;
+    first = 0;
+    b->cut = 0;
+    if (b->n > 0) {
+      int last = b->start[b->n] - 1;
+      first = blocksFind(b, b->from < last ? b->from : last);
+      while (first > 0 && b->start[first] > rows)
+        first--;
+      y = b->start[first];
+      b->cut = b->key[first];
+    }
+    b->n = first;
+    for (; y < rows; y += BLOCK_ROWS) {
+      blocksReserve(b, b->n + 1);
+      b->start[b->n] = y;
+      b->key[b->n] = b->cut + (long long)(b->n - first) * BLOCK_KEY;
+      b->touched[b->n] = 0;
+      b->n++;
+    }
+    blocksReserve(b, b->n);
+    b->start[b->n] = rows;
+    b->from = INT_MAX;
+    int kept = 0;
+    for (int i = 0; i < b->nlist; i++)
+      if (b->list[i] < first)
+        b->list[kept++] = b->list[i];
+    b->nlist = kept;
+  }
+  if (b->nlist > 1)
+    qsort(b->list, b->nlist, sizeof(int), blocksCompare);
+  return first;
+}
+
+/* The next block touched since blocksLayout, the last one first, or -1. */
+int blocksTouched(rowBlocks *b) {
+  if (b->nlist == 0)
+    return -1;
+  int block = b->list[--b->nlist];
+  b->touched[block] = 0;
+  return block;
+}
+
+/* Drop block if it has no rows left, or cut it into blocks of BLOCK_ROWS if
+   it has grown past twice that. The first piece keeps its key and summary,
+   and the caller fills in the summaries of the others. Returns how many
+   blocks it is now. */
+int blocksSplit(rowBlocks *b, int block) {
+  int rows = b->start[block + 1] - b->start[block];
+  if (rows > 0 && rows <= 2 * BLOCK_ROWS)
+    return 1;
+  int k = (rows + BLOCK_ROWS - 1) / BLOCK_ROWS, after = b->n - block - 1;
+  blocksReserve(b, b->n + k);
+  memmove(&b->start[block + k], &b->start[block + 1],
+          sizeof(int) * (after + 1));
+  memmove(&b->key[block + k], &b->key[block + 1], sizeof(long long) * after);
+  memmove(b->data + (size_t)b->size * (block + k),
+          b->data + (size_t)b->size * (block + 1), (size_t)b->size * after);
+  memmove(&b->touched[block + k], &b->touched[block + 1], after);
+  b->n += k - 1;
+  if (k == 0)
+    return 0;
+  long long lo = b->key[block];
+  long long hi = block + k < b->n ? b->key[block + k] : lo + k * BLOCK_KEY;
+  long long step = (hi - lo) / k;
+  for (int i = 1; i < k; i++) {
+    b->start[block + i] = b->start[block] + i * BLOCK_ROWS;
+    b->key[block + i] = lo + i * step;
+    b->touched[block + i] = 0;
+  }
+  if (step == 0) { // no room between the keys either side
+    for (int i = 0; i < b->n; i++)
+      b->key[i] = i * BLOCK_KEY;
+    b->labels++;
+  }
+  return k;
+}
@@ -0,0 +1,36 @@
+#ifndef BLOCKS_H
+#define BLOCKS_H
+
+#define BLOCK_ROWS 64 // rows in a block when it is laid out
+
+/* The rows of the buffer cut into runs that an index keeps a summary of
+   each of. Rows added or deleted only change the size of the block they are
+   in and shift the starts of the blocks after it, so an edit leaves one block
+   for the index to bring up to date rather than every block from the edit
+   on. */
+typedef struct rowBlocks {
+  int *start;     // the row each block starts at; start[n] is all the rows
+  long long *key; // a number for each block, in order, that stays with it
+  char *data;     // a summary of size bytes for each block, for the index
+  int size;
+  int n, cap;
+  unsigned char *touched; // whether each block is in list
+  int *list;              // the blocks whose rows changed, see blocksTouched
+  int nlist, listcap;
+  int from;      // rows from here on are laid out again, INT_MAX if none
+  long long cut; // the key the blocks laid out again are numbered from
+  int labels;    // bumped each time the keys are all numbered again
+} rowBlocks;
+
+void blocksMoved(rowBlocks *b, int at);
+void blocksShift(rowBlocks *b, int at, int n);
+int blocksLayout(rowBlocks *b, int rows);
+int blocksTouched(rowBlocks *b);
+int blocksSplit(rowBlocks *b, int block);
+void blocksTouch(rowBlocks *b, int block);
+int blocksFind(rowBlocks *b, int y);
+int blocksOf(rowBlocks *b, int y);
+int blocksByKey(rowBlocks *b, long long key);
+void *blocksData(rowBlocks *b, int block);
+
+#endif
@@ -0,0 +1,283 @@
+/* An index of the brackets in the buffer, for % and for showing the pair
+   around the cursor. Each row keeps the brackets the lexer left as code, and
+   a segment tree over blocks of rows sums up how they nest, so the match for
+   a bracket is found by walking down the tree rather than along the rows. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "bracket.h"
+
+/* How the brackets of one kind in a run of rows nest: their net depth, and
+   the lowest it gets going forwards, with closers counting -1. Going
+   backwards, with openers counting -1, the lowest it gets is min - sum. */
+typedef struct bracketSum {
+  int sum, min;
+} bracketSum;
+
+struct bracketIndex {
+  rowBlocks blocks;      // each with a sum for each kind of bracket
+  bracketSum (*tree)[3]; // a sum for each kind of bracket in each node
+  int size;              // leaves in the tree, a power of two
+  int leaves;            // blocks the tree was built over
+} BI = {.blocks.size = sizeof(bracketSum[3])};
+
+/* The kind of bracket c is, 0 to 2, or -1. *open says which way it faces. */
+int bracketKind(char c, int *open) {
+  const char *brackets = "()[]{}";
+  const char *p = c ? strchr(brackets, c) : NULL;
+  *open = 0;
+  if (!p)
+    return -1;
+  *open = (p - brackets) % 2 == 0;
+  return (p - brackets) / 2;
+}
+
+bracketSum bracketCombine(bracketSum l, bracketSum r) {
+  bracketSum s;
+  s.sum = l.sum + r.sum;
+  s.min = l.min < l.sum + r.min ? l.min : l.sum + r.min;
+  return s;
+}
+
+/* Sum up the brackets in the rows of block. */
+void bracketLeaf(editorConfig *e, int block) {
+  bracketSum *leaf = blocksData(&BI.blocks, block);
+  int open;
+  for (int k = 0; k < 3; k++)
+    leaf[k] = (bracketSum){0, 0};
+  for (int y = BI.blocks.start[block]; y < BI.blocks.start[block + 1]; y++) {
+    erow *row = &e->row[y];
+    for (int i = 0; i < row->nbrackets; i++) {
+      bracketSum *s = &leaf[bracketKind(row->brackets[i].c, &open)];
+      s->sum += open ? 1 : -1;
+      if (s->sum < s->min)
+        s->min = s->sum;
+    }
+  }
+}
+
+void bracketNode(int node) {
+  for (int k = 0; k < 3; k++)
+    BI.tree[node][k] =
+        bracketCombine(BI.tree[2 * node][k], BI.tree[2 * node + 1][k]);
+}
+
+/* Build the tree over the sums of the blocks. It is the next power of two
+   wide, with empty leaves past the last block. */
+void bracketBuild() {
+  int blocks = BI.blocks.n;
+  if (BI.size == 0 || blocks > BI.size || blocks * 4 < BI.size) {
+    for (BI.size = 1; BI.size < blocks;)
+      BI.size *= 2;
+    BI.tree = realloc(BI.tree, sizeof(*BI.tree) * 2 * BI.size);
+  }
+  for (int i = 0; i < BI.size; i++)
+    for (int k = 0; k < 3; k++)
+      BI.tree[BI.size + i][k] =
+          i < blocks ? ((bracketSum *)blocksData(&BI.blocks, i))[k]
+                     : (bracketSum){0, 0};
+  for (int node = BI.size - 1; node > 0; node--)
+    bracketNode(node);
+  BI.leaves = blocks;
+}
+
+/* Bring the blocks whose rows have changed, and the nodes above them, up to
+   date. The tree is built again if blocks were cut up or dropped. */
+void bracketUpdate(editorConfig *e) {
+  rowBlocks *b = &BI.blocks;
+  int first = blocksLayout(b, e->numrows), block;
+  int rebuild = first != -1 || BI.leaves != b->n;
+  for (block = first; block != -1 && block < b->n; block++)
+    bracketLeaf(e, block);
+  while ((block = blocksTouched(b)) != -1) {
+    int pieces = blocksSplit(b, block);
+    for (int i = block; i < block + pieces; i++)
+      bracketLeaf(e, i);
+    if (pieces != 1) {
+      rebuild = 1;
+    } else if (!rebuild) {
+      int node = BI.size + block;
+      memcpy(BI.tree[node], blocksData(b, block), sizeof(bracketSum[3]));
+      for (node /= 2; node > 0; node /= 2)
+        bracketNode(node);
+    }
+  }
+  if (rebuild)
+    bracketBuild();
+}
+
+int bracketCode(erow *row, int j) {
+  char c = row->render[j];
+  if (c != '(' && c != ')' && c != '[' && c != ']' && c != '{' && c != '}')
+    return 0;
+  return row->hl[j] != HL_STRING && row->hl[j] != HL_COMMENT &&
+         row->hl[j] != HL_MLCOMMENT;
+}
+
+/* Note where the brackets are in a row that has just been lexed. */
+void bracketScan(editorConfig *e, erow *row) {
+  int n = 0, changed = 0;
+  for (int j = 0; j < row->rsize; j++)
+    n += bracketCode(row, j);
+  if (n != row->nbrackets) {
+    row->brackets = realloc(row->brackets, sizeof(rowBracket) * n);
+    row->nbrackets = n;
+    changed = 1;
+  }
+  for (int j = 0, i = 0; i < n; j++) {
+    if (!bracketCode(row, j))
+      continue;
+    changed |= row->brackets[i].c != row->render[j];
+    row->brackets[i++] = (rowBracket){j, row->render[j]};
+  }
+  // only the order of the brackets matters to the tree, not where they are
+  int block = changed ? blocksOf(&BI.blocks, row->idx) : -1;
+  if (block != -1 && &e->row[row->idx] == row)
+    blocksTouch(&BI.blocks, block);
+}
+
+/* Rows from at on were moved in a way that can't be followed, so the blocks
+   from there on have to be laid out and summed up again. */
+void bracketRowsMoved(int at) { blocksMoved(&BI.blocks, at); }
+
+/* n rows are about to be added at at, or -n deleted from there. Only the
+   block they are in has to be summed up again. */
+void bracketRowsShifted(int at, int n) { blocksShift(&BI.blocks, at, n); }
+
+/* The first block from from on where depth *d, carried in from before it,
+   comes down to 0; -1 if none. *d is carried past the blocks skipped. */
+int bracketFindForward(int node, int lo, int hi, int from, int k, int *d) {
+  if (hi <= from)
+    return -1;
+  bracketSum *s = &BI.tree[node][k];
+  if (lo >= from && *d + s->min > 0) {
+    *d += s->sum;
+    return -1;
+  }
+  if (hi - lo == 1)
+    return lo;
+  int mid = (lo + hi) / 2;
+  int b = bracketFindForward(2 * node, lo, mid, from, k, d);
+  return b != -1 ? b : bracketFindForward(2 * node + 1, mid, hi, from, k, d);
+}
+
+/* As bracketFindForward, for the last block up to to, going backwards. */
+int bracketFindBackward(int node, int lo, int hi, int to, int k, int *d) {
+  if (lo > to)
+    return -1;
+  bracketSum *s = &BI.tree[node][k];
+  if (hi - 1 <= to && *d + s->min - s->sum > 0) {
+    *d -= s->sum;
+    return -1;
+  }
+  if (hi - lo == 1)
+    return lo;
+  int mid = (lo + hi) / 2;
+  int b = bracketFindBackward(2 * node + 1, mid, hi, to, k, d);
+  return b != -1 ? b : bracketFindBackward(2 * node, lo, mid, to, k, d);
+}
+
+/* Walk the brackets of kind k in row y from index i in direction dir,
+   starting at depth *d. Returns the index of the one that brings it to 0, or
+   -1 with *d carried past the row. */
+int bracketWalkRow(erow *row, int i, int dir, int k, int *d) {
+  int open;
+  for (; i >= 0 && i < row->nbrackets; i += dir) {
+    if (bracketKind(row->brackets[i].c, &open) != k)
+      continue;
+    *d += open == (dir > 0) ? 1 : -1;
+    if (*d == 0)
+      return i;
+  }
+  return -1;
+}
+
+/* Find the bracket of kind k that brings depth d to 0, walking from bracket
+   i of row y in direction dir: along the row, the rest of its block, and then
+   the block the tree says it is in. */
+int bracketFind(editorConfig *e, int y, int i, int dir, int k, int d, int *my,
+                int *mrx) {
+  bracketUpdate(e);
+  int j = bracketWalkRow(&e->row[y], i, dir, k, &d);
+  int block = blocksFind(&BI.blocks, y), jumped = 0;
+  while (j == -1) {
+    int first = BI.blocks.start[block], last = BI.blocks.start[block + 1] - 1;
+    while (j == -1 && y + dir >= first && y + dir <= last) {
+      y += dir;
+      erow *row = &e->row[y];
+      j = bracketWalkRow(row, dir > 0 ? 0 : row->nbrackets - 1, dir, k, &d);
+    }
+    if (j != -1 || jumped)
+      break;
+    block = dir > 0 ? bracketFindForward(1, 0, BI.size, block + 1, k, &d)
+                    : bracketFindBackward(1, 0, BI.size, block - 1, k, &d);
+    if (block == -1)
+      return 0;
+    y = dir > 0 ? BI.blocks.start[block] - 1 : BI.blocks.start[block + 1];
+    jumped = 1;
+  }
+  if (j == -1)
+    return 0;
+  *my = y;
+  *mrx = e->row[y].brackets[j].rx;
+  return 1;
+}
+
+/* The index of the first bracket in row at rx or after it. */
+int bracketAt(erow *row, int rx) {
+  int lo = 0, hi = row->nbrackets;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (row->brackets[mid].rx < rx)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* The bracket matching the one at rx in row y, or the first one after it on
+   the row, as % finds it. */
+int bracketMatch(editorConfig *e, int y, int rx, int *my, int *mrx) {
+  if (y >= e->numrows)
+    return 0;
+  erow *row = &e->row[y];
+  int i = bracketAt(row, rx), open;
+  if (i == row->nbrackets)
+    return 0;
+  int k = bracketKind(row->brackets[i].c, &open);
+  return bracketFind(e, y, i + (open ? 1 : -1), open ? 1 : -1, k, 1, my, mrx);
+}
+
+/* The pair of brackets to show for the cursor at rx in row y: the one it is
+   on and its match, or else the nearest pair around it. */
+int bracketPair(editorConfig *e, int y, int rx, int pair[4]) {
+  if (y >= e->numrows)
+    return 0;
+  erow *row = &e->row[y];
+  int i = bracketAt(row, rx);
+  if (i < row->nbrackets && row->brackets[i].rx == rx) {
+    pair[0] = y;
+    pair[1] = rx;
+    return bracketMatch(e, y, rx, &pair[2], &pair[3]);
+  }
+  int found = 0;
+  for (int k = 0; k < 3; k++) {
+    int oy, orx;
+    if (!bracketFind(e, y, i - 1, -1, k, 1, &oy, &orx))
+      continue;
+    if (found && (oy < pair[0] || (oy == pair[0] && orx < pair[1])))
+      continue;
+    int cy, crx;
+    if (!bracketMatch(e, oy, orx, &cy, &crx))
+      continue;
+    pair[0] = oy;
+    pair[1] = orx;
+    pair[2] = cy;
+    pair[3] = crx;
+    found = 1;
+  }
+  return found;
+}
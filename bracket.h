@@ -0,0 +1,12 @@
+#ifndef BRACKET_H
+#define BRACKET_H
+
+#include "bse.h"
+
+void bracketScan(editorConfig *e, erow *row);
+void bracketRowsMoved(int at);
+void bracketRowsShifted(int at, int n);
+int bracketMatch(editorConfig *e, int y, int rx, int *my, int *mrx);
+int bracketPair(editorConfig *e, int y, int rx, int pair[4]);
+
+#endif
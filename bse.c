@@ -5,11 +5,21 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <time.h>
@@ -17,11 +27,25 @@
 
 #include "history.h"
 #include "bse.h"
+#include "bracket.h"
+#include "cache.h"
+#include "finder.h"
+#include "grep.h"
+#include "ident.h"
 #include "point.h"
+#include "syntax.h"
+#include "tags.h"
+#include "utf8.h"
+#include "wrap.h"
 
 #define BSE_VERSION "0.0.1"
 #define BSE_TAB_STOP 4
 #define BSE_DEBUG 1
+#define BSE_SAVE_CHUNK (1 << 20) // bytes written between progress updates
+#define BSE_READ_CHUNK (1 << 20) // bytes read from a file or pipe at once
+#define BSE_WINDOW_MIN (256 << 20) // files this big are opened as a window
+#define BSE_WINDOW_ROWS 4096       // rows held in memory in window mode
+#define BSE_WINDOW_STRIDE 128      // lines between window index entries
 
 #define CTRL_KEY(k) ((k)&0x1F)
 
@@ -45,6 +69,7 @@ const char *TERM_WHITE_BRIGHT = "\x1b[97m";
 const char *TERM_RESET = "\x1b[m";
 const char *TERM_RESET_FOREGROUND = "\x1b[39m";
 const char *TERM_INVERT = "\x1b[7m";
+const char *TERM_UNDERLINE = "\x1b[4m";
 
 // terminal control sequences
 const char *TERM_CLEAR_SCREEN = "\x1b[2J";
@@ -70,60 +95,14 @@ enum editorKey {
   PAGE_DOWN
 };
 
-enum editorHighlight {
-  HL_NORMAL = 0,
-  HL_COMMENT,
-  HL_MLCOMMENT,
-  HL_KEYWORD1,
-  HL_KEYWORD2,
-  HL_STRING,
-  HL_NUMBER,
-  HL_MATCH
-};
-
-#define HL_HIGHLIGHT_NUMBERS (1 << 0)
-#define HL_HIGHLIGHT_STRINGS (1 << 1)
+/* In a recorded macro, the byte after this one is a key from ARROW_LEFT on,
+   less ARROW_LEFT. It can't start a key typed as UTF-8. */
+#define KEY_SPECIAL 0xff
 
 void initEditor(struct editorConfig *e);
 void message(const char *fmt, ...);
 
-editorConfig EE; // initialise the first global state.
-editorConfig *E = &EE;
-
-char *C_HL_extensions[] = {".c", ".h", ".cpp", ".hpp", NULL};
-char *C_HL_keywords[] = {
-    "switch", "if",      "while",  "for",     "break",     "continue",
-    "return", "else",    "struct", "union",   "typedef",   "static",
-    "enum",   "class",   "case",   "#define", "#include",  "int|",
-    "long|",  "double|", "float|", "char|",   "unsigned|", "signed|",
-    "void|",  NULL};
-
-char *BC_HL_extensions[] = {".bc", ".bh"};
-char *BC_HL_keywords[] = {
-    "switch", "if",      "while",  "for",     "break",     "continue",
-    "return", "else",    "struct", "union",   "typedef",   "static",
-    "enum",   "class",   "case",   "#define", "#include",  "int|",
-    "long|",  "double|", "float|", "char|",   "unsigned|", "signed|",
-    "void|",  "string|", NULL};
-
-char *Go_HL_extensions[] = {".go"};
-char *Go_HL_keywords[] = {
-    "const", "var", "func", "type", "import", "package",
-    "chan", "interface", "map", "struct",
-    "break", "case", "continue", "default", "else", "fallthrough", "for",
-    "goto", "if", "range", "return", "select", "switch",
-    "defer", "go", NULL};
-
-struct editorSyntax HLDB[] = {
-     {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/",
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
-     {"ben-c", BC_HL_extensions, BC_HL_keywords, "//", "/*", "*/",
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
-     {"go", Go_HL_extensions, Go_HL_keywords, "//", "/*", "*/",
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
-};
-
-#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+editorConfig *E; // the buffer; undo and redo make it another state
 
 void die(const char *s) {
   write(STDOUT_FILENO, "\x1b[2J", 4); // clear screen
@@ -133,32 +112,116 @@ void die(const char *s) {
 }
 
 void editorRefreshScreen();
+void editorRefreshIfIdle();
+void editorUpdateSyntax(erow *row);
+void editorWindowOpen(char *filename, int fd);
+int editorWindowOpenComment();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorMoveCursor(int key);
+void editorMoveCursorCount(int key, int count);
+void editorRunKeys(const char *keys, int len, int count);
 
 struct abuf {
   char *b;
   int len;
+  int cap;
 };
 
 #define ABUF_INIT                                                              \
-  { NULL, 0 } // Represents an empty buffer
-
-void abAppend(struct abuf *ab, const char *s, int len) {
-  // Get a block of memory that is the size of the current string, plus the
-  // string we're appending.
-  char *new = realloc(ab->b, ab->len + len);
+  { NULL, 0, 0 } // Represents an empty buffer
 
+/* Make room for n more bytes after ab->len. It grows geometrically, so a
+   frame built from many small pieces costs a few reallocations rather than
+   one per piece. */
+void abReserve(struct abuf *ab, int n) {
+  if (ab->len + n <= ab->cap)
+    return;
+  int cap = ab->cap ? ab->cap : 4096;
+  while (cap < ab->len + n)
+    cap *= 2;
+  char *new = realloc(ab->b, cap);
   if (new == NULL)
     return;
-  memcpy(&new[ab->len], s, len); // copy "s" after the current data
   ab->b = new;
+  ab->cap = cap;
+}
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+  abReserve(ab, len);
+  if (ab->len + len > ab->cap)
+    return;
+  memcpy(&ab->b[ab->len], s, len); // copy "s" after the current data
   ab->len += len;
 }
 
 void abFree(struct abuf *ab) { free(ab->b); }
 
+int unread_key = -1; // a key pushed back by editorUnreadKey
+
+/* Keys to read instead of the terminal, see editorRunKeys. */
+struct keyFeed {
+  const char *keys;
+  int len, pos;
+  int repeat; // times left to go through keys, this one included
+  int active;
+} KF;
+
+/* Keys typed since q started recording a macro. */
+struct macroRecording {
+  int on;
+  int reg;  // the register it goes into
+  int last; // the register @ last ran, plus one
+  char *keys;
+  int len, cap;
+} Q;
+
+/* Push a key back so that the next editorReadKey returns it. */
+void editorUnreadKey(int c) { unread_key = c; }
+
+/* Return 1 if a key can be read without blocking. */
+int editorKeyPending() {
+  if (unread_key != -1 || KF.active)
+    return 1;
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+void *editorReserve(void *p, int *cap, int n);
+int editorReadTerminalKey(int allow_timeout);
+
 /*If allow_timeout, then return -1 on read timeout. */
 int editorReadKey(int allow_timeout) {
+  if (unread_key != -1) {
+    int k = unread_key;
+    unread_key = -1;
+    return k;
+  }
+  if (KF.active) { // once they run out, cancel whatever is waiting for more
+    if (KF.pos == KF.len && KF.repeat > 1) {
+      KF.pos = 0;
+      KF.repeat--;
+    }
+    if (KF.pos == KF.len)
+      return '\x1b';
+    int c = (unsigned char)KF.keys[KF.pos++];
+    if (c == KEY_SPECIAL && KF.pos < KF.len)
+      c = ARROW_LEFT + (unsigned char)KF.keys[KF.pos++];
+    return c;
+  }
+  int c = editorReadTerminalKey(allow_timeout);
+  if (Q.on && c >= 0) {
+    Q.keys = editorReserve(Q.keys, &Q.cap, Q.len + 2);
+    if (c >= ARROW_LEFT) {
+      Q.keys[Q.len++] = (char)KEY_SPECIAL;
+      Q.keys[Q.len++] = c - ARROW_LEFT;
+    } else {
+      Q.keys[Q.len++] = c;
+    }
+  }
+  return c;
+}
+
+int editorReadTerminalKey(int allow_timeout) {
   int nread;
   char c;
   // read() returns the number of bytes read
@@ -267,185 +330,180 @@ void enableRawMode() {
     die("tcsetattr");
 }
 
-int is_separator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+int lexStateEq(lexState a, lexState b) {
+  return a.in_string == b.in_string && a.in_comment == b.in_comment &&
+         a.prev_sep == b.prev_sep && a.prev_number == b.prev_number;
 }
 
-void editorUpdateSyntax(erow *row) {
-  // The hl array is the same size as the render array
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
-
-  if (E->syntax == NULL)
-    return;
-
-  char **keywords = E->syntax->keywords;
+/* Store st as checkpoint ck at render index i, dropping any later checkpoints
+   the lexer has already stepped past. */
+void editorRowSetChunk(erow *row, int ck, int i, lexState st) {
+  if (ck == row->nchunks || row->chunks[ck].rx > i) {
+    // grow in powers of two, so a full lex appends in amortised O(1)
+    if ((row->nchunks & (row->nchunks - 1)) == 0)
+      row->chunks =
+          realloc(row->chunks,
+                  sizeof(rowChunk) * (row->nchunks ? row->nchunks * 2 : 1));
+    memmove(&row->chunks[ck + 1], &row->chunks[ck],
+            sizeof(rowChunk) * (row->nchunks - ck));
+    row->nchunks++;
+  }
+  row->chunks[ck].rx = i;
+  row->chunks[ck].st = st;
+
+  int skip = ck + 1;
+  while (skip < row->nchunks && row->chunks[skip].rx <= i)
+    skip++;
+  memmove(&row->chunks[ck + 1], &row->chunks[skip],
+          sizeof(rowChunk) * (row->nchunks - skip));
+  row->nchunks -= skip - (ck + 1);
+}
 
-  char *scs = E->syntax->singleline_comment_start;
-  char *mcs = E->syntax->multiline_comment_start;
-  char *mce = E->syntax->multiline_comment_end;
+/* The generic lexer, which runs off the tables compiled from the syntax
+   definition. Built-in languages use the specialized copies in hl_gen.h. */
+#define LEX_NAME editorLexRowTable
+#define LEX_INIT const synTable *t = E->syntax->table;
+#define LEX_CLS(c) (t->cls[c])
+#define LEX_SCS (t->scs)
+#define LEX_SCS_LEN (t->scs_len)
+#define LEX_MCS (t->mcs)
+#define LEX_MCS_LEN (t->mcs_len)
+#define LEX_MCE (t->mce)
+#define LEX_MCE_LEN (t->mce_len)
+#define LEX_KEYWORD(p, left, klen) syntaxKeyword(t, p, left, klen)
+#include "lexrow.h"
+
+#include "hl_gen.h"
+
+/* Hand each built-in language the lexer generated for it. */
+void editorAttachLexers() {
+  struct editorSyntax *s;
+  for (unsigned int j = 0; (s = syntaxBuiltin(j)) != NULL; j++) {
+    for (int k = 0; builtinLexers[k].filetype; k++) {
+      if (!strcmp(s->filetype, builtinLexers[k].filetype))
+        s->lex = builtinLexers[k].lex;
+    }
+  }
+}
 
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
+/* Note what the indexes need from a row that has just been lexed. */
+void editorIndexRow(erow *row) {
+  bracketScan(E, row);
+  identScan(E, row);
+}
 
-  int prev_sep = 1; // beginning of line can be considered a separator
-  int in_string =
-      0; // we store the string char in here so we know when it closes
-  int in_comment = (row->idx > 0 && E->row[row->idx - 1].hl_open_comment);
+/* Rows from at on were moved in a way the indexes can't follow, so they
+   look at them all again. */
+void editorRowsMoved(int at) {
+  bracketRowsMoved(at);
+  identRowsMoved(at);
+  wrapRowsMoved(at);
+}
 
-  int i = 0;
-  while (i < row->size) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+/* n rows are about to be added at at, or -n deleted from there, which the
+   indexes follow by only looking at the rows around the edit again. */
+void editorRowsShifted(int at, int n) {
+  bracketRowsShifted(at, n);
+  identRowsShifted(E, at, n);
+  wrapRowsShifted(at, n);
+}
 
-    // single line comments
-    if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
-      }
-    }
+/* Lex a row on its own, leaving the rows after it alone. */
+int editorLex(erow *row, int i, lexState st, int converge) {
+  if (E->syntax->lex)
+    return E->syntax->lex(row, i, st, converge);
+  return editorLexRowTable(row, i, st, converge);
+}
 
-    // multiline comments
-    if (mcs_len && mce_len && !in_string) {
-      if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;                     // highlight
-        if (!strncmp(&row->render[i], mce, mce_len)) { // match end?
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);  // highlight end token
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        } else {
-          i++;
-          continue;
-        }
-      } else if (!strncmp(&row->render[i], mcs,
-                          mcs_len)) {               // match multiline start?
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len); // highlight the start token
-        i += mcs_len;
-        in_comment = 1;
-        continue;
-      }
-    }
+int editorLexRow(erow *row, int i, lexState st, int converge) {
+  int open = row->hl_open_comment;
+  int converged = editorLex(row, i, st, converge);
+  editorIndexRow(row);
+  if (row->hl_open_comment != open && row->idx + 1 < E->numrows)
+    // Recursive iteration over the rest of the file as the highlighting may
+    // have changed.
+    editorUpdateSyntax(&E->row[row->idx + 1]);
+  return converged;
+}
 
-    if (E->syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (in_string) {
-        row->hl[i] = HL_STRING;
-        // backslashes should keep this as a string
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING;
-          i += 2;
-          continue;
-        }
+/* The lexer state at the start of a row. */
+lexState editorRowStartState(erow *row) {
+  lexState st = {0, 0, 1, 0};
+  if (row->idx > 0)
+    st.in_comment = E->row[row->idx - 1].hl_open_comment;
+  else
+    st.in_comment = editorWindowOpenComment();
+  return st;
+}
 
-        if (c == in_string)
-          in_string = 0; // this is the closing quote
-        i++;
-        prev_sep = 1;
-        continue;
-      } else {
-        if (c == '"' || c == '\'') {
-          in_string = c;
-          row->hl[i] = HL_STRING;
-          i++;
-          continue;
-        }
-      }
-    }
+/* While greater than 0, edits mark rows stale instead of highlighting them,
+   and editorLexResume highlights them all in one pass at the end. */
+int lexDeferred;
+int lexStale; // rows may have been marked stale since the last flush
 
-    if (E->syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-          (c == '.' &&
-           prev_hl == HL_NUMBER)) { // support if number is a decimal
-        row->hl[i] = HL_NUMBER;
-        i++;
-        prev_sep = 0; // it wasn't a separator because we know it was number
-        continue;
-      }
-    }
+void editorLexDefer() { lexDeferred++; }
 
-    if (prev_sep) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2)
-          klen--;
+/* Mark row to be highlighted later, if highlighting is deferred. */
+int editorLexLater(erow *row) {
+  if (lexDeferred == 0)
+    return 0;
+  row->stale = 1;
+  lexStale = 1;
+  row->nchunks = 0;
+  return 1;
+}
 
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL) {
-        prev_sep = 0;
-        continue;
-      }
-    }
+void editorUpdateSyntax(erow *row) {
+  memset(row->hl, HL_NORMAL, row->rsize);
+  row->nchunks = 0;
+  if (editorLexLater(row))
+    return;
 
-    prev_sep = is_separator(c);
-    i++;
+  if (E->syntax == NULL) {
+    editorIndexRow(row);
+    return;
   }
 
-  // set hl_open_comment appropriately
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E->numrows)
-    // Recursive iteration over the rest of the file as the highlighting may
-    // have changed.
-    editorUpdateSyntax(&E->row[row->idx + 1]);
+  editorLexRow(row, 0, editorRowStartState(row), -1);
 }
 
-const char *editorSyntaxToColor(int hl) {
-  switch (hl) {
-  case HL_COMMENT:
-  case HL_MLCOMMENT:
-    return TERM_BLACK_BRIGHT;
-  case HL_KEYWORD1:
-    return TERM_RED_BRIGHT;
-  case HL_KEYWORD2:
-    return TERM_MAGENTA;
-  case HL_STRING:
-    return TERM_CYAN;
-  case HL_NUMBER:
-    return TERM_GREEN_BRIGHT;
-  case HL_MATCH:
-    return TERM_RED;
-  default:
-    return TERM_WHITE;
-  }
-}
+/* An escape sequence that is written out as it is, with its length. It is
+   padded to a fixed size so it can be copied without a loop. */
+struct sgr {
+  char s[8];
+  int len;
+};
+
+#define SGR(s)                                                                 \
+  { s, sizeof(s) - 1 }
+
+/* The colour each highlight is drawn in. HL_NORMAL goes back to the
+   terminal's own. */
+const struct sgr hlColors[] = {
+    [HL_NORMAL] = SGR("\x1b[39m"),    [HL_COMMENT] = SGR("\x1b[90m"),
+    [HL_MLCOMMENT] = SGR("\x1b[90m"), [HL_KEYWORD1] = SGR("\x1b[91m"),
+    [HL_KEYWORD2] = SGR("\x1b[35m"),  [HL_STRING] = SGR("\x1b[36m"),
+    [HL_NUMBER] = SGR("\x1b[92m"),    [HL_MATCH] = SGR("\x1b[31m"),
+};
 
 void editorSelectSyntaxHighlight() {
   /*Sets E.syntax based on E.filename */
   E->syntax = NULL;
   if (E->filename == NULL)
     return;
-  char *ext = strchr(E->filename, '.');
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-    struct editorSyntax *s = &HLDB[j];
-    unsigned int i = 0;
-    while (s->filematch[i]) {
-      int is_ext = (s->filematch[i][0] == '.');
-      if ((is_ext && !strcmp(ext, s->filematch[i])) ||
-          (!is_ext && strstr(E->filename, s->filematch[i]))) {
-        E->syntax = s;
-
-        int filerow;
-        for (filerow = 0; filerow < E->numrows; filerow++) {
-          editorUpdateSyntax(&E->row[filerow]);
-        }
-      }
-      i++;
-    }
+  E->syntax = syntaxFind(E->filename);
+  if (E->syntax == NULL)
+    return;
+
+  int filerow;
+  for (filerow = 0; filerow < E->numrows; filerow++) {
+    editorUpdateSyntax(&E->row[filerow]);
   }
 }
 
 int editorRowCxToRx(erow *row, int cx) {
+  if (row->tabs == 0)
+    return cx;
   int rx = 0;
   int j;
   for (j = 0; j < cx; j++) {
@@ -458,6 +516,8 @@ int editorRowCxToRx(erow *row, int cx) {
 
 int editorRowRxToCx(erow *row, int rx) {
   // For a given row, converts the given rx value to the corresponding cx
+  if (row->tabs == 0)
+    return rx < row->size ? rx : row->size;
   int cur_rx = 0;
   int cx;
   for (cx = 0; cx < row->size; cx++) {
@@ -470,16 +530,70 @@ int editorRowRxToCx(erow *row, int rx) {
   return cx;
 }
 
-void editorUpdateRow(erow *row) {
+/* Whether cx is inside a character of row rather than at its start. A
+   character takes in the marks that combine with it, see utf8.c. */
+int editorRowInChar(erow *row, int cx) {
+  if (!row->cols || cx <= 0 || cx >= row->size)
+    return 0;
+  int rx = editorRowCxToRx(row, cx);
+  return row->cols[rx] == row->cols[rx - 1];
+}
+
+/* The start of the character after (dir 1) or before (dir -1) the one at
+   cx. */
+int editorRowNextChar(erow *row, int cx, int dir) {
+  cx += dir;
+  while (editorRowInChar(row, cx))
+    cx += dir;
+  return cx;
+}
+
+/* Grow an allocation of *cap bytes so that it holds n bytes and a
+   terminator. Growth is geometric, so appending to a row is amortised O(1). */
+void *editorReserve(void *p, int *cap, int n) {
+  if (n < *cap)
+    return p;
+  int newcap = *cap + *cap / 2;
+  if (newcap < n + 1)
+    newcap = n + 1;
+  *cap = newcap;
+  return realloc(p, newcap);
+}
+
+/* Make room for n chars in the row, and make it safe to write. */
+void editorRowReserve(erow *row, int n) {
+  textReserve(&row->text, row->size, n);
+  row->chars = row->text->chars;
+}
+
+/* Make room for n rendered chars and their highlighting. */
+void editorRowReserveRender(erow *row, int n) {
+  int cap = row->rcap;
+  row->render = editorReserve(row->render, &cap, n);
+  row->hl = editorReserve(row->hl, &row->rcap, n);
+}
+
+/* Expand chars into render, turning tabs into spaces. */
+void editorRenderRow(erow *row) {
+  if (memchr(row->chars, '\t', row->size) == NULL) {
+    // the common case: render is a copy of chars
+    row->tabs = 0;
+    editorRowReserveRender(row, row->size);
+    memcpy(row->render, row->chars, row->size);
+    row->render[row->size] = '\0';
+    row->rsize = row->size;
+    return;
+  }
+
   int tabs = 0;
   int j;
   for (j = 0; j < row->size; j++) {
     if (row->chars[j] == '\t')
       tabs++;
   }
+  row->tabs = tabs;
 
-  free(row->render);
-  row->render = malloc(row->size + tabs * (BSE_TAB_STOP - 1) + 1);
+  editorRowReserveRender(row, row->size + tabs * (BSE_TAB_STOP - 1));
 
   int idx = 0;
   for (j = 0; j < row->size; j++) {
@@ -496,138 +610,889 @@ void editorUpdateRow(erow *row) {
   row->render[idx] = '\0';
   row->rsize =
       idx; // idx contains the number of characters we copied into row->render
+}
 
+/* Work out again what depends on the render of a row of the buffer: the
+   columns its characters are in, and the lines it wraps onto. */
+void editorRenderChanged(erow *row) {
+  utf8Columns(row);
+  wrapRowChanged(E, row);
+}
+
+void editorRerenderRow(erow *row) {
+  editorRenderRow(row);
+  editorRenderChanged(row);
+}
+
+void editorUpdateRow(erow *row) {
+  editorRerenderRow(row);
   editorUpdateSyntax(row);
 }
 
+/* Update a row after chars[at, at + removed) was replaced by inserted new
+   bytes. The text after the edit renders the same as before as long as it
+   holds no tab, so its highlighting is moved rather than recomputed and the
+   lexer only re-runs from a checkpoint just before the edit until its state
+   lines up with the old checkpoints again. */
+void editorUpdateRowSpan(erow *row, int at, int removed, int inserted) {
+  if (lexDeferred) {
+    editorUpdateRow(row);
+    return;
+  }
+  int j;
+  int newtabs = 0;
+  for (j = at; j < at + inserted; j++) {
+    if (row->chars[j] == '\t')
+      newtabs++;
+  }
+  int tail = row->size - at - inserted; // unchanged chars after the edit
+  int oldrsize = row->rsize;
+  int rat; // where the edit starts in render
+
+  if (row->tabs == 0 && newtabs == 0) {
+    // render is a copy of chars, so patch it in place
+    rat = at;
+    editorRowReserveRender(row, row->size);
+    memmove(&row->render[at + inserted], &row->render[at + removed], tail);
+    memcpy(&row->render[at], &row->chars[at], inserted);
+    row->rsize = row->size;
+    row->render[row->rsize] = '\0';
+    editorRenderChanged(row);
+  } else if (memchr(&row->chars[at + inserted], '\t', tail) == NULL) {
+    editorRerenderRow(row);
+    rat = editorRowCxToRx(row, at);
+  } else {
+    // a tab after the edit may change width, so start over
+    editorUpdateRow(row);
+    return;
+  }
+  memmove(&row->hl[row->rsize - tail], &row->hl[oldrsize - tail], tail);
+  memset(&row->hl[rat], HL_NORMAL, row->rsize - tail - rat);
+
+  // Move the checkpoints after the edit along with their text. Those at the
+  // start of or inside the replaced text no longer mean anything; keeping one
+  // at rat would let the lexer converge on it over stale highlighting.
+  int n = 0;
+  for (j = 0; j < row->nchunks; j++) {
+    rowChunk c = row->chunks[j];
+    if (c.rx >= rat && c.rx < oldrsize - tail)
+      continue;
+    if (c.rx >= rat)
+      c.rx += row->rsize - oldrsize;
+    row->chunks[n++] = c;
+  }
+  row->nchunks = n;
+
+  if (E->syntax == NULL) {
+    editorIndexRow(row);
+    return;
+  }
+
+  // Resume from the last checkpoint far enough back that the lexer could not
+  // have looked into the edited text from before it.
+  int safe = rat - E->syntax->table->lookahead;
+  j = row->nchunks;
+  while (j > 0 && row->chunks[j - 1].rx > safe)
+    j--;
+  if (j == 0)
+    editorLexRow(row, 0, editorRowStartState(row), row->rsize - tail);
+  else
+    editorLexRow(row, row->chunks[j - 1].rx, row->chunks[j - 1].st,
+                 row->rsize - tail);
+}
+
+/* Re-render the changed rows and relex them in one pass from the first,
+   carrying on past the last only while the comment state differs. */
+void editorRelexRows(int *rows, int n) {
+  if (n == 0)
+    return;
+  for (int i = 0; i < n; i++)
+    editorRerenderRow(&E->row[rows[i]]);
+  if (lexDeferred) {
+    for (int i = 0; i < n; i++)
+      editorLexLater(&E->row[rows[i]]);
+    return;
+  }
+  int before = editorRowStartState(&E->row[rows[0]]).in_comment; // as it was
+  int after = before;                                           // as it is
+  for (int y = rows[0], i = 0; y < E->numrows; y++) {
+    erow *row = &E->row[y];
+    int changed = i < n && rows[i] == y;
+    if (!changed && before == after && i == n)
+      break;
+    i += changed;
+    int old = row->hl_open_comment;
+    if (changed || before != after) {
+      memset(row->hl, HL_NORMAL, row->rsize);
+      row->nchunks = 0;
+      if (E->syntax) {
+        lexState st = {0, after, 1, 0};
+        editorLex(row, 0, st, -1);
+      }
+      editorIndexRow(row);
+    }
+    before = old;
+    after = row->hl_open_comment;
+  }
+}
+
+/* Highlight the rows left stale now, even if highlighting is deferred, for
+   something that needs it to be right straight away. */
+void editorLexFlush() {
+  if (!lexStale)
+    return;
+  int depth = lexDeferred;
+  lexDeferred = 0;
+  lexStale = 0;
+  int *rows = NULL, n = 0, cap = 0;
+  for (int y = 0; y < E->numrows; y++) {
+    if (!E->row[y].stale)
+      continue;
+    E->row[y].stale = 0;
+    rows = editorReserve(rows, &cap, (n + 1) * sizeof(int));
+    rows[n++] = y;
+  }
+  editorRelexRows(rows, n);
+  free(rows);
+  lexDeferred = depth;
+}
+
+/* Stop deferring highlighting, and highlight the rows left stale. */
+void editorLexResume() {
+  if (--lexDeferred > 0)
+    return;
+  editorLexFlush();
+}
+
+/* Re-render and relex rows [at, at + n), as editorRelexRows. */
+void editorRelexSpan(int at, int n) {
+  int *rows = malloc(sizeof(int) * (n > 0 ? n : 1));
+  for (int i = 0; i < n; i++)
+    rows[i] = at + i;
+  editorRelexRows(rows, n);
+  free(rows);
+}
+
+/* Fill in row number at with the first len chars of t, taking over a
+   reference to it. It still has to be rendered and highlighted. */
+void editorInitRow(erow *row, int at, text *t, int len) {
+  row->idx = at;
+
+  row->size = len;
+  row->text = t;
+  row->chars = t->chars;
+
+  row->rsize = 0;
+  row->rcap = 0;
+  row->render = NULL;
+  row->hl = NULL;
+  row->hl_open_comment = 0;
+  row->chunks = NULL;
+  row->nchunks = 0;
+  row->brackets = NULL;
+  row->nbrackets = 0;
+  row->idents = NULL;
+  row->nidents = 0;
+  row->cols = NULL;
+  row->wraps = NULL;
+  row->nwraps = 0;
+  row->wrapcols = 0;
+  row->marked = 0;
+  row->stale = 0;
+}
+
 void editorInsertRow(int at, char *s, size_t len) {
   if (at < 0 || at > E->numrows)
     return;
   /* history_push(&E); */
   E->row = realloc(E->row, sizeof(erow) * (E->numrows + 1));
+  editorRowsShifted(at, 1);
   memmove(&E->row[at + 1], &E->row[at], sizeof(erow) * (E->numrows - at));
   for (int j = at + 1; j <= E->numrows; j++)
     E->row[j].idx++;
 
-  E->row[at].idx = at;
-
-  E->row[at].size = len;
-  E->row[at].chars = malloc(len + 1);
-  memcpy(E->row[at].chars, s, len);
-  E->row[at].chars[len] = '\0';
-
-  E->row[at].rsize = 0;
-  E->row[at].render = NULL;
-  E->row[at].hl = NULL;
-  E->row[at].hl_open_comment = 0;
+  // the state the row after it was lexed in, as for editorInsertRows
+  int was = at < E->numrows ? editorRowStartState(&E->row[at]).in_comment : 0;
+  editorInitRow(&E->row[at], at, textNew(s, len), len);
+  E->row[at].hl_open_comment = was;
   editorUpdateRow(&E->row[at]);
 
   E->numrows++;
   E->dirty++;
+  E->edits++;
+}
+
+/* Insert a row for each of the n slices at at, with one shift of the rows
+   after them and one pass of highlighting. A slice that is a whole text is
+   shared rather than copied. */
+void editorInsertRows(int at, slice *s, int n) {
+  if (at < 0 || at > E->numrows || n <= 0)
+    return;
+  // the state the row after them was lexed in, so the pass can stop there
+  int was = at < E->numrows ? editorRowStartState(&E->row[at]).in_comment : 0;
+  E->row = realloc(E->row, sizeof(erow) * (E->numrows + n));
+  editorRowsShifted(at, n);
+  memmove(&E->row[at + n], &E->row[at], sizeof(erow) * (E->numrows - at));
+  for (int j = at + n; j < E->numrows + n; j++)
+    E->row[j].idx = j;
+  for (int i = 0; i < n; i++) {
+    text *t = s[i].off == 0 && s[i].t->chars[s[i].len] == '\0'
+                  ? textRef(s[i].t)
+                  : textNew(&s[i].t->chars[s[i].off], s[i].len);
+    editorInitRow(&E->row[at + i], at + i, t, s[i].len);
+    E->row[at + i].hl_open_comment = was;
+  }
+  E->numrows += n;
+  editorRelexSpan(at, n);
+  E->dirty++;
+  E->edits++;
 }
 
 void editorFreeRow(erow *row) {
   free(row->render);
-  free(row->chars);
+  textUnref(row->text);
   free(row->hl);
+  free(row->chunks);
+  free(row->brackets);
+  free(row->idents);
+  free(row->cols);
+  free(row->wraps);
 }
 
-void editorDelRow(int at) {
-  if (at < 0 || at >= E->numrows)
-    return;
-  editorFreeRow(&E->row[at]);
-  memmove(&E->row[at], &E->row[at + 1], sizeof(erow) * (E->numrows - at - 1));
-  for (int j = at; j < E->numrows - 1; j++)
-    E->row[j].idx--;
-  E->numrows--;
+/* Take rows [at, at + n) out with one shift of the rows after them, leaving
+   the highlighting to the caller. */
+void editorRemoveRows(int at, int n) {
+  editorRowsShifted(at, -n);
+  for (int j = at; j < at + n; j++)
+    editorFreeRow(&E->row[j]);
+  memmove(&E->row[at], &E->row[at + n],
+          sizeof(erow) * (E->numrows - at - n));
+  E->numrows -= n;
+  for (int j = at; j < E->numrows; j++)
+    E->row[j].idx = j;
   E->dirty++;
+  E->edits++;
+}
+
+/* Delete the rows from at up to at + n in one go. */
+void editorDelRows(int at, int n) {
+  if (at < 0 || n <= 0 || at + n > E->numrows)
+    return;
+  int was = E->row[at + n - 1].hl_open_comment; // what the next row started in
+  editorRemoveRows(at, n);
+  if (at < E->numrows && editorRowStartState(&E->row[at]).in_comment != was)
+    editorUpdateSyntax(&E->row[at]);
+}
+
+void editorDelRow(int at) { editorDelRows(at, 1); }
+
+/* Join rows [at, at + n) into row at, separated by spaces. */
+void editorJoinRows(int at, int n) {
+  if (at < 0 || n < 2 || at + n > E->numrows)
+    return;
+  erow *row = &E->row[at];
+  int len = row->size;
+  for (int j = at + 1; j < at + n; j++)
+    len += 1 + E->row[j].size;
+  editorRowReserve(row, len);
+  for (int j = at + 1; j < at + n; j++) {
+    row->chars[row->size++] = ' ';
+    memcpy(&row->chars[row->size], E->row[j].chars, E->row[j].size);
+    row->size += E->row[j].size;
+  }
+  row->chars[row->size] = '\0';
+  // the row after the join was lexed starting in the last joined row's state
+  row->hl_open_comment = E->row[at + n - 1].hl_open_comment;
+  editorRemoveRows(at + 1, n - 1);
+  editorRelexSpan(at, 1);
+}
+
+/* Delete the chars from a up to b, which may be on a later row, joining what
+   is left of the two. */
+void editorDelRange(point a, point b) {
+  erow *row = &E->row[a.y], *last = &E->row[b.y];
+  int len = a.x + last->size - b.x;
+  editorRowReserve(row, len);
+  memmove(&row->chars[a.x], &last->chars[b.x], last->size - b.x + 1);
+  if (a.y == b.y) {
+    row->size = len;
+    editorUpdateRowSpan(row, a.x, b.x - a.x, 0);
+    E->dirty++;
+    E->edits++;
+    return;
+  }
+  row->size = len;
+  // the row after the range was lexed starting in the last row's state
+  row->hl_open_comment = last->hl_open_comment;
+  editorRemoveRows(a.y + 1, b.y - a.y);
+  editorRelexSpan(a.y, 1);
+}
+
+/* Shift rows [at, at + n) right by a tab, or left (dir < 0) by a tab or up
+   to BSE_TAB_STOP spaces. Empty rows are left alone. */
+void editorIndentRows(int at, int n, int dir) {
+  if (at < 0 || n <= 0 || at + n > E->numrows)
+    return;
+  int *rows = malloc(sizeof(int) * n), nrows = 0;
+  for (int y = at; y < at + n; y++) {
+    erow *row = &E->row[y];
+    if (dir > 0 && row->size > 0) {
+      editorRowReserve(row, row->size + 1);
+      memmove(&row->chars[1], row->chars, row->size + 1);
+      row->chars[0] = '\t';
+      row->size++;
+    } else if (dir < 0) {
+      int k = 0;
+      if (row->size > 0 && row->chars[0] == '\t')
+        k = 1;
+      else
+        while (k < row->size && k < BSE_TAB_STOP && row->chars[k] == ' ')
+          k++;
+      if (k == 0)
+        continue;
+      editorRowReserve(row, row->size);
+      memmove(row->chars, &row->chars[k], row->size - k + 1);
+      row->size -= k;
+    } else {
+      continue;
+    }
+    rows[nrows++] = y;
+  }
+  editorRelexRows(rows, nrows);
+  free(rows);
+  if (nrows) {
+    E->dirty++;
+    E->edits++;
+  }
+}
+
+/* A register holds the rows last deleted or yanked into it, sharing their
+   text with the rows they came from until one side is changed. */
+struct editorRegister {
+  slice *rows;
+  int n;
+  int lines; // whole rows, rather than the chars between two points
+};
+
+/* The unnamed register, then "a to "z. */
+struct editorRegister Reg[27];
+int regName; // the one picked with " for the next yank or put
+
+/* Which register c names, or -1. */
+int editorRegisterIndex(int c) {
+  if (c == '"')
+    return 0;
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 1;
+  return -1;
+}
+
+void editorRegisterSet(struct editorRegister *r, slice *rows, int n,
+                       int lines) {
+  for (int i = 0; i < r->n; i++)
+    textUnref(r->rows[i].t);
+  free(r->rows);
+  r->rows = rows;
+  r->n = n;
+  r->lines = lines;
+}
+
+/* Store n slices in the picked register and the unnamed one. */
+void editorRegisterStore(slice *rows, int n, int lines) {
+  int name = regName;
+  regName = 0;
+  if (name) {
+    slice *copy = malloc(sizeof(slice) * n);
+    for (int i = 0; i < n; i++) {
+      copy[i] = rows[i];
+      textRef(copy[i].t);
+    }
+    editorRegisterSet(&Reg[name], copy, n, lines);
+  }
+  editorRegisterSet(&Reg[0], rows, n, lines);
+}
+
+/* Yank rows [at, at + n). */
+void editorYankRows(int at, int n) {
+  if (at < 0 || n <= 0 || at + n > E->numrows) {
+    regName = 0;
+    return;
+  }
+  slice *rows = malloc(sizeof(slice) * n);
+  for (int i = 0; i < n; i++) {
+    erow *row = &E->row[at + i];
+    rows[i] = (slice){textRef(row->text), 0, row->size};
+  }
+  editorRegisterStore(rows, n, 1);
+}
+
+/* Yank the chars from a up to b, which may be on a later row. */
+void editorYankRange(point a, point b) {
+  int n = b.y - a.y + 1;
+  slice *rows = malloc(sizeof(slice) * n);
+  for (int i = 0; i < n; i++) {
+    erow *row = &E->row[a.y + i];
+    int from = i == 0 ? a.x : 0, to = i == n - 1 ? b.x : row->size;
+    rows[i] = (slice){textRef(row->text), from, to - from};
+  }
+  editorRegisterStore(rows, n, 0);
+}
+
+/* Put the picked register's rows in at row at, count times over with one
+   insertion. Returns how many rows that is. */
+int editorPutRows(int at, int count) {
+  struct editorRegister *r = &Reg[regName];
+  regName = 0;
+  if (r->n == 0) {
+    message("Nothing to put");
+    return 0;
+  }
+  if (count == 1) {
+    editorInsertRows(at, r->rows, r->n);
+    return r->n;
+  }
+  slice *rows = malloc(sizeof(slice) * r->n * count);
+  for (int i = 0; i < count; i++)
+    memcpy(&rows[i * r->n], r->rows, sizeof(slice) * r->n);
+  editorInsertRows(at, rows, r->n * count);
+  free(rows);
+  return r->n * count;
+}
+
+/* Put the chars in r at at. More than one row's worth splits the row, the
+   rest of it going after the last. */
+void editorPutChars(point at, struct editorRegister *r) {
+  erow *row = &E->row[at.y];
+  slice *s = r->rows;
+  if (r->n == 1) {
+    editorRowReserve(row, row->size + s[0].len);
+    memmove(&row->chars[at.x + s[0].len], &row->chars[at.x],
+            row->size - at.x + 1);
+    memcpy(&row->chars[at.x], &s[0].t->chars[s[0].off], s[0].len);
+    row->size += s[0].len;
+    editorUpdateRowSpan(row, at.x, 0, s[0].len);
+    E->dirty++;
+    E->edits++;
+    return;
+  }
+  slice *rest = malloc(sizeof(slice) * (r->n - 1));
+  memcpy(rest, &s[1], sizeof(slice) * (r->n - 2));
+  slice last = s[r->n - 1];
+  int len = last.len + row->size - at.x;
+  text *t = textNew(&last.t->chars[last.off], last.len);
+  textReserve(&t, last.len, len);
+  memcpy(&t->chars[last.len], &row->chars[at.x], row->size - at.x + 1);
+  rest[r->n - 2] = (slice){t, 0, len};
+
+  editorRowReserve(row, at.x + s[0].len);
+  memcpy(&row->chars[at.x], &s[0].t->chars[s[0].off], s[0].len);
+  row->size = at.x + s[0].len;
+  row->chars[row->size] = '\0';
+  editorInsertRows(at.y + 1, rest, r->n - 1);
+  editorRelexSpan(at.y, 1);
+  textUnref(t);
+  free(rest);
+}
+
+/* p and P: put the picked register count times after or before the cursor. */
+void editorPut(int after, int count) {
+  struct editorRegister *r = &Reg[regName];
+  if (r->n == 0 || r->lines) {
+    int n = editorPutRows(E->cy + (after && E->numrows > 0), count);
+    if (n > 0 && after && E->cy + 1 < E->numrows)
+      E->cy++;
+    E->cx = 0;
+    return;
+  }
+  regName = 0;
+  if (E->numrows == 0)
+    editorInsertRow(0, "", 0);
+  point at = {E->cy, E->cx};
+  if (after && at.x < E->row[at.y].size)
+    at.x++;
+  for (int i = 0; i < count; i++)
+    editorPutChars(at, r);
+  E->cy = at.y;
+  E->cx = at.x;
+  if (r->n == 1)
+    E->cx += r->rows[0].len * count - (r->rows[0].len > 0);
 }
 
 void editorRowInsertChar(erow *row, int at, int c) {
   if (at < 0 || at > row->size)
     at = row->size; // bounds
-  row->chars =
-      realloc(row->chars, row->size + 2); // the new character + null byte
+  editorRowReserve(row, row->size + 1); // the new character + null byte
   // shift later chars along
   memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
   row->size++;
   row->chars[at] = c;
-  editorUpdateRow(row);
+  editorUpdateRowSpan(row, at, 0, 1);
   E->dirty++;
+  E->edits++;
 }
 
 void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
+  int at = row->size;
+  editorRowReserve(row, row->size + len);
   memcpy(&row->chars[row->size], s, len);
   row->size += len;
   row->chars[row->size] = '\0';
-  editorUpdateRow(row);
+  editorUpdateRowSpan(row, at, 0, len);
   E->dirty++;
+  E->edits++;
 }
 
 void editorRowDelChar(erow *row, int at) {
   if (at < 0 || at >= row->size)
     return;
+  editorRowReserve(row, row->size);
   memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
   row->size--;
-  editorUpdateRow(row);
+  editorUpdateRowSpan(row, at, 1, 0);
   E->dirty++;
+  E->edits++;
 }
 
-void editorJoinLines() {
-  if (E->cy == E->numrows - 1)
-    return;
-  erow *row = &E->row[E->cy];
-  erow *rowBelow = &E->row[E->cy + 1];
-  editorRowAppendString(row, " ", 1);
-  editorRowAppendString(row, rowBelow->chars, rowBelow->size);
-  editorDelRow(E->cy + 1);
+/* Cursors besides the primary one at E->cx, E->cy. An edit made while there
+   are any is applied at all of them in one batch, so each row is re-rendered
+   and re-lexed once however many cursors are on it. */
+struct cursorState {
+  point *at; // sorted by row, then column; never equal to the primary
+  int n, cap;
+  char *word; // what Ctrl-N is looking for
+  int wlen;
+} C;
+
+int cursorCompare(const void *a, const void *b) {
+  const point *p = a, *q = b;
+  return p->y != q->y ? p->y - q->y : p->x - q->x;
 }
 
-void editorInsertChar(int c) {
-  if (E->cy == E->numrows) { // the cursor is on the tilde after the last line
-    editorInsertRow(E->numrows, "", 0);
+/* The index of the first cursor at or after row y, column x. */
+int editorCursorFind(int y, int x) {
+  int lo = 0, hi = C.n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (C.at[mid].y < y || (C.at[mid].y == y && C.at[mid].x < x))
+      lo = mid + 1;
+    else
+      hi = mid;
   }
-  editorRowInsertChar(&E->row[E->cy], E->cx, c);
-  E->cx++;
+  return lo;
 }
 
-void editorInsertNewline() {
-  if (E->cx == 0) {
-    editorInsertRow(E->cy, "", 0);
-  } else {
-    erow *row = &E->row[E->cy];
-    editorInsertRow(E->cy + 1, &row->chars[E->cx], row->size - E->cx);
-    row = &E->row[E->cy];
-    row->size = E->cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+void editorCursorAdd(int y, int x) {
+  int i = editorCursorFind(y, x);
+  if ((i < C.n && C.at[i].y == y && C.at[i].x == x) ||
+      (y == E->cy && x == E->cx))
+    return;
+  if (C.n == C.cap) {
+    C.cap = C.cap ? C.cap * 2 : 16;
+    C.at = realloc(C.at, sizeof(point) * C.cap);
   }
-  E->cy++;
-  E->cx = 0;
+  memmove(&C.at[i + 1], &C.at[i], sizeof(point) * (C.n - i));
+  C.at[i] = (point){y, x};
+  C.n++;
 }
 
-void editorDelChar() {
-  if (E->cy == E->numrows)
-    return;
-  if (E->cx == 0 && E->cy == 0)
-    return;
+void editorCursorsClear() {
+  C.n = 0;
+  free(C.word);
+  C.word = NULL;
+}
 
-  erow *row = &E->row[E->cy];
-  if (E->cx > 0) {
-    editorRowDelChar(row, E->cx - 1);
-    E->cx--;
-  } else {
-    E->cx = E->row[E->cy - 1].size;
-    editorRowAppendString(&E->row[E->cy - 1], row->chars, row->size);
-    editorDelRow(E->cy);
-    E->cy--;
+/* Restore order after the cursors have moved, merging any that meet. */
+void editorCursorsSort() {
+  qsort(C.at, C.n, sizeof(point), cursorCompare);
+  int n = 0;
+  for (int i = 0; i < C.n; i++) {
+    if ((n > 0 && !cursorCompare(&C.at[i], &C.at[n - 1])) ||
+        (C.at[i].y == E->cy && C.at[i].x == E->cx))
+      continue;
+    C.at[n++] = C.at[i];
   }
+  C.n = n;
 }
 
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
+/* Move every cursor as editorMoveCursorCount would move the primary. */
+void editorCursorsMove(int key, int count) {
+  int cx = E->cx, cy = E->cy;
+  for (int i = 0; i < C.n; i++) {
+    E->cx = C.at[i].x;
+    E->cy = C.at[i].y;
+    editorMoveCursorCount(key, count);
+    C.at[i] = (point){E->cy, E->cx};
+  }
+  E->cx = cx;
+  E->cy = cy;
+  editorMoveCursorCount(key, count);
+  editorCursorsSort();
+}
+
+/* At every cursor, replace the before chars to its left and the after chars
+   from it on with s, leaving the cursor just after s. */
+void editorCursorsReplace(int before, int after, const char *s, int len) {
+  int n = C.n + 1;
+  point *all = malloc(sizeof(point) * n);
+  memcpy(all, C.at, sizeof(point) * C.n);
+  all[C.n] = (point){E->cy, E->cx};
+  qsort(all, n, sizeof(point), cursorCompare);
+  int primary = 0;
+  while (all[primary].y != E->cy || all[primary].x != E->cx)
+    primary++;
+
+  char *buf = NULL;
+  int cap = 0;
+  for (int i = 0, j; i < n; i = j) {
+    int y = all[i].y;
+    for (j = i; j < n && all[j].y == y; j++)
+      ;
+    if (y >= E->numrows)
+      continue;
+
+    // build the new row in buf, then copy over everything from the first edit
+    erow *row = &E->row[y];
+    buf = editorReserve(buf, &cap, row->size + (j - i) * len);
+    int pos = 0, out = 0, first = -1;
+    for (int k = i; k < j; k++) {
+      int start = all[k].x - before < pos ? pos : all[k].x - before;
+      int end = all[k].x + after > row->size ? row->size : all[k].x + after;
+      if (end < start)
+        end = start;
+      if (first == -1)
+        first = start;
+      memcpy(&buf[out], &row->chars[pos], start - pos);
+      out += start - pos;
+      memcpy(&buf[out], s, len);
+      out += len;
+      if (k == primary)
+        E->cx = out;
+      all[k].x = out;
+      pos = end;
+    }
+    int tail = row->size - pos;
+    memcpy(&buf[out], &row->chars[pos], tail);
+    out += tail;
+    int removed = row->size - first - tail, inserted = out - first - tail;
+    if (removed == 0 && inserted == 0)
+      continue;
+    editorRowReserve(row, out);
+    memcpy(&row->chars[first], &buf[first], inserted + tail);
+    row->size = out;
+    row->chars[out] = '\0';
+    editorUpdateRowSpan(row, first, removed, inserted);
+  }
+  free(buf);
+
+  C.n = 0;
+  for (int i = 0; i < n; i++) {
+    if (i != primary)
+      C.at[C.n++] = all[i];
+  }
+  free(all);
+  editorCursorsSort(); // deletions can bring cursors together
+  E->dirty++;
+  E->edits++;
+}
+
+/* Add a cursor at the next match of the word under the cursor, and make it
+   the primary one. */
+void editorCursorAddNext() {
+  if (E->cy >= E->numrows)
+    return;
+  erow *row = &E->row[E->cy];
+  if (C.word == NULL) {
+    int start = E->cx, end = E->cx;
+    while (start > 0 && !is_separator(row->chars[start - 1]))
+      start--;
+    while (end < row->size && !is_separator(row->chars[end]))
+      end++;
+    if (start == end) {
+      message("No word under the cursor");
+      return;
+    }
+    C.word = strndup(&row->chars[start], end - start);
+    C.wlen = end - start;
+    E->cx = start;
+  }
+
+  // search on from the primary cursor, wrapping around to it again
+  for (int i = 0; i <= E->numrows; i++) {
+    int y = (E->cy + i) % E->numrows;
+    row = &E->row[y];
+    int from = i == 0 ? E->cx + 1 : 0;
+    char *p = &row->chars[from < row->size ? from : row->size];
+    while ((p = memmem(p, &row->chars[row->size] - p, C.word, C.wlen))) {
+      int x = p - row->chars;
+      p++;
+      if ((x > 0 && !is_separator(row->chars[x - 1])) ||
+          (x + C.wlen < row->size && !is_separator(row->chars[x + C.wlen])))
+        continue; // only part of a word
+      if (i == E->numrows && x >= E->cx)
+        break;
+      int k = editorCursorFind(y, x);
+      if ((k < C.n && C.at[k].y == y && C.at[k].x == x) ||
+          (y == E->cy && x == E->cx)) {
+        message("No more matches for %s", C.word);
+        return;
+      }
+      int oy = E->cy, ox = E->cx;
+      E->cy = y;
+      E->cx = x;
+      editorCursorAdd(oy, ox);
+      return;
+    }
+  }
+  message("No more matches for %s", C.word);
+}
+
+/* Put a cursor on each of lines start to end, in the current column. */
+void editorCursorsRange(int start, int end) {
+  int cx = E->cx;
+  editorCursorsClear();
+  E->cy = start;
+  for (int y = start; y <= end; y++) {
+    int x = cx < E->row[y].size ? cx : E->row[y].size;
+    if (y == start)
+      E->cx = x;
+    else
+      editorCursorAdd(y, x);
+  }
+}
+
+void editorInsertChar(int c) {
+  if (C.n > 0) {
+    char ch = c;
+    editorCursorsReplace(0, 0, &ch, 1);
+    return;
+  }
+  if (E->cy == E->numrows) { // the cursor is on the tilde after the last line
+    editorInsertRow(E->numrows, "", 0);
+  }
+  editorRowInsertChar(&E->row[E->cy], E->cx, c);
+  E->cx++;
+}
+
+void editorInsertNewline() {
+  if (E->cx == 0) {
+    editorInsertRow(E->cy, "", 0);
+  } else {
+    erow *row = &E->row[E->cy];
+    editorInsertRow(E->cy + 1, &row->chars[E->cx], row->size - E->cx);
+    row = &E->row[E->cy];
+    int removed = row->size - E->cx;
+    editorRowReserve(row, row->size);
+    row->size = E->cx;
+    row->chars[row->size] = '\0';
+    editorUpdateRowSpan(row, E->cx, removed, 0);
+  }
+  E->cy++;
+  E->cx = 0;
+}
+
+void editorDelChar() {
+  if (C.n > 0) {
+    editorCursorsReplace(1, 0, "", 0); // not across lines
+    return;
+  }
+  if (E->cy == E->numrows)
+    return;
+  if (E->cx == 0 && E->cy == 0)
+    return;
+
+  erow *row = &E->row[E->cy];
+  if (E->cx > 0) {
+    int at = editorRowNextChar(row, E->cx, -1);
+    for (; E->cx > at; E->cx--)
+      editorRowDelChar(row, E->cx - 1);
+  } else {
+    E->cx = E->row[E->cy - 1].size;
+    editorRowAppendString(&E->row[E->cy - 1], row->chars, row->size);
+    editorDelRow(E->cy);
+    E->cy--;
+  }
+}
+
+/* Take an undo step, unless running keys that the caller already took one
+   for: a macro or :g is undone in one go. */
+void editorHistoryPush() {
+  if (!KF.active)
+    E = history_push(E);
+}
+
+/* Make E, a patch of the rows a change made to from, the buffer: it takes
+   from's rows and puts back the text it kept of them, which from keeps in
+   turn to redo the change with. */
+void editorUnpatch(editorConfig *from) {
+  int *patch = E->patch, n = 0;
+  size_t total = 0;
+  for (int i = 0; i < E->npatch; i++)
+    if (patch[2 * i] < from->numrows)
+      total += from->row[patch[2 * i]].size;
+  char *text = E->text, *kept = malloc(total ? total : 1), *k = kept;
+  int *rows = malloc(sizeof(int) * E->npatch + 1);
+  E->row = from->row;
+  E->numrows = from->numrows;
+  from->row = NULL;
+  for (int i = 0; i < E->npatch; i++) {
+    int y = patch[2 * i], size = patch[2 * i + 1];
+    text += size;
+    if (y >= E->numrows) // gone in a change the history missed
+      continue;
+    erow *row = &E->row[y];
+    memcpy(k, row->chars, row->size);
+    k += row->size;
+    patch[2 * n] = y;
+    patch[2 * n + 1] = row->size;
+    editorRowReserve(row, size);
+    memcpy(row->chars, text - size, size);
+    row->size = size;
+    row->chars[size] = '\0';
+    rows[n++] = y;
+  }
+  free(E->text);
+  from->patch = patch;
+  from->npatch = n;
+  from->text = kept;
+  E->patch = NULL;
+  E->npatch = 0;
+  E->text = NULL;
+  editorRelexRows(rows, n);
+  free(rows);
+}
+
+/* Make e the buffer. A snapshot only kept the text of its rows, so they are
+   rebuilt from it. */
+void editorRestore(editorConfig *e) {
+  editorConfig *from = E;
+  e->screenrows = E->screenrows; // the terminal may have changed size since
+  e->screencols = E->screencols;
+  e->edits = E->edits + 1; // the text changed, even if back to what was saved
+  E = e;
+  if (history_patched(E)) {
+    editorUnpatch(from);
+    return;
+  }
+  editorRowsMoved(0);
+  if (!history_packed(E))
+    return;
+  int *sizes = (int *)E->text;
+  char *text = E->text + sizeof(int) * E->numrows;
+  int rows = E->numrows;
+  E->row = malloc(sizeof(erow) * rows);
+  for (E->numrows = 0; E->numrows < rows; E->numrows++) {
+    editorInitRow(&E->row[E->numrows], E->numrows,
+                  textNew(text, sizes[E->numrows]), sizes[E->numrows]);
+    editorUpdateRow(&E->row[E->numrows]);
+    text += sizes[E->numrows];
+  }
+  free(E->text);
+  E->text = NULL;
+}
+
+char *editorRowsToString(int *buflen) {
+  int totlen = 0;
+  int j;
   for (j = 0; j < E->numrows; j++)
     totlen += E->row[j].size + 1; // + 1 for newline
   *buflen = totlen; // so the caller can inspect how long the string is
@@ -644,31 +1509,245 @@ char *editorRowsToString(int *buflen) {
   return buf;
 }
 
-void editorOpen(char *filename) {
+/* :follow keeps reading a file as it grows, like tail -f. */
+struct followState {
+  int on;
+  int ifd;       // inotify instance
+  int wd;        // watch on the file
+  int dirwd;     // watch on its directory, to see a rotated file reappear
+  int fd;        // the file being followed, kept open across a rotation
+  dev_t dev;     // identity of the open file
+  ino_t ino;
+  off_t off;     // bytes of it already in the buffer
+  int open_line; // the last row is still waiting for its newline
+  int rotated;   // the file was replaced; switch once the old one is read
+} F = {0, -1, -1, -1, -1, 0, 0, 0, 0, 0};
+
+#define LINES_MAGIC "BSELIN1"
+#define LINES_VERSION 1
+#define LINES_SAMPLES 16 // blocks hashed to tell whether a file has changed
+
+/* A cached line index: this header, then int64_t index[nindex], then
+   unsigned char comment[nindex]. Everything before lines must match the file
+   being opened. */
+struct lineCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t stride;
+  uint64_t size;
+  uint64_t mtime_sec;
+  uint64_t mtime_nsec;
+  uint64_t sample; // hash of blocks spread through the file
+  uint64_t syntax; // hash of the syntax table the comment states are for
+  int64_t lines;
+  int64_t nindex;
+};
+
+/* Files too big to hold in memory are read-only, and only a window of rows
+   around the cursor is loaded. The byte offset of every BSE_WINDOW_STRIDE-th
+   line is indexed in the background so that any line can be found, then the
+   file is lexed to find which of those lines start inside a multiline
+   comment. Both are kept in a cache file so the next open is instant. */
+struct windowState {
+  int on;
+  int fd;
+  long long first; // the line of the file held in E->row[0]
+  unsigned loads; // bumped whenever the rows are replaced
+  int open;       // the comment state E->row[0] was lexed with
+  pthread_t thread;
+  pthread_mutex_t lock; // guards the index, which the thread is building
+  int64_t *index;       // index[i] is where line i * BSE_WINDOW_STRIDE starts
+  long long nindex;
+  unsigned char *comment; // comment[i]: line i * BSE_WINDOW_STRIDE starts in
+                          // a multiline comment
+  long long ncomment;     // entries of comment known so far
+  long long lines;        // lines indexed so far
+  off_t indexed;          // bytes indexed so far
+  off_t size;
+  int done;                     // the whole file is indexed
+  struct lineCacheHeader cache; // what the cache file must match
+  char cachefile[PATH_MAX];     // or "" for none
+} W = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* Refuse to change a buffer that is only partly loaded. */
+int editorReadOnly() {
+  if (!W.on)
+    return 0;
+  message("Read-only: file is too big to edit");
+  return 1;
+}
+
+/* Load filename, already open as fd, into the empty buffer. */
+void editorLoad(char *filename, int fd) {
   free(E->filename);
   E->filename = strdup(filename); // copies the given string to new memory loc.
 
   editorSelectSyntaxHighlight();
 
-  FILE *fp = fopen(filename, "r");
+  struct stat st;
+  if (W.on || (fstat(fd, &st) == 0 && st.st_size >= BSE_WINDOW_MIN)) {
+    editorWindowOpen(filename, fd);
+    return;
+  }
+
+  FILE *fp = fdopen(fd, "r");
   if (!fp)
-    die("fopen");
+    die("fdopen");
 
   char *line = NULL;
   size_t linecap = 0;
   ssize_t linelen;
+  F.open_line = 0;
   while ((linelen = getline(&line, &linecap, fp)) != -1) { // iterate over lines
+    F.open_line = line[linelen - 1] != '\n';
     while (linelen > 0 &&
            (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
       linelen--;
     editorInsertRow(E->numrows, line, linelen);
   }
+  F.off = ftello(fp); // where :follow picks up from
   free(line);
   fclose(fp);
   E->dirty = 0;
 }
 
+void editorOpen(char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    die("open");
+  editorLoad(filename, fd);
+}
+
+/* Append raw file contents to the end of the buffer. A line without its
+   newline yet stays open, and the next call carries on appending to it. The
+   view stays on the last row unless the user has moved away from it. */
+void editorAppendBytes(const char *buf, int len, int *open_line) {
+  int pinned = E->numrows > 0 && E->cy >= E->numrows - 1;
+  int dirty = E->dirty; // appended text is the file's, not an edit
+  while (len > 0) {
+    const char *nl = memchr(buf, '\n', len);
+    int n = nl ? nl - buf : len;
+    if (*open_line && E->numrows > 0) {
+      erow *row = &E->row[E->numrows - 1];
+      if (n > 0)
+        editorRowAppendString(row, (char *)buf, n);
+      if (nl && row->size > 0 && row->chars[row->size - 1] == '\r')
+        editorRowDelChar(row, row->size - 1);
+    } else {
+      editorInsertRow(E->numrows, (char *)buf,
+                      nl && n > 0 && buf[n - 1] == '\r' ? n - 1 : n);
+    }
+    *open_line = nl == NULL;
+    if (nl)
+      n++;
+    buf += n;
+    len -= n;
+  }
+  E->dirty = dirty;
+  if (pinned && E->cy < E->numrows - 1) {
+    E->cy = E->numrows - 1;
+    E->cx = 0;
+  }
+}
+
+/* State shared between the UI and a background save. The worker only touches
+   the snapshot it was handed; everything else is guarded by lock. */
+struct saveJob {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int running;    // a save is in flight
+  int done;       // the worker has finished and is waiting to be reaped
+  char *filename; // where the snapshot is going
+  char *buf;      // the serialised snapshot of the buffer
+  int len;
+  int written; // bytes written so far
+  int err;     // errno of the failed call, 0 on success
+  int edits;   // value of E->edits when the snapshot was taken
+} SJ = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+int wake_pipe[2] = {-1, -1}; // background jobs poke this to wake the UI
+
+void editorWake() {
+  char c = 0;
+  write(wake_pipe[1], &c, 1);
+}
+
+void *editorSaveThread(void *arg) {
+  (void)arg;
+  int err = 0;
+  int off = 0;
+  int fd = open(SJ.filename, O_RDWR | O_CREAT, 0644);
+  if (fd == -1 || ftruncate(fd, SJ.len) == -1)
+    err = errno;
+  while (!err && off < SJ.len) {
+    int chunk = SJ.len - off;
+    if (chunk > BSE_SAVE_CHUNK)
+      chunk = BSE_SAVE_CHUNK;
+    ssize_t n = write(fd, &SJ.buf[off], chunk);
+    if (n == -1) {
+      if (errno != EINTR)
+        err = errno;
+      continue;
+    }
+    off += n;
+    pthread_mutex_lock(&SJ.lock);
+    SJ.written = off;
+    pthread_mutex_unlock(&SJ.lock);
+    editorWake();
+  }
+  if (fd != -1 && close(fd) == -1 && !err)
+    err = errno;
+
+  pthread_mutex_lock(&SJ.lock);
+  SJ.err = err;
+  SJ.done = 1;
+  pthread_mutex_unlock(&SJ.lock);
+  editorWake();
+  return NULL;
+}
+
+/* Join the worker and report the result. Edits made while it ran keep the
+   buffer dirty. */
+void editorSaveFinish() {
+  pthread_join(SJ.thread, NULL);
+  if (SJ.err) {
+    message("Can't save! I/O error: %s", strerror(SJ.err));
+  } else {
+    if (E->edits == SJ.edits)
+      E->dirty = 0;
+    F.off = SJ.len; // the file is now what was saved
+    F.open_line = 0;
+    message("%d bytes written to disk", SJ.len);
+    tagsUpdate(SJ.filename);
+  }
+  free(SJ.filename);
+  free(SJ.buf);
+  SJ.running = 0;
+  SJ.done = 0;
+}
+
+/* Reap the save if the worker has finished. */
+void editorSaveReap() {
+  if (!SJ.running)
+    return;
+  pthread_mutex_lock(&SJ.lock);
+  int done = SJ.done;
+  pthread_mutex_unlock(&SJ.lock);
+  if (done)
+    editorSaveFinish();
+}
+
+/* Block until any save in flight has hit the disk. */
+void editorSaveWait() {
+  if (SJ.running)
+    editorSaveFinish();
+}
+
+/* Snapshot the buffer and write it out on a background thread. Editing
+   carries on while the write runs; editorSaveReap reports the result. */
 void editorSave() {
+  if (editorReadOnly())
+    return;
   if (E->filename == NULL) {
     E->filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
     if (E->filename == NULL) {
@@ -677,36 +1756,866 @@ void editorSave() {
     }
     editorSelectSyntaxHighlight();
   }
+  if (SJ.running) {
+    message("A save is already in progress");
+    return;
+  }
 
-  int len;
-  char *buf = editorRowsToString(&len);
-
-  int fd = open(E->filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E->dirty = 0;
-        message("%d bytes written to disk", len);
-        return;
+  SJ.buf = editorRowsToString(&SJ.len);
+  SJ.filename = strdup(E->filename);
+  SJ.edits = E->edits;
+  SJ.written = 0;
+  SJ.err = 0;
+  SJ.done = 0;
+  int err = pthread_create(&SJ.thread, NULL, editorSaveThread, NULL);
+  if (err != 0) {
+    free(SJ.buf);
+    free(SJ.filename);
+    message("Can't save! %s", strerror(err));
+    return;
+  }
+  SJ.running = 1;
+}
+
+/* Read whatever has been appended since last time, a bounded amount at once
+   so keys still get through while a burst is loaded. */
+void editorFollowRead() {
+  char *buf = malloc(BSE_READ_CHUNK);
+  ssize_t n = pread(F.fd, buf, BSE_READ_CHUNK, F.off);
+  if (n > 0) {
+    editorAppendBytes(buf, n, &F.open_line);
+    F.off += n;
+    if (n == BSE_READ_CHUNK)
+      editorWake(); // there may be more, come back after the next redraw
+  }
+  free(buf);
+}
+
+/* Replace the buffer with the file as it is now. */
+void editorFollowReload() {
+  int dirty = E->dirty;
+  editorDelRows(0, E->numrows);
+  E->dirty = dirty;
+  E->cx = E->cy = E->rowoff = E->coloff = 0;
+  editorCursorsClear();
+  F.off = 0;
+  F.open_line = 0;
+  editorFollowRead();
+  E->cy = E->numrows > 0 ? E->numrows - 1 : 0;
+}
+
+/* Open E->filename and watch it for changes. */
+int editorFollowOpen() {
+  struct stat st;
+  int fd = open(E->filename, O_RDONLY);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    if (fd != -1)
+      close(fd);
+    return -1;
+  }
+  if (F.fd != -1)
+    close(F.fd);
+  if (F.wd != -1)
+    inotify_rm_watch(F.ifd, F.wd);
+  F.fd = fd;
+  F.dev = st.st_dev;
+  F.ino = st.st_ino;
+  F.wd = inotify_add_watch(F.ifd, E->filename,
+                           IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF |
+                               IN_DELETE_SELF);
+  return 0;
+}
+
+void editorFollowStop() {
+  if (!F.on)
+    return;
+  close(F.ifd); // drops the watches with it
+  close(F.fd);
+  F.ifd = F.wd = F.dirwd = F.fd = -1;
+  F.on = 0;
+  F.rotated = 0;
+}
+
+/* Read what is left of a file that was replaced, a chunk at a time, and then
+   start over on the new one. */
+void editorFollowSwitch() {
+  off_t off = F.off;
+  editorFollowRead();
+  if (F.off - off == BSE_READ_CHUNK)
+    return; // editorFollowRead asked to come back for the rest
+  F.rotated = 0;
+  if (editorFollowOpen() == 0) {
+    editorFollowReload();
+    message("%s was replaced, reloaded", E->filename);
+  }
+}
+
+/* Catch up after inotify reports a change. The events only say that
+   something happened; the file itself says what. */
+void editorFollowPoll() {
+  char events[4096];
+  while (read(F.ifd, events, sizeof(events)) > 0)
+    ;
+
+  struct stat st;
+  if (F.rotated || (stat(E->filename, &st) == 0 &&
+                    (st.st_dev != F.dev || st.st_ino != F.ino))) {
+    F.rotated = 1; // only the wake pipe comes back for the rest of the old
+    editorFollowSwitch();
+    return;
+  }
+  if (fstat(F.fd, &st) == 0 && st.st_size < F.off) {
+    editorFollowReload();
+    message("%s was truncated, reloaded", E->filename);
+    return;
+  }
+  editorFollowRead();
+}
+
+/* A pipe on stdin is read as it arrives, like a pager, while keys come from
+   the terminal. */
+struct streamState {
+  int fd;        // the pipe, -1 once it has been read to the end
+  int open_line; // the last row is still waiting for its newline
+  int keep;      // how many rows to retain, 0 for all of them
+} S = {-1, 0, 0};
+
+/* Read what the pipe has, a bounded amount at once, and drop the oldest rows
+   past the cap. */
+void editorStreamRead() {
+  char *buf = malloc(BSE_READ_CHUNK);
+  ssize_t n = read(S.fd, buf, BSE_READ_CHUNK);
+  if (n > 0) {
+    editorAppendBytes(buf, n, &S.open_line);
+    if (n == BSE_READ_CHUNK)
+      editorWake(); // there may be more, come back after the next redraw
+  } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+    close(S.fd);
+    S.fd = -1;
+    message("End of input");
+  }
+  free(buf);
+
+  if (S.keep > 0 && E->numrows > S.keep) {
+    int drop = E->numrows - S.keep;
+    int dirty = E->dirty;
+    editorDelRows(0, drop);
+    E->dirty = dirty;
+    E->cy = E->cy > drop ? E->cy - drop : 0;
+    E->rowoff = E->rowoff > drop ? E->rowoff - drop : 0;
+    editorCursorsClear();
+  }
+}
+
+/* Take the pipe on stdin for reading and put the terminal in its place. */
+void editorStreamOpen() {
+  S.fd = dup(STDIN_FILENO);
+  int tty = open("/dev/tty", O_RDWR);
+  if (S.fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1)
+    die("/dev/tty");
+  close(tty);
+  fcntl(S.fd, F_SETFL, O_NONBLOCK);
+}
+
+/* Where the line index of the open file is cached, and the header a cache
+   file must have to be used for it. The content is only sampled: hashing all
+   of a file this size would take longer than indexing it. */
+void editorLineCacheKey(const char *filename, struct stat *st) {
+  struct lineCacheHeader *h = &W.cache;
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, LINES_MAGIC, sizeof(h->magic));
+  h->version = LINES_VERSION;
+  h->stride = BSE_WINDOW_STRIDE;
+  h->size = st->st_size;
+  h->mtime_sec = st->st_mtim.tv_sec;
+  h->mtime_nsec = st->st_mtim.tv_nsec;
+  if (E->syntax)
+    h->syntax = cacheHash(E->syntax->table, sizeof(synTable), CACHE_HASH_INIT);
+
+  char buf[4096];
+  uint64_t sample = CACHE_HASH_INIT;
+  for (int i = 0; i <= LINES_SAMPLES; i++) {
+    off_t off = (st->st_size - (off_t)sizeof(buf)) / LINES_SAMPLES * i;
+    ssize_t n = pread(W.fd, buf, sizeof(buf), off > 0 ? off : 0);
+    if (n > 0)
+      sample = cacheHash(buf, n, sample);
+  }
+  h->sample = sample;
+
+  char dir[PATH_MAX], *path = realpath(filename, NULL);
+  W.cachefile[0] = '\0';
+  if (path && cacheDir(dir) == 0) {
+    uint64_t name = cacheHash(path, strlen(path), CACHE_HASH_INIT);
+    if (snprintf(W.cachefile, sizeof(W.cachefile), "%s/lines/%016llx.idx",
+                 dir, (unsigned long long)name) >= PATH_MAX)
+      W.cachefile[0] = '\0';
+  }
+  free(path);
+}
+
+/* Map in the cached index of the open file. Returns -1 if there is none or
+   it is out of date. */
+int editorLineCacheLoad() {
+  int fd = W.cachefile[0] ? open(W.cachefile, O_RDONLY) : -1;
+  if (fd == -1)
+    return -1;
+  struct stat st;
+  struct lineCacheHeader h;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && read(fd, &h, sizeof(h)) == sizeof(h) &&
+      !memcmp(h.magic, W.cache.magic, offsetof(struct lineCacheHeader, lines)) &&
+      h.nindex > 0 &&
+      st.st_size == (off_t)(sizeof(h) + h.nindex * (sizeof(int64_t) + 1)))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  W.index = (int64_t *)((char *)map + sizeof(h));
+  W.nindex = h.nindex;
+  W.comment = (unsigned char *)(W.index + h.nindex);
+  W.ncomment = h.nindex;
+  W.lines = h.lines;
+  W.indexed = W.size;
+  W.done = 1;
+  return 0;
+}
+
+/* Write the finished index out, replacing any old cache atomically. */
+void editorLineCacheSave() {
+  if (!W.cachefile[0])
+    return;
+  char dir[PATH_MAX], tmp[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", W.cachefile);
+  *strrchr(dir, '/') = '\0';
+  cacheMkdirs(dir);
+  if (snprintf(tmp, sizeof(tmp), "%s.%d", W.cachefile, (int)getpid()) >=
+      PATH_MAX)
+    return;
+
+  struct lineCacheHeader h = W.cache;
+  h.lines = W.lines;
+  h.nindex = W.nindex;
+  FILE *fp = fopen(tmp, "w");
+  if (!fp)
+    return;
+  int ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+           fwrite(W.index, sizeof(int64_t), W.nindex, fp) == (size_t)W.nindex &&
+           fwrite(W.comment, 1, W.nindex, fp) == (size_t)W.nindex;
+  if (fclose(fp) == 0 && ok)
+    rename(tmp, W.cachefile);
+  else
+    unlink(tmp);
+}
+
+/* Lex the whole file a line at a time to find the comment state at each
+   indexed line. */
+void editorWindowLexLines() {
+  int fd = dup(W.fd);
+  FILE *fp = fd == -1 ? NULL : fdopen(fd, "r");
+  if (!fp)
+    return;
+  erow row;
+  memset(&row, 0, sizeof(row));
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t len;
+  long long n = 0;
+  lexState st = {0, 0, 1, 0};
+  while (n / BSE_WINDOW_STRIDE < W.nindex &&
+         (len = getline(&line, &linecap, fp)) != -1) {
+    if (n % BSE_WINDOW_STRIDE == 0) {
+      pthread_mutex_lock(&W.lock);
+      W.comment[W.ncomment++] = st.in_comment;
+      pthread_mutex_unlock(&W.lock);
+      if (W.ncomment % 4096 == 0)
+        editorWake(); // the window may be waiting on its state
+    }
+    n++;
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      len--;
+    row.chars = line;
+    row.size = len;
+    editorRenderRow(&row);
+    row.nchunks = 0;
+    editorLex(&row, 0, st, -1);
+    st.in_comment = row.hl_open_comment;
+  }
+  free(line);
+  fclose(fp);
+  editorFreeRow(&row);
+}
+
+void *editorWindowIndexThread(void *arg) {
+  (void)arg;
+  char *buf = malloc(BSE_READ_CHUNK);
+  off_t off = 0;
+  long long lines = 0; // newlines seen
+  int chunks = 0;
+  ssize_t n;
+  while ((n = pread(W.fd, buf, BSE_READ_CHUNK, off)) > 0) {
+    pthread_mutex_lock(&W.lock);
+    for (char *p = buf; (p = memchr(p, '\n', buf + n - p)) != NULL; p++) {
+      if (++lines % BSE_WINDOW_STRIDE == 0) {
+        if ((W.nindex & (W.nindex - 1)) == 0)
+          W.index = realloc(W.index, sizeof(int64_t) * W.nindex * 2);
+        W.index[W.nindex++] = off + (p - buf) + 1;
       }
     }
-    close(fd);
+    off += n;
+    W.lines = lines;
+    W.indexed = off;
+    pthread_mutex_unlock(&W.lock);
+    if (++chunks % 64 == 0)
+      editorWake(); // show progress
   }
   free(buf);
-  message("Can't save! I/O error: %s", strerror(errno));
+
+  pthread_mutex_lock(&W.lock);
+  char last;
+  if (off > 0 && pread(W.fd, &last, 1, off - 1) == 1 && last != '\n')
+    lines++; // the last line has no newline
+  W.lines = lines;
+  W.done = 1;
+  W.comment = calloc(W.nindex, 1);
+  pthread_mutex_unlock(&W.lock);
+  editorWake();
+
+  if (E->syntax)
+    editorWindowLexLines();
+  pthread_mutex_lock(&W.lock);
+  W.ncomment = W.nindex;
+  pthread_mutex_unlock(&W.lock);
+  editorLineCacheSave();
+  editorWake();
+  return NULL;
+}
+
+/* Whether the first row of the window starts inside a multiline comment, as
+   far as is known yet. */
+int editorWindowOpenComment() {
+  if (!W.on)
+    return 0;
+  long long i = W.first / BSE_WINDOW_STRIDE;
+  pthread_mutex_lock(&W.lock);
+  W.open = W.first % BSE_WINDOW_STRIDE == 0 && i < W.ncomment && W.comment[i];
+  pthread_mutex_unlock(&W.lock);
+  return W.open;
+}
+
+/* Where line n starts, or -1 if the index hasn't got that far yet. */
+off_t editorWindowLineOffset(long long n) {
+  pthread_mutex_lock(&W.lock);
+  long long i = n / BSE_WINDOW_STRIDE;
+  off_t off = i < W.nindex && n <= W.lines ? W.index[i] : -1;
+  pthread_mutex_unlock(&W.lock);
+  if (off == -1)
+    return -1;
+
+  char buf[65536];
+  int skip = n % BSE_WINDOW_STRIDE;
+  while (skip > 0) {
+    ssize_t len = pread(W.fd, buf, sizeof(buf), off);
+    if (len <= 0)
+      return -1;
+    char *p = buf;
+    while (skip > 0 && (p = memchr(p, '\n', buf + len - p)) != NULL) {
+      p++;
+      skip--;
+    }
+    off += skip > 0 ? len : p - buf;
+  }
+  return off;
+}
+
+/* The line that the byte at off is on. off must be indexed already. */
+long long editorWindowLineAt(off_t off) {
+  pthread_mutex_lock(&W.lock);
+  long long lo = 0, hi = W.nindex - 1; // the last entry at or before off
+  while (lo < hi) {
+    long long mid = (lo + hi + 1) / 2;
+    if (W.index[mid] <= off)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  off_t pos = W.index[lo];
+  long long line = lo * BSE_WINDOW_STRIDE;
+  pthread_mutex_unlock(&W.lock);
+
+  char buf[65536];
+  while (pos < off) {
+    ssize_t len = pread(W.fd, buf, sizeof(buf), pos);
+    if (len <= 0)
+      break;
+    if (len > off - pos)
+      len = off - pos;
+    for (char *p = buf; (p = memchr(p, '\n', buf + len - p)) != NULL; p++)
+      line++;
+    pos += len;
+  }
+  return line;
+}
+
+/* Replace the rows with the window starting at line first. */
+void editorWindowLoad(long long first) {
+  off_t off = editorWindowLineOffset(first);
+  if (off == -1)
+    return;
+  int dirty = E->dirty;
+  editorDelRows(0, E->numrows);
+  W.first = first;
+  char *buf = malloc(BSE_READ_CHUNK / 16);
+  int open_line = 0;
+  ssize_t n;
+  while (E->numrows <= BSE_WINDOW_ROWS &&
+         (n = pread(W.fd, buf, BSE_READ_CHUNK / 16, off)) > 0) {
+    editorAppendBytes(buf, n, &open_line);
+    off += n;
+  }
+  free(buf);
+  if (E->numrows > BSE_WINDOW_ROWS)
+    editorDelRows(BSE_WINDOW_ROWS, E->numrows - BSE_WINDOW_ROWS);
+  E->dirty = dirty;
+  W.loads++;
+}
+
+/* Make sure line n of the file is loaded, keeping a margin of rows on either
+   side of it so the view can move a while before the window does. */
+void editorWindowShow(long long n) {
+  int margin = BSE_WINDOW_ROWS / 4;
+  pthread_mutex_lock(&W.lock);
+  long long lines = W.lines;
+  pthread_mutex_unlock(&W.lock);
+  long long end = W.first + E->numrows;
+  if ((n >= W.first + margin || W.first == 0) &&
+      (n < end - margin || end >= lines))
+    return;
+
+  long long first = n - BSE_WINDOW_ROWS / 2;
+  if (first > lines - BSE_WINDOW_ROWS)
+    first = lines - BSE_WINDOW_ROWS;
+  first -= first % BSE_WINDOW_STRIDE; // where the comment state is known
+  if (first < 0)
+    first = 0;
+  long long top = W.first + E->rowoff;
+  long long old = W.first;
+  editorWindowLoad(first);
+  E->cy += old - W.first;
+  E->rowoff = top > W.first ? top - W.first : 0;
+}
+
+/* Follow the cursor as it moves about the window, and relex once the
+   comment state at its top is known. */
+void editorWindowScroll() {
+  if (E->cy < E->numrows)
+    editorWindowShow(W.first + E->cy);
+  int open = W.open;
+  if (E->numrows > 0 && E->syntax && editorWindowOpenComment() != open)
+    editorUpdateSyntax(&E->row[0]);
+}
+
+/* Search the indexed part of the file for query, forwards from after line
+   from or backwards from before it, wrapping at the ends. Returns the line
+   of the match or -1. */
+long long editorWindowSearch(char *query, long long from, int direction) {
+  int qlen = strlen(query);
+  if (qlen == 0)
+    return -1;
+  pthread_mutex_lock(&W.lock);
+  off_t indexed = W.indexed;
+  pthread_mutex_unlock(&W.lock);
+  off_t start = editorWindowLineOffset(direction == 1 ? from + 1 : from);
+  if (start == -1)
+    start = direction == 1 ? indexed : 0;
+
+  // forwards: [start, end) then [0, start); backwards: the last match in
+  // [0, start) then in [start, end)
+  off_t ranges[2][2] = {{start, indexed}, {0, start}};
+  if (direction == -1) {
+    ranges[0][0] = 0;
+    ranges[0][1] = start;
+    ranges[1][0] = start;
+    ranges[1][1] = indexed;
+  }
+
+  char *buf = malloc(BSE_READ_CHUNK);
+  off_t hit = -1;
+  for (int r = 0; r < 2 && hit == -1; r++) {
+    off_t off = ranges[r][0];
+    while (off < ranges[r][1]) {
+      off_t want = ranges[r][1] - off;
+      if (want > BSE_READ_CHUNK)
+        want = BSE_READ_CHUNK;
+      ssize_t len = pread(W.fd, buf, want, off);
+      if (len < qlen)
+        break;
+      char *p = buf;
+      while ((p = memmem(p, buf + len - p, query, qlen)) != NULL) {
+        hit = off + (p - buf);
+        if (direction == 1)
+          break;
+        p++;
+      }
+      if (hit != -1 && direction == 1)
+        break;
+      // let a match straddle the chunk boundary
+      off += len == want && off + len < ranges[r][1] ? len - qlen + 1 : len;
+    }
+  }
+  free(buf);
+  return hit == -1 ? -1 : editorWindowLineAt(hit);
+}
+
+void editorWindowOpen(char *filename, int fd) {
+  struct stat st;
+  W.fd = fd;
+  if (fstat(W.fd, &st) == -1)
+    die("fstat");
+  W.on = 1;
+  W.size = st.st_size;
+  editorLineCacheKey(filename, &st);
+  if (editorLineCacheLoad() == -1) {
+    W.index = malloc(sizeof(int64_t));
+    W.index[0] = 0;
+    W.nindex = 1;
+    if (pthread_create(&W.thread, NULL, editorWindowIndexThread, NULL) != 0)
+      die("pthread_create");
+  }
+
+  editorWindowLoad(0); // line 0 is always in the index
+}
+
+/* Put the cursor at the start of line n of the file, counting from 0. */
+void editorGotoLine(long long n) {
+  if (W.on) {
+    editorWindowShow(n);
+    n -= W.first;
+  }
+  if (n >= E->numrows)
+    n = E->numrows - 1;
+  if (n < 0)
+    n = 0;
+  E->cy = n;
+  E->cx = 0;
+}
+
+/* The number of lines in the file, as far as is known. */
+long long editorLines() {
+  if (!W.on)
+    return E->numrows;
+  pthread_mutex_lock(&W.lock);
+  long long lines = W.lines;
+  pthread_mutex_unlock(&W.lock);
+  return lines;
+}
+
+/* Free the undo and redo states, which only make sense for the file they
+   were taken of. */
+void editorDropHistory() {
+  for (int dir = 0; dir < 2; dir++) {
+    editorConfig *e = dir ? E->redo : E->undo;
+    while (e) {
+      editorConfig *next = dir ? e->redo : e->undo;
+      history_free(e);
+      e = next;
+    }
+  }
+  E->undo = NULL;
+  E->redo = NULL;
+}
+
+/* Whether path names the file in the buffer, however it is spelt. */
+int editorIsFile(const char *path) {
+  struct stat a, b;
+  if (!E->filename)
+    return 0;
+  if (strcmp(path, E->filename) == 0)
+    return 1;
+  return stat(path, &a) == 0 && stat(E->filename, &b) == 0 &&
+         a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+/* Replace the buffer with filename, if no changes would be lost. */
+int editorSwitchFile(char *filename) {
+  if (E->dirty) {
+    message("No write since last change");
+    return -1;
+  }
+  if (W.on || F.on || S.fd != -1) {
+    message("Can't leave a file that is still being read");
+    return -1;
+  }
+  // Opened before the buffer is dropped, so a file that has gone away
+  // leaves it as it was.
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    message("Can't open %s: %s", filename, strerror(errno));
+    return -1;
+  }
+  editorSaveWait();
+  editorDropHistory();
+  editorCursorsClear();
+  for (int j = 0; j < E->numrows; j++)
+    editorFreeRow(&E->row[j]);
+  free(E->row);
+  E->row = NULL;
+  E->numrows = 0;
+  E->cx = E->cy = E->rowoff = E->coloff = 0;
+  editorRowsMoved(0);
+  editorLoad(filename, fd);
+  return 0;
+}
+
+/* The places the last tag looked up is defined, and which one is shown. */
+struct tagJump {
+  char *name;
+  tagMatch *m;
+  int n, i;
+} TJ;
+
+/* Go to the i-th place the last tag is defined, with the cursor on its
+   name. */
+void editorTagGo(int i) {
+  tagMatch *m = &TJ.m[i];
+  if (!editorIsFile(m->file) && editorSwitchFile(m->file) == -1)
+    return;
+  TJ.i = i;
+  editorGotoLine(m->line);
+  if (E->cy < E->numrows) {
+    char *at = strstr(E->row[E->cy].chars, TJ.name);
+    E->cx = at ? at - E->row[E->cy].chars : 0;
+  }
+  if (TJ.n > 1)
+    message("tag %d of %d", i + 1, TJ.n);
+}
+
+/* :tag name and Ctrl-] jump to where name is defined. */
+void editorTag(const char *name) {
+  tagsFree(TJ.m, TJ.n);
+  free(TJ.name);
+  TJ.name = strdup(name);
+  TJ.n = tagsFind(name, E->filename, &TJ.m);
+  if (TJ.n == 0) {
+    message(tagsIndexing() ? "tag not found: %s (still indexing)"
+                           : "tag not found: %s",
+            name);
+    return;
+  }
+  editorTagGo(0);
+}
+
+void editorTagUnderCursor() {
+  if (E->cy >= E->numrows)
+    return;
+  erow *row = &E->row[E->cy];
+  int start = E->cx, end = E->cx;
+  while (start > 0 && !is_separator(row->chars[start - 1]))
+    start--;
+  while (end < row->size && !is_separator(row->chars[end]))
+    end++;
+  if (start == end) {
+    message("No word under the cursor");
+    return;
+  }
+  char *name = strndup(&row->chars[start], end - start);
+  editorTag(name);
+  free(name);
+}
+
+/* :tn and :tp go to the next and previous place the last tag is defined. */
+void editorTagNext(int dir) {
+  if (TJ.n == 0)
+    message("No tag to go to");
+  else
+    editorTagGo((TJ.i + dir + TJ.n) % TJ.n);
+}
+
+/* Where :cn and :cp are in the matches of the last :grep. */
+int grepAt = -1;
+
+void editorGrepGo(int i) {
+  int done, n = grepCount(&done);
+  grepMatch m = grepGet(i);
+  if (!editorIsFile(m.file) && editorSwitchFile((char *)m.file) == -1)
+    return;
+  grepAt = i;
+  editorGotoLine(m.line);
+  if (E->cy < E->numrows && m.col <= E->row[E->cy].size)
+    E->cx = m.col;
+  message("(%d of %d%s) %s", i + 1, n, done ? "" : "+", m.text);
+}
+
+/* :cn and :cp go to the next and previous match. The list can still be
+   growing, so they stop at the ends rather than wrap. */
+void editorGrepNext(int dir) {
+  int done, n = grepCount(&done);
+  if (n == 0)
+    message(done ? "No matches" : "No matches yet");
+  else if (grepAt + dir < 0 || grepAt + dir >= n)
+    message(dir > 0 ? "No more matches%s" : "No earlier matches%s",
+            done ? "" : " yet");
+  else
+    editorGrepGo(grepAt + dir);
+}
+
+/* :grep pattern [dir] searches the files under dir, or the working
+   directory, in the background. */
+void editorGrep(char *args) {
+  char *dir = ".", *sp = strrchr(args, ' ');
+  struct stat st;
+  if (sp && stat(sp + 1, &st) == 0 && S_ISDIR(st.st_mode)) {
+    *sp = '\0';
+    dir = sp + 1;
+  }
+  if (grepStart(args, dir) == -1) {
+    message("Invalid pattern");
+    return;
+  }
+  grepAt = -1;
+  message("Searching for %s (:cn for the matches, ESC to stop)", args);
+}
+
+/* If set, editorPrompt calls back with -1 when no key comes for a while, so
+   the callback can show what has changed in the background since. */
+int promptIdle;
+
+#define PICKER_ROWS 10 // most files the picker lists
+
+/* The files the picker lists, best last, which is nearest the prompt. */
+struct filePicker {
+  int on;
+  int best[PICKER_ROWS];
+  int nbest, matches;
+  int sel;  // the one Enter opens, counting from best
+  int seen; // paths in the index when it was last matched
+} PK;
+
+void editorFindFileCallback(char *query, int key) {
+  int done, n = finderCount(&done);
+  promptIdle = !done;
+  if (key == ARROW_UP || key == CTRL_KEY('p')) {
+    if (PK.sel + 1 < PK.nbest)
+      PK.sel++;
+    return;
+  }
+  if (key == ARROW_DOWN || key == CTRL_KEY('n')) {
+    if (PK.sel > 0)
+      PK.sel--;
+    return;
+  }
+  if (key == '\r' || key == '\x1b' || (key == -1 && n == PK.seen))
+    return;
+  int rows = E->screenrows - 2 < PICKER_ROWS ? E->screenrows - 2 : PICKER_ROWS;
+  PK.nbest = finderMatch(query, PK.best, rows > 0 ? rows : 1, &PK.matches);
+  PK.seen = n;
+  if (key != -1 || PK.sel >= PK.nbest) // keep the selection while indexing
+    PK.sel = 0;
+}
+
+/* <leader>f opens a file under the working directory picked by typing
+   letters from its path. */
+void editorFindFile() {
+  finderStart();
+  PK.on = 1;
+  PK.sel = 0;
+  PK.seen = -1;
+  editorFindFileCallback("", 0);
+  char *query = editorPrompt("Find file: %s (ESC/Arrows/Enter)",
+                             editorFindFileCallback);
+  promptIdle = 0;
+  PK.on = 0;
+  if (query) {
+    if (PK.nbest == 0)
+      message("No file matches %s", query);
+    else
+      editorSwitchFile((char *)finderPath(PK.best[PK.sel]));
+    free(query);
+  }
+}
+
+/* Draw row i of the picker, over the bottom of the file: the number of files
+   that match, then the best of them. */
+void editorDrawPicker(struct abuf *ab, int i) {
+  char buf[80];
+  if (i == 0) {
+    int done, n = finderCount(&done);
+    int len = snprintf(buf, sizeof(buf), "  %d/%d files%s", PK.matches, n,
+                       done ? "" : " (indexing)");
+    abAppend(ab, TERM_WHITE_BRIGHT, 5);
+    abAppend(ab, buf, len > E->screencols ? E->screencols : len);
+    abAppend(ab, TERM_RESET, 3);
+    return;
+  }
+  int k = PK.nbest - i;
+  const char *path = finderPath(PK.best[k]);
+  int len = strlen(path);
+  if (len > E->screencols - 2)
+    len = E->screencols - 2;
+  if (k == PK.sel)
+    abAppend(ab, TERM_INVERT, 4);
+  abAppend(ab, k == PK.sel ? "> " : "  ", 2);
+  abAppend(ab, path, len > 0 ? len : 0);
+  abAppend(ab, TERM_RESET, 3);
+}
+
+/* :follow toggles tailing the file. */
+void editorFollow() {
+  if (F.on) {
+    editorFollowStop();
+    message("Stopped following");
+    return;
+  }
+  if (E->filename == NULL) {
+    message("No file to follow");
+    return;
+  }
+  if (W.on) {
+    message("Can't follow a file opened as a window");
+    return;
+  }
+  F.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (F.ifd == -1) {
+    message("Can't follow: %s", strerror(errno));
+    return;
+  }
+  off_t off = F.off;
+  if (editorFollowOpen() == -1) {
+    message("Can't follow: %s", strerror(errno));
+    close(F.ifd);
+    F.ifd = -1;
+    return;
+  }
+  char dir[PATH_MAX];
+  char *slash = strrchr(E->filename, '/');
+  if (slash == NULL)
+    strcpy(dir, ".");
+  else
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash - E->filename + 1),
+             E->filename);
+  F.dirwd = inotify_add_watch(F.ifd, dir, IN_CREATE | IN_MOVED_TO);
+  F.on = 1;
+  F.off = off;
+
+  // jump to the end and pick up anything written since the file was opened
+  E->cy = E->numrows > 0 ? E->numrows - 1 : 0;
+  E->cx = 0;
+  editorFollowPoll();
+  message("Following %s", E->filename);
 }
 
 void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
+  static long long last_match = -1;
   static int direction = 1;
 
   static int saved_hl_line;
   static char *saved_hl = NULL;
+  static unsigned saved_hl_loads; // the row is gone if the window moved
 
   if (saved_hl) {
-    memcpy(E->row[saved_hl_line].hl, saved_hl, E->row[saved_hl_line].rsize);
+    if (saved_hl_loads == W.loads)
+      memcpy(E->row[saved_hl_line].hl, saved_hl,
+             E->row[saved_hl_line].rsize);
     free(saved_hl);
     saved_hl = NULL;
   }
@@ -726,11 +2635,34 @@ void editorFindCallback(char *query, int key) {
 
   if (last_match == -1)
     direction = 1;
-  int current = last_match;
+  // last_match counts from the start of the file, the window may have moved
+  int current = last_match == -1 ? -1 : last_match - W.first;
+  int tries = E->numrows;
+  if (W.on) {
+    tries++; // to step off the end of the window
+    if (current == -1 && W.first > 0) {
+      // a new search starts at the top of the file, which isn't loaded
+      long long line = editorWindowSearch(query, -1, 1);
+      if (line == -1)
+        return;
+      editorWindowShow(line);
+      current = line - W.first - 1;
+    }
+  }
   int i;
-  for (i = 0; i < E->numrows; i++) {
+  for (i = 0; i < tries; i++) {
     current += direction;
 
+    if (W.on && (current == -1 || current == E->numrows)) {
+      // search the rest of the file and bring the match into the window
+      long long line = editorWindowSearch(
+          query, W.first + current - direction, direction);
+      if (line == -1)
+        break;
+      editorWindowShow(line);
+      current = line - W.first;
+    }
+
     // loops around the file
     if (current == -1)
       current = E->numrows - 1;
@@ -740,12 +2672,13 @@ void editorFindCallback(char *query, int key) {
     erow *row = &E->row[current];
     char *match = strstr(row->render, query);
     if (match) {
-      last_match = current;
+      last_match = W.first + current;
       E->cy = current;
       E->cx = editorRowRxToCx(row, match - row->render);
       E->rowoff = E->numrows;
 
       saved_hl_line = current;
+      saved_hl_loads = W.loads;
       saved_hl = malloc(row->rsize);
       memcpy(saved_hl, row->hl, row->rsize);
       memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
@@ -754,67 +2687,999 @@ void editorFindCallback(char *query, int key) {
   }
 }
 
-void editorFind() {
-  int saved_cx = E->cx;
-  int saved_cy = E->cy;
-  int saved_coloff = E->coloff;
-  int saved_rowoff = E->rowoff;
+void editorFind() {
+  int saved_cx = E->cx;
+  int saved_cy = E->cy;
+  int saved_coloff = E->coloff;
+  int saved_rowoff = E->rowoff;
+
+  char *query =
+      editorPrompt("Search: %s (ESC/Arrows/Enter)", editorFindCallback);
+  if (query) {
+    free(query);
+  } else { // NULL query means they pressed ESC.
+    E->cx = saved_cx;
+    E->cy = saved_cy;
+    E->coloff = saved_coloff;
+    E->rowoff = saved_rowoff;
+  }
+}
+
+/* The identifier * or # last looked for, highlighted wherever it is on
+   screen until Esc. */
+struct starSearch {
+  int on;
+  int word; // its number in the identifier index
+  const char *s;
+  int len;
+} ST;
+
+/* Whether the identifier * looked for is at column rx of row, as code. */
+int editorStarAt(erow *row, int rx) {
+  if (rx + ST.len > row->rsize || memcmp(&row->render[rx], ST.s, ST.len))
+    return 0;
+  unsigned char hl = row->hl[rx];
+  return (rx == 0 || !identChar(row->render[rx - 1])) &&
+         (rx + ST.len == row->rsize || !identChar(row->render[rx + ST.len])) &&
+         hl != HL_STRING && hl != HL_COMMENT && hl != HL_MLCOMMENT;
+}
+
+/* The column of the first place in row y the identifier is in after rx going
+   in direction dir, or -1. */
+int editorStarInRow(int y, int rx, int dir) {
+  erow *row = &E->row[y];
+  for (rx += dir; rx >= 0 && rx < row->rsize; rx += dir)
+    if (editorStarAt(row, rx))
+      return rx;
+  return -1;
+}
+
+/* Go count places on from the cursor that the identifier is in, going in
+   direction dir: along the cursor's row, then to the rows the index has it
+   in. */
+void editorStarGo(int dir, int count) {
+  int y = E->cy, rx = editorRowCxToRx(&E->row[y], E->cx);
+  while (count-- > 0) {
+    int at = editorStarInRow(y, rx, dir), rows = identRows(E, ST.word);
+    for (; at == -1 && rows >= 0; rows--) {
+      y = identNextRow(E, ST.word, y, dir);
+      if (y == -1)
+        break;
+      at = editorStarInRow(y, dir > 0 ? -1 : E->row[y].rsize, dir);
+    }
+    if (at == -1) {
+      message("%s is no longer in the file", ST.s);
+      return;
+    }
+    rx = at;
+  }
+  E->cy = y;
+  E->cx = editorRowRxToCx(&E->row[y], rx);
+  message("%s%s (%d lines)", dir > 0 ? "*" : "#", ST.s, identRows(E, ST.word));
+}
+
+/* * and # go to the next and previous place the identifier under the cursor
+   is, outside strings and comments, and highlight it everywhere. */
+void editorStar(int dir, int count) {
+  if (E->cy >= E->numrows)
+    return;
+  editorLexFlush(); // rows are only indexed once they are highlighted
+  erow *row = &E->row[E->cy];
+  int start = E->cx, end = E->cx;
+  while (start > 0 && identChar(row->chars[start - 1]))
+    start--;
+  while (end < row->size && identChar(row->chars[end]))
+    end++;
+  int word = start < end ? identFind(&row->chars[start], end - start) : -1;
+  if (word == -1 || identRows(E, word) == 0) {
+    message("No identifier under the cursor");
+    return;
+  }
+  ST.on = 1;
+  ST.word = word;
+  ST.s = identWord(word);
+  ST.len = end - start;
+  E->cx = start; // so the first place found is the next one
+  editorStarGo(dir, count ? count : 1);
+}
+
+/* n and N go on to the next place, in the same or the other direction. */
+void editorStarNext(int dir, int count) {
+  if (!ST.on || E->cy >= E->numrows) {
+    message("No identifier to look for");
+    return;
+  }
+  editorLexFlush();
+  editorStarGo(dir, count ? count : 1);
+}
+
+#define BSE_COMPLETIONS 1000 // most words offered to complete one
+
+/* Ctrl-X Ctrl-N and Ctrl-X Ctrl-P in insert mode complete the identifier
+   before the cursor with the first or last that starts with it in the
+   buffer. More Ctrl-N and Ctrl-P go through the others. */
+void editorComplete(int dir) {
+  if (E->cy >= E->numrows)
+    return;
+  if (C.n > 0) {
+    message("Can't complete with several cursors");
+    return;
+  }
+  editorLexFlush();
+  erow *row = &E->row[E->cy];
+  int start = E->cx;
+  while (start > 0 && identChar(row->chars[start - 1]))
+    start--;
+  int len = E->cx - start;
+  if (len == 0 || (row->chars[start] >= '0' && row->chars[start] <= '9')) {
+    message("No identifier to complete");
+    return;
+  }
+  int *words = malloc(sizeof(int) * BSE_COMPLETIONS);
+  int n = identComplete(E, &row->chars[start], len, words, BSE_COMPLETIONS);
+  if (n == 0) {
+    message("No completions");
+    free(words);
+    return;
+  }
+  int i = dir > 0 ? 0 : n - 1;
+  for (;;) {
+    while (E->cx > start + len)
+      editorDelChar();
+    for (const char *c = identWord(words[i]) + len; *c; c++)
+      editorInsertChar(*c);
+    message("completion %d of %d", i + 1, n);
+    editorRefreshIfIdle();
+    int c = editorReadKey(0);
+    if (c == CTRL_KEY('n'))
+      i = (i + 1) % n;
+    else if (c == CTRL_KEY('p'))
+      i = (i + n - 1) % n;
+    else {
+      editorUnreadKey(c); // the word stays, and the key does what it does
+      break;
+    }
+  }
+  free(words);
+}
+
+void editorQuit() {
+  editorSaveWait(); // don't lose a save that is still being written
+  write(STDOUT_FILENO, TERM_CLEAR_SCREEN, 4);        // clear screen
+  write(STDOUT_FILENO, TERM_MOVE_CURSOR_DEFAULT, 3); // reposition cursor
+  exit(0);
+}
+
+/* Parse a line address: a number, "." for the cursor line or "$" for the
+   last, then any +n or -n offsets. Lines count from 0. */
+int editorParseAddress(char **p, long long *line) {
+  char *s = *p;
+  if (*s == '.' || *s == '+' || *s == '-') {
+    *line = W.first + E->cy;
+    s += *s == '.';
+  } else if (*s == '$') {
+    *line = editorLines() - 1;
+    s++;
+  } else if (isdigit((unsigned char)*s)) {
+    *line = strtoll(s, &s, 10) - 1;
+  } else {
+    return 0;
+  }
+  while (*s == '+' || *s == '-') {
+    int sign = *s++ == '+' ? 1 : -1;
+    *line += sign * (isdigit((unsigned char)*s) ? strtoll(s, &s, 10) : 1);
+  }
+  *p = s;
+  return 1;
+}
+
+/* Parse the range an ex command can start with: "%" for every line, or one
+   or two addresses separated by ",". Without one it is the cursor line.
+   Returns how many addresses were given, or -1 if the range is malformed. */
+int editorParseRange(char **p, long long *start, long long *end) {
+  int n = 0;
+  *start = *end = W.first + E->cy;
+  if (**p == '%') {
+    (*p)++;
+    *start = 0;
+    *end = editorLines() - 1;
+    n = 2;
+  } else if (editorParseAddress(p, start)) {
+    *end = *start;
+    n = 1;
+    if (**p == ',') {
+      (*p)++;
+      if (!editorParseAddress(p, end))
+        return -1;
+      n = 2;
+    }
+  }
+  if (*start > *end) {
+    long long t = *start;
+    *start = *end;
+    *end = t;
+  }
+  return n;
+}
+
+/* The row of the buffer that line of the file is in. A line far outside the
+   buffer stays outside it rather than wrapping around into it. */
+int editorLineRow(long long line) {
+  line -= W.first;
+  return line < -1 ? -1 : line > E->numrows ? E->numrows : line;
+}
+
+/* Whether lines start to end are all in the buffer. */
+int editorRangeValid(int start, int end) {
+  if (start >= 0 && end < E->numrows)
+    return 1;
+  message("Invalid range");
+  return 0;
+}
+
+int editorPatternCompile(struct pattern *pat, char *s, int cflags) {
+  pat->s = s;
+  pat->len = strlen(s);
+  pat->literal = !cflags && !strpbrk(s, ".[]*^$\\");
+  if (pat->len == 0)
+    return -1;
+  if (!pat->literal && regcomp(&pat->re, s, cflags) != 0)
+    return -1;
+  return 0;
+}
+
+void editorPatternFree(struct pattern *pat) {
+  if (!pat->literal)
+    regfree(&pat->re);
+}
+
+/* Find the first match in chars[from, len), with m holding offsets into
+   chars. Only m[0] is set for a plain string. */
+int editorPatternMatch(struct pattern *pat, const char *chars, int len,
+                       int from, regmatch_t *m) {
+  if (pat->literal) {
+    const char *p = memmem(chars + from, len - from, pat->s, pat->len);
+    if (p == NULL)
+      return 0;
+    m[0].rm_so = p - chars;
+    m[0].rm_eo = m[0].rm_so + pat->len;
+    return 1;
+  }
+  if (from > len ||
+      regexec(&pat->re, chars + from, 10, m, from > 0 ? REG_NOTBOL : 0) != 0)
+    return 0;
+  for (int i = 0; i < 10 && m[i].rm_so != -1; i++) {
+    m[i].rm_so += from;
+    m[i].rm_eo += from;
+  }
+  return 1;
+}
+
+/* Cut the next delim-terminated field of an ex command out of *p in place,
+   taking a backslash before delim as part of the field, and step past it. */
+char *editorExField(char **p, char delim) {
+  char *field = *p, *in = *p, *out = *p;
+  while (*in && *in != delim) {
+    if (in[0] == '\\' && in[1] == delim)
+      in++;
+    else if (in[0] == '\\' && in[1])
+      *out++ = *in++;
+    *out++ = *in++;
+  }
+  int found = *in == delim;
+  *out = '\0';
+  *p = found ? in + 1 : out;
+  return field;
+}
+
+/* A parsed :s command. */
+struct substitute {
+  struct pattern pat;
+  char *rep;
+  int global; // every match on a line, not just the first
+};
+
+/* Parse "s/pat/rep/flags" from cmd. Any punctuation can stand in for "/". */
+int editorSubstParse(char *cmd, struct substitute *sub) {
+  memset(sub, 0, sizeof(*sub));
+  if (cmd[0] != 's')
+    return -1;
+  char delim = cmd[1];
+  if (!ispunct((unsigned char)delim) || delim == '\\')
+    return -1;
+  char *p = cmd + 2;
+  char *pat = editorExField(&p, delim);
+  sub->rep = editorExField(&p, delim); // none deletes the matches
+  int cflags = 0;
+  for (; *p; p++) {
+    if (*p == 'g')
+      sub->global = 1;
+    else if (*p == 'i')
+      cflags |= REG_ICASE;
+    else
+      return -1;
+  }
+  return editorPatternCompile(&sub->pat, pat, cflags);
+}
+
+/* Build the row with the matches replaced in *buf. Returns the number of
+   replacements, leaving the new length in *len. */
+int editorSubstRow(struct substitute *sub, erow *row, char **buf, int *cap,
+                   int *len) {
+  regmatch_t m[10];
+  int from = 0, out = 0, count = 0;
+  while (from <= row->size &&
+         editorPatternMatch(&sub->pat, row->chars, row->size, from, m)) {
+    int so = m[0].rm_so, eo = m[0].rm_eo;
+    *buf = editorReserve(*buf, cap, out + (so - from));
+    memcpy(*buf + out, row->chars + from, so - from);
+    out += so - from;
+    for (char *r = sub->rep; *r; r++) {
+      int gs = -1, ge = -1;
+      if (*r == '&') {
+        gs = so;
+        ge = eo;
+      } else if (r[0] == '\\' && isdigit((unsigned char)r[1])) {
+        int g = *++r - '0';
+        if (sub->pat.literal || m[g].rm_so == -1)
+          continue;
+        gs = m[g].rm_so;
+        ge = m[g].rm_eo;
+      } else if (r[0] == '\\' && r[1]) {
+        r++;
+      }
+      int n = gs == -1 ? 1 : ge - gs;
+      *buf = editorReserve(*buf, cap, out + n);
+      memcpy(*buf + out, gs == -1 ? r : row->chars + gs, n);
+      out += n;
+    }
+    count++;
+    from = eo;
+    if (so == eo) { // an empty match: step over a char so the next can't be
+      if (from < row->size) {
+        *buf = editorReserve(*buf, cap, out + 1);
+        (*buf)[out++] = row->chars[from];
+      }
+      from++;
+    }
+    if (!sub->global)
+      break;
+  }
+  if (count == 0)
+    return 0;
+  if (from < row->size) {
+    *buf = editorReserve(*buf, cap, out + row->size - from);
+    memcpy(*buf + out, row->chars + from, row->size - from);
+    out += row->size - from;
+  }
+  *len = out;
+  return count;
+}
+
+/* :[range]s/pat/rep/[g]. With marked, only the rows :g picked out are
+   changed, and :g has already taken the undo snapshot. */
+void editorSubstitute(char *cmd, int start, int end, int marked) {
+  struct substitute sub;
+  if (editorSubstParse(cmd, &sub) == -1) {
+    message("Bad substitute: %s", cmd);
+    return;
+  }
+  if (editorReadOnly() || !editorRangeValid(start, end)) {
+    editorPatternFree(&sub.pat);
+    return;
+  }
+
+  // One undo step for the lot, which only keeps the rows it changes: the
+  // index and old size of each in patch, and their old chars in old.
+  editorCursorsClear();
+  int push = !marked && !KF.active;
+  int *rows = NULL, nrows = 0, count = 0, *patch = NULL;
+  char *buf = NULL, *old = NULL;
+  int cap = 0, len, oldlen = 0, oldcap = 0;
+  for (int y = start; y <= end; y++) {
+    erow *row = &E->row[y];
+    if (marked && !row->marked)
+      continue;
+    int n = editorSubstRow(&sub, row, &buf, &cap, &len);
+    if (n == 0)
+      continue;
+    if (push) {
+      if ((nrows & (nrows - 1)) == 0)
+        patch = realloc(patch, sizeof(int) * 2 * (nrows ? nrows * 2 : 1));
+      patch[2 * nrows] = y;
+      patch[2 * nrows + 1] = row->size;
+      old = editorReserve(old, &oldcap, oldlen + row->size);
+      memcpy(old + oldlen, row->chars, row->size);
+      oldlen += row->size;
+    }
+    editorRowReserve(row, len);
+    memcpy(row->chars, buf, len);
+    row->size = len;
+    row->chars[len] = '\0';
+    if ((nrows & (nrows - 1)) == 0)
+      rows = realloc(rows, sizeof(int) * (nrows ? nrows * 2 : 1));
+    rows[nrows++] = y;
+    count += n;
+  }
+  free(buf);
+  editorPatternFree(&sub.pat);
+  if (nrows && push) {
+    E = history_push_rows(E, patch, nrows, old);
+  } else {
+    free(patch);
+    free(old);
+  }
+
+  editorRelexRows(rows, nrows);
+  if (nrows == 0) {
+    message("Pattern not found: %s", sub.pat.s);
+  } else {
+    E->cy = rows[nrows - 1];
+    E->cx = 0;
+    E->dirty++;
+    E->edits++;
+    message("%d substitution%s on %d line%s", count, count == 1 ? "" : "s",
+            nrows, nrows == 1 ? "" : "s");
+  }
+  free(rows);
+}
+
+/* Delete the marked rows in one pass, moving the others down over the gaps
+   and renumbering them as it goes. Only the rows that end up just after a
+   gap can need relexing. Returns how many were deleted. */
+int editorDelMarkedRows() {
+  int n = 0, *gaps = NULL, ngaps = 0, gap = 0;
+  for (int y = 0; y < E->numrows; y++) {
+    erow *row = &E->row[y];
+    if (row->marked) {
+      editorFreeRow(row);
+      gap = 1;
+      continue;
+    }
+    if (gap) {
+      if ((ngaps & (ngaps - 1)) == 0)
+        gaps = realloc(gaps, sizeof(int) * (ngaps ? ngaps * 2 : 1));
+      gaps[ngaps++] = n;
+      gap = 0;
+    }
+    E->row[n] = *row;
+    E->row[n].idx = n;
+    n++;
+  }
+  int deleted = E->numrows - n;
+  E->numrows = n;
+  if (deleted)
+    editorRowsMoved(ngaps ? gaps[0] : n); // where the first was deleted
+  editorRelexRows(gaps, ngaps);
+  free(gaps);
+  if (deleted) {
+    E->dirty++;
+    E->edits++;
+  }
+  return deleted;
+}
+
+/* Run keys in normal mode on each marked row in turn. The keys may add or
+   delete rows, which carry their marks with them. */
+void editorGlobalNormal(const char *keys) {
+  int y = 0;
+  editorLexDefer(); // for the lot, not each row
+  while (1) {
+    while (y < E->numrows && !E->row[y].marked)
+      y++;
+    if (y >= E->numrows)
+      break;
+    E->row[y].marked = 0;
+    E->cy = y;
+    E->cx = 0;
+    int rows = E->numrows;
+    editorRunKeys(keys, strlen(keys), 1);
+    if (E->numrows < rows) // the next mark may have moved up past y
+      y = y > rows - E->numrows ? y - (rows - E->numrows) : 0;
+  }
+  editorLexResume();
+}
+
+/* :[range]g/pat/cmd runs cmd on every line in range that matches pat, and
+   :v/pat/cmd (or :g!) on every line that doesn't. The lines are all marked
+   first, then cmd is run over the marks: d, s/pat/rep/ or normal keys. */
+void editorGlobal(char *cmd, int start, int end) {
+  int invert = cmd[0] == 'v';
+  char *p = cmd + 1;
+  if (cmd[0] == 'g' && *p == '!') {
+    invert = 1;
+    p++;
+  }
+  char delim = *p++;
+  struct pattern pat;
+  char *s = editorExField(&p, delim);
+  if (delim == '\\' || editorPatternCompile(&pat, s, 0) == -1) {
+    message("Bad pattern: %s", s);
+    return;
+  }
+  if (editorReadOnly() || !editorRangeValid(start, end)) {
+    editorPatternFree(&pat);
+    return;
+  }
+
+  regmatch_t m[10];
+  int count = 0, first = -1;
+  for (int y = start; y <= end; y++) {
+    erow *row = &E->row[y];
+    row->marked = editorPatternMatch(&pat, row->chars, row->size, 0, m) != invert;
+    if (row->marked && first == -1)
+      first = y;
+    count += row->marked;
+  }
+  editorPatternFree(&pat);
+  if (count == 0) {
+    message("Pattern not found: %s", s);
+    return;
+  }
+
+  // one undo step for the lot
+  editorCursorsClear();
+  editorHistoryPush();
+  while (*p == ' ')
+    p++;
+  if (strcmp(p, "d") == 0) {
+    editorDelMarkedRows();
+    E->cy = first < E->numrows ? first : E->numrows > 0 ? E->numrows - 1 : 0;
+    E->cx = 0;
+    message("%d fewer lines", count);
+  } else if (p[0] == 's' && ispunct((unsigned char)p[1])) {
+    editorSubstitute(p, start, end, 1);
+  } else if (!strncmp(p, "normal ", 7) || !strncmp(p, "norm ", 5)) {
+    editorGlobalNormal(strchr(p, ' ') + 1);
+  } else {
+    message("Not supported with :g: %s", p);
+  }
+  for (int y = 0; y < E->numrows; y++)
+    E->row[y].marked = 0;
+}
+
+/* While a :s command is typed, highlight what it would replace on the rows
+   on screen. */
+void editorColonPreview(char *query, int key) {
+  static unsigned char **saved = NULL; // the highlighting of each screen row
+  static int saved_first, saved_n;
+  static unsigned saved_loads;
+
+  if (saved) {
+    for (int i = 0; i < saved_n; i++) {
+      erow *row = &E->row[saved_first + i];
+      if (saved[i] && saved_loads == W.loads && saved_first + i < E->numrows)
+        memcpy(row->hl, saved[i], row->rsize);
+      free(saved[i]);
+    }
+    free(saved);
+    saved = NULL;
+  }
+  if (key == '\r' || key == '\x1b')
+    return;
+
+  char *cmd = strdup(query), *p = cmd;
+  long long from, to;
+  struct substitute sub;
+  if (editorParseRange(&p, &from, &to) == -1 ||
+      editorSubstParse(p, &sub) == -1) {
+    free(cmd);
+    return;
+  }
+  int start = editorLineRow(from), end = editorLineRow(to);
+  saved_first = E->rowoff > start ? E->rowoff : start;
+  int last = E->rowoff + E->screenrows - 1;
+  if (last > end)
+    last = end;
+  if (last >= E->numrows)
+    last = E->numrows - 1;
+  saved_n = last - saved_first + 1;
+  saved_loads = W.loads;
+  if (saved_n > 0) {
+    saved = calloc(saved_n, sizeof(unsigned char *));
+    for (int y = saved_first; y <= last; y++) {
+      erow *row = &E->row[y];
+      regmatch_t m[10];
+      for (int from = 0; from <= row->size &&
+                         editorPatternMatch(&sub.pat, row->chars, row->size, from, m);
+           from = m[0].rm_eo + (m[0].rm_so == m[0].rm_eo)) {
+        if (!saved[y - saved_first]) {
+          saved[y - saved_first] = malloc(row->rsize);
+          memcpy(saved[y - saved_first], row->hl, row->rsize);
+        }
+        int rs = editorRowCxToRx(row, m[0].rm_so);
+        int re = editorRowCxToRx(row, m[0].rm_eo);
+        memset(&row->hl[rs], HL_MATCH, re - rs);
+        if (!sub.global)
+          break;
+      }
+    }
+  }
+  editorPatternFree(&sub.pat);
+  free(cmd);
+}
+
+/* :d, :y, :>, :<, :j and :pu over a range, each one undo step. Returns 0 if
+   cmd isn't one of them. */
+int editorRangeCommand(char *cmd, int naddr, int start, int end) {
+  int op, name = 0;
+  char *arg = strchr(cmd, ' '); // :d, :y and :pu can take a register
+  if (arg) {
+    if (arg[1] == '\0' || arg[2] != '\0' ||
+        (name = editorRegisterIndex(arg[1])) == -1)
+      return 0;
+    *arg = '\0';
+  }
+  if (!strcmp(cmd, "d") || !strcmp(cmd, "delete"))
+    op = 'd';
+  else if (!strcmp(cmd, "y") || !strcmp(cmd, "yank"))
+    op = 'y';
+  else if (!strcmp(cmd, ">") || !strcmp(cmd, "<"))
+    op = cmd[0];
+  else if (!strcmp(cmd, "j") || !strcmp(cmd, "join"))
+    op = 'j';
+  else if (!strcmp(cmd, "pu") || !strcmp(cmd, "put"))
+    op = 'p';
+  else if (!strcmp(cmd, "pu!") || !strcmp(cmd, "put!"))
+    op = 'P';
+  else
+    op = 0;
+  if (arg && (op == 0 || strchr("><j", op)))
+    op = 0;
+  if (arg)
+    *arg = ' ';
+  if (op == 0)
+    return 0;
+  if (op == 'j' && naddr < 2) // the line and the one after it
+    end = start + 1;
+  if (!editorRangeValid(start, end) || (op != 'y' && editorReadOnly()))
+    return 1;
+  regName = name;
+  int n = end - start + 1;
+  if (op == 'y') {
+    editorYankRows(start, n);
+    message("%d lines yanked", n);
+    return 1;
+  }
+  if ((op == 'p' || op == 'P') && Reg[regName].n == 0) {
+    regName = 0;
+    message("Nothing to put");
+    return 1;
+  }
+  editorCursorsClear(); // rows are about to move under the extra cursors
+  editorHistoryPush();
+  E->cx = 0;
+  switch (op) {
+  case 'd':
+    editorYankRows(start, n);
+    editorDelRows(start, n);
+    E->cy = start < E->numrows ? start : (E->numrows > 0 ? E->numrows - 1 : 0);
+    message("%d fewer lines", n);
+    break;
+  case '>':
+  case '<':
+    editorIndentRows(start, n, op == '>' ? 1 : -1);
+    E->cy = end;
+    break;
+  case 'j':
+    editorJoinRows(start, n);
+    E->cy = start;
+    break;
+  case 'p':
+  case 'P':
+    E->cy = end + (op == 'p');
+    E->cy += editorPutRows(E->cy, 1) - 1;
+    break;
+  }
+  return 1;
+}
+
+/* Lines of the row at the top of the screen that are scrolled off above it,
+   when long rows are wrapped. */
+int rowskip;
+
+void editorSetWrap(int on) {
+  wrapSet(on ? E->screencols : 0);
+  rowskip = 0;
+}
+
+volatile sig_atomic_t resized; // the terminal changed size
 
-  char *query =
-      editorPrompt("Search: %s (ESC/Arrows/Enter)", editorFindCallback);
-  if (query) {
-    free(query);
-  } else { // NULL query means they pressed ESC.
-    E->cx = saved_cx;
-    E->cy = saved_cy;
-    E->coloff = saved_coloff;
-    E->rowoff = saved_rowoff;
-  }
+void editorHandleResize(int sig) {
+  (void)sig;
+  resized = 1;
+  editorWake();
 }
 
-void editorQuit() {
-  write(STDOUT_FILENO, TERM_CLEAR_SCREEN, 4);        // clear screen
-  write(STDOUT_FILENO, TERM_MOVE_CURSOR_DEFAULT, 3); // reposition cursor
-  exit(0);
+/* Take the new size of the terminal, and wrap at the new width. */
+void editorResize() {
+  resized = 0;
+  int rows, cols;
+  if (getWindowSize(&rows, &cols) == -1 || rows < 3)
+    return;
+  E->screenrows = rows - 2; // For the status bar and message bar
+  E->screencols = cols;
+  if (wrapCols())
+    wrapSet(cols);
 }
 
 void editorColon() {
-  char *query = editorPrompt(":%s", NULL);
+  char *query = editorPrompt(":%s", editorColonPreview);
   if (query) {
-    if (strcmp(query, "q!") == 0) {
+    char *cmd = query;
+    long long first, last;
+    int naddr = editorParseRange(&cmd, &first, &last);
+    int start = editorLineRow(first), end = editorLineRow(last);
+    if (naddr == -1) {
+      message("Invalid range");
+    } else if (naddr > 0 && *cmd == '\0') {
+      editorGotoLine(last);
+    } else if (strcmp(cmd, "cursors") == 0) {
+      if (!editorReadOnly() && editorRangeValid(start, end))
+        editorCursorsRange(start, end);
+    } else if (editorRangeCommand(cmd, naddr, start, end)) {
+      ; // done
+    } else if (cmd[0] == 's' && ispunct((unsigned char)cmd[1])) {
+      editorSubstitute(cmd, start, end, 0);
+    } else if ((cmd[0] == 'g' || cmd[0] == 'v') &&
+               (ispunct((unsigned char)cmd[1]))) {
+      if (naddr == 0) { // the whole file by default
+        start = 0;
+        end = E->numrows - 1;
+      }
+      editorGlobal(cmd, start, end);
+    } else if (strcmp(query, "q!") == 0) {
       editorQuit();
     } else if (strcmp(query, "wq") == 0) {
       editorSave();
       editorQuit();
+    } else if (strcmp(query, "follow") == 0) {
+      editorFollow();
+    } else if (strcmp(query, "set wrap") == 0) {
+      editorSetWrap(1);
+    } else if (strcmp(query, "set nowrap") == 0) {
+      editorSetWrap(0);
+    } else if (!strncmp(query, "grep ", 5)) {
+      editorGrep(query + 5);
+    } else if (strcmp(query, "cn") == 0 || strcmp(query, "cnext") == 0) {
+      editorGrepNext(1);
+    } else if (strcmp(query, "cp") == 0 || strcmp(query, "cprevious") == 0) {
+      editorGrepNext(-1);
+    } else if (!strncmp(query, "e ", 2)) {
+      editorSwitchFile(query + 2);
+    } else if (!strncmp(query, "tag ", 4) || !strncmp(query, "ta ", 3)) {
+      editorTag(strchr(query, ' ') + 1);
+    } else if (strcmp(query, "tn") == 0 || strcmp(query, "tnext") == 0) {
+      editorTagNext(1);
+    } else if (strcmp(query, "tp") == 0 || strcmp(query, "tprevious") == 0) {
+      editorTagNext(-1);
     }
     free(query);
   }
 }
 
+/* Bring the screen line the cursor is on into view, when wrapping. Positions
+   are in screen lines from the top of the buffer, from the prefix sums in
+   wrap.c. */
+void editorScrollWrapped() {
+  E->coloff = 0;
+  if (E->rowoff > E->numrows)
+    E->rowoff = E->numrows;
+  int start = wrapLinesBefore(E, E->cy); // where the cursor's row starts
+  int line = start;
+  if (E->cy < E->numrows)
+    line += wrapLineOf(&E->row[E->cy], E->rx);
+  int top = wrapLinesBefore(E, E->rowoff) + rowskip;
+  if (line < top) // show all of the row if it fits
+    top = line - start < E->screenrows ? start : line;
+  if (line >= top + E->screenrows)
+    top = line - E->screenrows + 1;
+  E->rowoff = wrapRowAt(E, top, &rowskip);
+  if (rowskip > 0 && E->rowoff < E->cy) { // start with a whole row if it can
+    E->rowoff++;
+    rowskip = 0;
+  }
+}
+
 void editorScroll() {
+  if (W.on)
+    editorWindowScroll();
   E->rx = 0;
   if (E->cy < E->numrows) {
     E->rx = editorRowCxToRx(&E->row[E->cy], E->cx);
   }
+  if (wrapCols()) {
+    editorScrollWrapped();
+    return;
+  }
   if (E->cy < E->rowoff) { // is the cursor above the visible window?
     E->rowoff = E->cy;
   }
   if (E->cy >= E->rowoff + E->screenrows) {
     E->rowoff = E->cy - E->screenrows + 1;
   }
-  if (E->rx < E->coloff) {
-    E->coloff = E->rx;
+  int col = 0, w = 1; // the cursor's column, and how wide what it is on is
+  if (E->cy < E->numrows) {
+    erow *row = &E->row[E->cy];
+    col = utf8Column(row, E->rx);
+    if (E->rx < row->rsize)
+      w = utf8Column(row, utf8Rx(row, col + 1)) - col;
+  }
+  if (col < E->coloff) {
+    E->coloff = col;
+  }
+  if (col + w > E->coloff + E->screencols) {
+    E->coloff = col + w - E->screencols;
+  }
+}
+
+/* Where on screen the first cursor from *k on that is on row y and not
+   before render column from is drawn, or -1. */
+int editorCursorColumn(int *k, int y, int from) {
+  for (; *k < C.n && C.at[*k].y == y; (*k)++) {
+    int rx = editorRowCxToRx(&E->row[y], C.at[*k].x) - from;
+    if (rx >= 0)
+      return rx;
+  }
+  return -1;
+}
+
+/* The bracket pair around the cursor, underlined when drawn: the rows and
+   render columns of the two, if showPair is set. */
+int showPair, pairAt[4];
+
+int editorPairAt(int filerow, int rx) {
+  return showPair && ((filerow == pairAt[0] && rx == pairAt[1]) ||
+                      (filerow == pairAt[2] && rx == pairAt[3]));
+}
+
+/* The symbol a control character or a byte that isn't UTF-8 is drawn as, or
+   0 if the character at s can be drawn as it is. */
+char editorSymbol(const char *s, int len) {
+  unsigned char b = s[0];
+  if (b < 0x80)
+    return iscntrl(b) ? (b <= 26 ? '@' + b : '?') : 0;
+  int cp;
+  utf8Decode(s, len, &cp);
+  return cp < 0xA0 ? '?' : 0;
+}
+
+/* The bytes of the character at render byte rx of row, with any marks on
+   it, going no further than end. */
+int editorCharLen(erow *row, int rx, int end) {
+  int n = 1;
+  while (row->cols && rx + n < end && row->cols[rx + n] == row->cols[rx])
+    n++;
+  return n;
+}
+
+/* Draw len bytes of the render of row filerow, from byte from on. A run of
+   characters in one colour is copied in one go; only a change of colour, a
+   cursor, a bracket of the pair or a character drawn as a symbol ends one.
+   The escape sequences come ready made, and everything is written straight
+   into ab, which is grown once up front. */
+void editorDrawRow(struct abuf *ab, int filerow, int from, int len) {
+  erow *row = &E->row[filerow];
+  char *c = &row->render[from];
+  unsigned char *hl = &row->hl[from];
+  int color = HL_NORMAL; // what the terminal is drawing in
+  int k = editorCursorFind(filerow, 0);
+  int next = editorCursorColumn(&k, filerow, from); // the next cursor to show
+  int star = ST.on && identRowHas(row, ST.word), starEnd = 0, starAt = -1;
+  for (int rx = from - ST.len + 1; star && rx < from; rx++)
+    if (rx >= 0 && editorStarAt(row, rx)) // one cut off on the left
+      starEnd = rx + ST.len;
+  if (star)
+    starAt = editorStarInRow(filerow, from - 1, 1);
+
+  // A byte can take a colour, a cursor, an underline, a symbol and a reset.
+  int most = 32 * len + 16;
+  abReserve(ab, most);
+  if (ab->len + most > ab->cap)
+    return;
+  char *o = &ab->b[ab->len];
+
+  int j = 0;
+  while (j < len) {
+    int rx = from + j;
+    if (rx == starAt) {
+      starEnd = rx + ST.len;
+      starAt = editorStarInRow(filerow, starEnd - 1, 1);
+    }
+    int h = rx < starEnd ? HL_MATCH : hl[j];
+    if (h != color) {
+      memcpy(o, hlColors[h].s, sizeof(hlColors[h].s));
+      o += hlColors[h].len;
+      color = h;
+    }
+
+    unsigned char b = c[j];
+    int n = row->cols ? editorCharLen(row, rx, from + len) : 1;
+    int cursor = next >= j && next < j + n, pair = editorPairAt(filerow, rx);
+    char sym = b >= 0x20 && b < 0x7f ? 0 : editorSymbol(&c[j], n);
+    if (cursor || pair || sym) {
+      if (cursor) {
+        memcpy(o, TERM_INVERT, 4);
+        o += 4;
+      }
+      if (pair) {
+        memcpy(o, TERM_UNDERLINE, 4);
+        o += 4;
+      }
+      if (sym) {
+        memcpy(o, "\x1b[7m?\x1b[m", 8);
+        o[4] = sym;
+        o += 8;
+      } else {
+        memcpy(o, &c[j], n);
+        o += n;
+      }
+      if (cursor || pair) {
+        memcpy(o, TERM_RESET, 3);
+        o += 3;
+      }
+      color = HL_NORMAL; // both end in a reset
+      if (cursor) {
+        k++;
+        next = editorCursorColumn(&k, filerow, from);
+      }
+      j += n;
+      continue;
+    }
+
+    // Find where the run ends: at the next thing drawn on its own, or where
+    // the colour changes.
+    int limit = len;
+    if (next > j && next < limit)
+      limit = next;
+    if (starAt != -1 && starAt - from < limit)
+      limit = starAt - from;
+    if (rx < starEnd && starEnd - from < limit)
+      limit = starEnd - from;
+    for (int p = 0; showPair && p < 4; p += 2)
+      if (pairAt[p] == filerow && pairAt[p + 1] > rx &&
+          pairAt[p + 1] - from < limit)
+        limit = pairAt[p + 1] - from;
+    int end = j + n;
+    while (end < limit) {
+      b = c[end];
+      if (b < 0x20 || b == 0x7f || (rx >= starEnd && hl[end] != h))
+        break;
+      if (row->cols) {
+        int m = editorCharLen(row, from + end, from + len);
+        if (end + m > limit || editorSymbol(&c[end], m))
+          break;
+        end += m;
+      } else {
+        end++;
+      }
+    }
+    memcpy(o, &c[j], end - j);
+    o += end - j;
+    j = end;
+  }
+  int width = utf8Column(row, from + len) - utf8Column(row, from);
+  if (next == len && from + len == row->rsize && width < E->screencols) {
+    memcpy(o, "\x1b[7m \x1b[m", 8); // a cursor at the end of the line
+    o += 8;
+    color = HL_NORMAL;
   }
-  if (E->rx >= E->coloff + E->screencols) {
-    E->coloff = E->rx - E->screencols + 1;
+  if (color != HL_NORMAL) {
+    memcpy(o, TERM_RESET_FOREGROUND, 5); // reset at end of line
+    o += 5;
   }
+  ab->len = o - ab->b;
 }
 
 void editorDrawRows(struct abuf *ab) {
   int y;
+  int top = E->rowoff, line = rowskip; // the row and line drawn next, wrapping
   for (y = 0; y < E->screenrows; y++) {
-    int filerow = y + E->rowoff;
-    if (filerow >= E->numrows) {
+    int filerow = wrapCols() ? top : y + E->rowoff;
+    int picker = PK.on ? E->screenrows - (PK.nbest + 1) : E->screenrows;
+    if (y >= picker) {
+      editorDrawPicker(ab, y - picker);
+    } else if (filerow >= E->numrows) {
       // Draw things that come after the rows
       if (E->numrows == 0 && y == E->screenrows / 3) {
         char welcome[80];
@@ -834,49 +3699,25 @@ void editorDrawRows(struct abuf *ab) {
       } else {
         abAppend(ab, "~", 1);
       }
-    } else {
-      // Draw the row
-      int len = E->row[filerow].rsize - E->coloff;
-      if (len < 0)
-        len = 0;
-      if (len > E->screencols)
-        len = E->screencols; // Truncate the len
-      char *c = &E->row[filerow].render[E->coloff];
-      unsigned char *hl = &E->row[filerow].hl[E->coloff];
-      int j;
-      const char *current_color =
-          NULL; // keep track of colour to keep number of resets down
-      for (j = 0; j < len; j++) {
-        // control characters
-        if (iscntrl(c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, TERM_INVERT, 4); // invert colours
-          abAppend(ab, &sym, 1);
-          abAppend(ab, TERM_RESET, 3); // reset
-          if (current_color != NULL) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), current_color);
-            abAppend(ab, buf, clen);
-          }
-
-        } else if (hl[j] == HL_NORMAL) {
-          if (current_color != NULL) {
-            abAppend(ab, TERM_RESET_FOREGROUND, 5);
-            current_color = NULL;
-          }
-          abAppend(ab, &c[j], 1);
-        } else {
-          const char *color = editorSyntaxToColor(hl[j]);
-          if (color != current_color) {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), color);
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
-        }
+    } else if (wrapCols()) {
+      erow *row = &E->row[filerow];
+      int from = wrapLineStart(row, line);
+      editorDrawRow(ab, filerow, from, wrapLineStart(row, line + 1) - from);
+      if (++line >= wrapHeight(row)) {
+        top++;
+        line = 0;
       }
-      abAppend(ab, TERM_RESET_FOREGROUND, 5); // reset at end of line
+    } else {
+      // Draw the characters that fit between coloff and the right edge
+      erow *row = &E->row[filerow];
+      int from = utf8Rx(row, E->coloff);
+      int pad = utf8Column(row, from) - E->coloff; // a wide one cut in two
+      if (pad < 0)
+        pad = 0;
+      for (int i = 0; i < pad; i++)
+        abAppend(ab, " ", 1);
+      editorDrawRow(ab, filerow, from,
+                    utf8Fit(row, from, E->screencols - pad) - from);
     }
     abAppend(ab, TERM_CLEAR_ROW, 3); // clear the rest of the row before drawing
     abAppend(ab, "\r\n", 2); // this means there's always an empty row at the
@@ -885,9 +3726,9 @@ void editorDrawRows(struct abuf *ab) {
 }
 
 void editorDrawStatusBar(struct abuf *ab) {
-  abAppend(ab, TERM_WHITE, 4);
+  abAppend(ab, TERM_WHITE, 5);
   abAppend(ab, TERM_INVERT, 4);
-  char status[80], rstatus[80], statusmode[4], statuscolor[5];
+  char status[80], rstatus[80], statusmode[4], statuscolor[8];
 
   switch (E->mode) {
   case MODE_NORMAL:
@@ -904,11 +3745,42 @@ void editorDrawStatusBar(struct abuf *ab) {
   }
 
   int len =
-      snprintf(status, sizeof(status), "%s%04d:%02d  %s  %s %s  %s %s%s",
-               statuscolor, E->cy + 1, E->cx + 1, statusmode, TERM_WHITE_BRIGHT,
+      snprintf(status, sizeof(status), "%s%04lld:%02d  %s  %s %s  %s %s%s",
+               statuscolor, W.first + E->cy + 1, E->cx + 1, statusmode, TERM_WHITE_BRIGHT,
                E->syntax ? E->syntax->filetype : "Fundamental", TERM_WHITE,
                E->filename ? E->filename : "[No file]", E->dirty ? " + " : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), " ");
+  int rlen, grepDone, grepFound = grepCount(&grepDone);
+  int indexing = 0;
+  long long indexed = 0;
+  if (W.on) { // the thread building the index sets these
+    pthread_mutex_lock(&W.lock);
+    indexing = !W.done;
+    indexed = W.indexed;
+    pthread_mutex_unlock(&W.lock);
+  }
+  if (SJ.running) {
+    pthread_mutex_lock(&SJ.lock);
+    long long written = SJ.written;
+    pthread_mutex_unlock(&SJ.lock);
+    rlen = snprintf(rstatus, sizeof(rstatus), "saving %lld%% ",
+                    SJ.len ? written * 100 / SJ.len : 100);
+  } else if (indexing) {
+    rlen = snprintf(rstatus, sizeof(rstatus), "indexing %lld%% ",
+                    W.size ? indexed * 100 / W.size : 100);
+  } else if (F.on) {
+    rlen = snprintf(rstatus, sizeof(rstatus), "following ");
+  } else if (S.fd != -1) {
+    rlen = snprintf(rstatus, sizeof(rstatus), "reading ");
+  } else if (!grepDone) {
+    rlen = snprintf(rstatus, sizeof(rstatus), "grep %d ", grepFound);
+  } else if (Q.on) {
+    rlen = snprintf(rstatus, sizeof(rstatus), "recording @%c ",
+                    Q.reg ? 'a' + Q.reg - 1 : '"');
+  } else if (C.n > 0) {
+    rlen = snprintf(rstatus, sizeof(rstatus), "%d cursors ", C.n + 1);
+  } else {
+    rlen = snprintf(rstatus, sizeof(rstatus), " ");
+  }
   if (len > E->screencols)
     len = E->screencols; // bounds
   abAppend(ab, status, len);
@@ -937,6 +3809,7 @@ void editorDrawMessageBar(struct abuf *ab) {
 
 void editorRefreshScreen() {
   editorScroll();
+  showPair = E->cy < E->numrows && bracketPair(E, E->cy, E->rx, pairAt);
 
   struct abuf ab = ABUF_INIT;
   abAppend(&ab, TERM_HIDE_CURSOR, 6);         // hide cursor
@@ -950,8 +3823,16 @@ void editorRefreshScreen() {
   // The ~[H~ escape sequence moves the cursor to the position given by the
   // coordinates. The +1 is to convert because the terminal uses 1-indexed
   // values.
-  snprintf(buf, sizeof(buf), TERM_MOVE_CURSOR, (E->cy - E->rowoff) + 1,
-           (E->rx - E->coloff) + 1);
+  erow *row = E->cy < E->numrows ? &E->row[E->cy] : NULL;
+  int y = E->cy - E->rowoff, x = (row ? utf8Column(row, E->rx) : 0) - E->coloff;
+  if (wrapCols()) { // count the screen lines down to the cursor's
+    int line = row ? wrapLineOf(row, E->rx) : 0;
+    y = wrapLinesBefore(E, E->cy) + line - wrapLinesBefore(E, E->rowoff) -
+        rowskip;
+    if (row)
+      x = utf8Column(row, E->rx) - utf8Column(row, wrapLineStart(row, line));
+  }
+  snprintf(buf, sizeof(buf), TERM_MOVE_CURSOR, y + 1, x + 1);
   abAppend(&ab, buf, strlen(buf));
 
   abAppend(&ab, TERM_SHOW_CURSOR, 6); // show cursor
@@ -959,6 +3840,47 @@ void editorRefreshScreen() {
   abFree(&ab);
 }
 
+/* Redraw only when no further input is queued. Pasted text and key repeat
+   are applied in one go and drawn once by the main loop. */
+void editorRefreshIfIdle() {
+  if (!editorKeyPending())
+    editorRefreshScreen();
+}
+
+/* Block until a key arrives or a background job wants the screen redrawn.
+   Returns 1 if a key is ready to be read. */
+int editorWaitForInput() {
+  if (unread_key != -1)
+    return 1;
+  struct pollfd fds[4] = {{STDIN_FILENO, POLLIN, 0},
+                          {wake_pipe[0], POLLIN, 0},
+                          {F.ifd, POLLIN, 0}, // these are ignored while -1
+                          {S.fd, POLLIN, 0}};
+  while (poll(fds, 4, -1) == -1) {
+    if (errno != EINTR)
+      die("poll");
+  }
+  if (fds[1].revents & POLLIN) {
+    char drain[64];
+    while (read(wake_pipe[0], drain, sizeof(drain)) > 0)
+      ;
+    if (resized)
+      editorResize();
+    editorSaveReap();
+    if (F.on && F.rotated)
+      editorFollowSwitch();
+    else if (F.on)
+      editorFollowRead();
+    if (S.fd != -1)
+      editorStreamRead();
+  }
+  if (F.on && (fds[2].revents & POLLIN))
+    editorFollowPoll();
+  if (S.fd != -1 && (fds[3].revents & (POLLIN | POLLHUP)))
+    editorStreamRead();
+  return (fds[0].revents & POLLIN) != 0;
+}
+
 void message(const char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
@@ -976,10 +3898,12 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
   while (1) {
     message(prompt, buf);
-    editorRefreshScreen();
+    editorRefreshIfIdle();
 
-    int c = editorReadKey(0);
-    if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+    int c = editorReadKey(promptIdle);
+    if (c == -1) {
+      ; // nothing typed
+    } else if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
       if (buflen != 0)
         buf[--buflen] = '\0';
     } else if (c == '\x1b') {
@@ -1017,7 +3941,7 @@ void editorMoveCursor(int key) {
   case CTRL_KEY('b'):
   case ARROW_LEFT:
     if (E->cx != 0) {
-      E->cx--;
+      E->cx = row ? editorRowNextChar(row, E->cx, -1) : E->cx - 1;
     } else if (E->cy > 0) {
       // Move to the row above
       E->cy--;
@@ -1029,7 +3953,7 @@ void editorMoveCursor(int key) {
   case ARROW_RIGHT:
     if (row &&
         E->cx < row->size) { // limit horizontal scrolling by column width
-      E->cx++;
+      E->cx = editorRowNextChar(row, E->cx, 1);
     } else if (row && E->cx == row->size) {
       // Move to the row below
       E->cy++;
@@ -1051,6 +3975,15 @@ void editorMoveCursor(int key) {
       E->cy++;
     }
     break;
+  case '^':
+  case CTRL_KEY('a'):
+    E->cx = 0;
+    break;
+  case '$':
+  case CTRL_KEY('e'):
+    if (row)
+      E->cx = row->size; // move to end of the line
+    break;
   }
 
   // Limit the cursor to the end of the row. Fixes the case where
@@ -1060,6 +3993,34 @@ void editorMoveCursor(int key) {
   if (E->cx > rowlen) {
     E->cx = rowlen;
   }
+  while (row && editorRowInChar(row, E->cx))
+    E->cx--; // not in the middle of a character
+}
+
+/* editorMoveCursor count times, going straight to the row for up and down. */
+void editorMoveCursorCount(int key, int count) {
+  switch (key) {
+  case 'k':
+  case CTRL_KEY('p'):
+  case ARROW_UP:
+    E->cy = E->cy > count - 1 ? E->cy - (count - 1) : 0;
+    break;
+  case 'j':
+  case CTRL_KEY('n'):
+  case ARROW_DOWN:
+    if (E->cy + count - 1 < E->numrows)
+      E->cy += count - 1;
+    else if (E->numrows > 0)
+      E->cy = E->numrows - 1;
+    break;
+  case '^':
+  case '$':
+    break;
+  default:
+    while (--count > 0)
+      editorMoveCursor(key);
+  }
+  editorMoveCursor(key);
 }
 
 enum charType {
@@ -1161,53 +4122,304 @@ void editorMoveCursorWordBackward() {
       if (E->cy > 0) {
         E->cy--;
         previous_row = &E->row[E->cy];
-        E->cx = previous_row->size - 1;
+        E->cx = previous_row->size > 0 ? previous_row->size - 1 : 0;
       } else {
         E->cx = 0;
+        break; // the start of the file
       }
     }
   }
 }
 
-void processKeyNormalMode_g() {
-  message("g...");
-  editorRefreshScreen(); // display the message
-  int c = editorReadKey(0);
+enum motionKind {
+  MOTION_FAILED = -1,
+  MOTION_NONE,
+  MOTION_CHARS,
+  MOTION_LINES,
+  MOTION_INCLUSIVE
+};
+
+/* Move the cursor by motion c, count times (0 if no count was given). Returns
+   how an operator takes the text moved over: MOTION_CHARS for the chars from
+   the cursor up to where it lands, MOTION_INCLUSIVE for those and the char it
+   lands on, MOTION_LINES for every row in between. */
+int editorMotion(int c, int count) {
+  int n = count ? count : 1;
   switch (c) {
-  case 'g': {
+  case 'h':
+  case 'l':
+  case '$':
+  case '^':
+  case ARROW_LEFT:
+  case ARROW_RIGHT:
+    editorMoveCursorCount(c, n);
+    return MOTION_CHARS;
+  case 'j':
+  case 'k':
+  case ARROW_UP:
+  case ARROW_DOWN:
+    editorMoveCursorCount(c, n);
+    return MOTION_LINES;
+  case '0':
     E->cx = 0;
-    E->cy = 0;
-  }
+    return MOTION_CHARS;
+  case 'w':
+    while (n--)
+      editorMoveCursorWordForward();
+    return MOTION_CHARS;
+  case 'b':
+    while (n--)
+      editorMoveCursorWordBackward();
+    return MOTION_CHARS;
+  case 'W':
+    while (n--) {
+      point p = point_W(*E);
+      E->cx = p.x;
+      E->cy = p.y;
+    }
+    return MOTION_CHARS;
+  case '}': // to the blank row after the paragraph
+    while (n-- && E->cy < E->numrows - 1) {
+      int y = E->cy + 1;
+      while (y < E->numrows - 1 && E->row[y].size == 0)
+        y++;
+      while (y < E->numrows - 1 && E->row[y].size > 0)
+        y++;
+      E->cy = y;
+    }
+    E->cx = E->cy == E->numrows - 1 ? E->row[E->cy].size : 0;
+    return MOTION_CHARS;
+  case '{':
+    while (n-- && E->cy > 0) {
+      int y = E->cy - 1;
+      while (y > 0 && E->row[y].size == 0)
+        y--;
+      while (y > 0 && E->row[y].size > 0)
+        y--;
+      E->cy = y;
+    }
+    E->cx = 0;
+    return MOTION_CHARS;
+  case 'G':
+    editorGotoLine(count ? count - 1 : editorLines() - 1);
+    if (!count && E->cy < E->numrows)
+      E->cx = E->row[E->cy].size;
+    return MOTION_LINES;
+  case 'g': {
+    message("g...");
+    editorRefreshIfIdle(); // display the message
+    int k = editorReadKey(0);
+    if (k != 'g') {
+      message("g%c is undefined", k);
+      return MOTION_FAILED;
+    }
     message("");
-    break;
-  default:
-    message("%c is undefined", c);
+    editorGotoLine(n - 1);
+    return MOTION_LINES;
+  }
+  case CTRL_KEY('f'):
+    E->cy = E->rowoff + E->screenrows * (n + 1) - 1;
+    if (wrapCols()) { // a screenful of wrapped lines
+      int skip, top = wrapLinesBefore(E, E->rowoff) + rowskip;
+      E->cy = wrapRowAt(E, top + E->screenrows * (n + 1) - 1, &skip);
+    }
+    if (E->cy >= E->numrows)
+      E->cy = E->numrows > 0 ? E->numrows - 1 : 0; // cap to end of file
+    editorMoveCursor(0); // keeps cx on the row
+    return MOTION_LINES;
+  case CTRL_KEY('b'):
+    E->cy = E->rowoff - E->screenrows * n;
+    if (wrapCols()) {
+      int skip, top = wrapLinesBefore(E, E->rowoff) + rowskip;
+      E->cy = top > E->screenrows * n
+                  ? wrapRowAt(E, top - E->screenrows * n, &skip)
+                  : 0;
+    }
+    if (E->cy < 0)
+      E->cy = 0;
+    editorMoveCursor(0);
+    return MOTION_LINES;
+  case '%': {
+    if (count > 100)
+      return MOTION_FAILED;
+    if (count) { // to count percent of the way through the file
+      editorGotoLine((count * editorLines() + 99) / 100 - 1);
+      return MOTION_LINES;
+    }
+    if (E->cy >= E->numrows)
+      return MOTION_FAILED;
+    editorLexFlush(); // a macro may have left brackets unindexed
+    erow *row = &E->row[E->cy];
+    int y, rx;
+    if (!bracketMatch(E, E->cy, editorRowCxToRx(row, E->cx), &y, &rx))
+      return MOTION_FAILED;
+    E->cy = y;
+    E->cx = editorRowRxToCx(&E->row[y], rx);
+    return MOTION_INCLUSIVE;
   }
+  }
+  return MOTION_NONE;
 }
 
-// TODO: fix cursor behaviour
-void processKeyNormalMode_d() {
-  message("d...");
-  editorRefreshScreen(); // display the message
+/* Read the count typed before a command, 0 if there is none, and return the
+   key after it. */
+int editorReadCount(int *count) {
   int c = editorReadKey(0);
-  switch (c) {
-  case 'd':
-    editorDelRow(E->cy);
-    message("");
-    break;
-  default:
-    message("%c is undefined", c);
+  for (*count = 0; (c >= '1' && c <= '9') || (*count && c == '0');
+       c = editorReadKey(0)) {
+    if (*count < 10000000)
+      *count = *count * 10 + c - '0';
+  }
+  return c;
+}
+
+/* Apply operator op (d, y, c, > or <) to the chars from a up to b, or with
+   lines to every row from a's to b's. */
+void editorOperate(int op, point a, point b, int lines) {
+  int n = b.y - a.y + 1;
+  if (op == '>' || op == '<') {
+    editorIndentRows(a.y, n, op == '>' ? 1 : -1);
+    return;
+  }
+  E->cy = a.y;
+  E->cx = lines ? 0 : a.x;
+  if (lines) {
+    editorYankRows(a.y, n);
+    if (op == 'd') {
+      editorDelRows(a.y, n);
+      if (E->cy >= E->numrows && E->cy > 0)
+        E->cy = E->numrows - 1;
+    } else if (op == 'c') { // keep one row to type in
+      editorDelRows(a.y + 1, n - 1);
+      editorDelRange((point){a.y, 0}, (point){a.y, E->row[a.y].size});
+    }
+  } else {
+    editorYankRange(a, b);
+    if (op != 'y')
+      editorDelRange(a, b);
+  }
+  if (op == 'c')
+    E->mode = MODE_INSERT;
+}
+
+/* [count]op[count]motion, or op doubled for count whole rows. */
+void processKeyNormalMode_operator(int op, int count) {
+  message("%c...", op);
+  editorRefreshIfIdle(); // display the message
+  int more, c = editorReadCount(&more);
+  if (more)
+    count = (count ? count : 1) * more;
+  message("");
+  if (E->numrows == 0 || editorReadOnly())
+    return;
+  point a = {E->cy, E->cx}, b;
+  int kind = MOTION_LINES;
+  if (c == op) {
+    b.y = E->cy + (count ? count : 1) - 1;
+    if (b.y >= E->numrows)
+      b.y = E->numrows - 1;
+    b.x = 0;
+  } else {
+    kind = editorMotion(c, count);
+    b = (point){E->cy, E->cx};
+    E->cy = a.y;
+    E->cx = a.x;
+    if (kind == MOTION_NONE)
+      message("%c%c is undefined", op, c);
+    if (kind <= MOTION_NONE)
+      return;
+  }
+  if (b.y < a.y || (b.y == a.y && b.x < a.x)) {
+    point t = a;
+    a = b;
+    b = t;
+  }
+  if (kind == MOTION_INCLUSIVE) {
+    if (b.x < E->row[b.y].size)
+      b.x++;
+    kind = MOTION_CHARS;
+  }
+  if (kind == MOTION_CHARS && c == 'w' && b.y > a.y) {
+    // the word moved over last ends its row: stop there, as vim does
+    b.y--;
+    b.x = E->row[b.y].size;
+  }
+  if (kind == MOTION_CHARS && op == 'c' && c == 'w') // cw leaves the space
+    while (b.x > a.x && b.y == a.y && isspace(E->row[b.y].chars[b.x - 1]))
+      b.x--;
+  if (kind == MOTION_CHARS && b.x == 0 && b.y > a.y) {
+    // an exclusive motion to the start of a row stops at the end of the one
+    // before, and takes whole rows if it started before the text of its own
+    b.y--;
+    b.x = E->row[b.y].size;
+    int indent = 0;
+    while (indent < E->row[a.y].size && isspace(E->row[a.y].chars[indent]))
+      indent++;
+    if (a.x <= indent)
+      kind = MOTION_LINES;
+  }
+  editorOperate(op, a, b, kind == MOTION_LINES);
+}
+
+/* q{reg} starts recording keys into a register, and q stops. */
+void processKeyNormalMode_q() {
+  if (Q.on) {
+    Q.on = 0;
+    if (!KF.active)
+      Q.len--; // the q that stopped it, unless a macro ran it
+    slice *keys = malloc(sizeof(slice));
+    *keys = (slice){textNew(Q.keys, Q.len), 0, Q.len};
+    editorRegisterSet(&Reg[Q.reg], keys, 1, 0);
+    return;
+  }
+  int r = editorRegisterIndex(editorReadKey(0));
+  if (r == -1) {
+    message("No such register");
+    return;
+  }
+  Q.on = 1;
+  Q.reg = r;
+  Q.len = 0;
+}
+
+/* [count]@{reg} runs the keys in a register count times, and @@ runs the
+   last one again. It is one undo step, and drawn once at the end. */
+void processKeyNormalMode_at(int count) {
+  int c = editorReadKey(0);
+  int r = c == '@' ? Q.last - 1 : editorRegisterIndex(c);
+  if (r < 0 || Reg[r].n == 0) {
+    message(r < 0 ? "No such register" : "Register %c is empty", c);
+    return;
+  }
+  Q.last = r + 1;
+  // a copy, as the keys could change the register while they run
+  struct editorRegister *reg = &Reg[r];
+  char *keys = NULL;
+  int len = 0, cap = 0;
+  for (int i = 0; i < reg->n; i++) {
+    slice *s = &reg->rows[i];
+    keys = editorReserve(keys, &cap, len + s->len + 1);
+    memcpy(&keys[len], &s->t->chars[s->off], s->len);
+    len += s->len;
+    if (reg->lines || i < reg->n - 1)
+      keys[len++] = '\n';
   }
+  editorHistoryPush();
+  editorRunKeys(keys, len, count);
+  free(keys);
 }
 
 void processKeyNormalMode_leader() {
   message("<leader>...");
-  editorRefreshScreen(); // display the message
+  editorRefreshIfIdle(); // display the message
   int c = editorReadKey(0);
   switch (c) {
   case 'w':
     editorSave();
     break;
+  case 'f':
+    editorFindFile();
+    break;
   default:
     message("%c is undefined", c);
   }
@@ -1217,8 +4429,8 @@ void processKeyInsertMode_j() {
   int c = editorReadKey(1);
   if (c == -1) { // timed out;
     editorInsertChar('j');
+    return;
   }
-  editorRefreshScreen();
   switch (c) {
   case 'k':
     E->mode = MODE_NORMAL;
@@ -1228,13 +4440,15 @@ void processKeyInsertMode_j() {
     E->mode = MODE_NORMAL;
     break;
   default:
-    message("%c is undefined", c);
+    // Not an escape chord (eg. pasted text), so keep both keys.
+    editorInsertChar('j');
+    editorUnreadKey(c);
   }
 }
 
 void processKey_Cx() {
   message("C-x...");
-  editorRefreshScreen(); // display the message
+  editorRefreshIfIdle(); // display the message
   int c = editorReadKey(0);
   switch (c) {
   case CTRL_KEY('c'):
@@ -1243,22 +4457,60 @@ void processKey_Cx() {
   case CTRL_KEY('s'):
     editorSave();
     break;
+  case CTRL_KEY('n'):
+  case CTRL_KEY('p'):
+    if (E->mode == MODE_INSERT) {
+      editorComplete(c == CTRL_KEY('n') ? 1 : -1);
+      break;
+    }
+    // fall through
   default:
     message("%c is undefined", c);
   }
 }
 
 void editorProcessKeypressNormalMode() {
-  int c = editorReadKey(0);
+  int count;
+  int c = editorReadCount(&count);
+  // keys that would change the buffer: insert, delete, change, join, put,
+  // indent, undo and redo
+  if (c > 0 && c < 128 && strchr("iaAIodcJxuHpP<>\x12\x0e", c) &&
+      editorReadOnly())
+    return;
+  // these only know about the primary cursor, and can move rows under the
+  // others
+  if (C.n > 0 && c > 0 && c < 128 && strchr("odcJuHpP<>\x12", c))
+    editorCursorsClear();
+  // one undo step for everything done at once with several cursors
+  if (C.n > 0 && c > 0 && c < 128 && strchr("iaAIx", c))
+    editorHistoryPush();
   switch (c) {
   case SPACE:
     processKeyNormalMode_leader();
     break;
-  case 'g':
-    processKeyNormalMode_g();
-    break;
   case 'd':
-    processKeyNormalMode_d();
+  case 'y':
+  case 'c':
+  case '>':
+  case '<':
+    processKeyNormalMode_operator(c, count);
+    break;
+  case '"': {
+    int r = editorRegisterIndex(editorReadKey(0));
+    if (r == -1)
+      message("No such register");
+    else
+      regName = r;
+  } break;
+  case 'p':
+  case 'P':
+    editorPut(c == 'p', count ? count : 1);
+    break;
+  case 'q':
+    processKeyNormalMode_q();
+    break;
+  case '@':
+    processKeyNormalMode_at(count ? count : 1);
     break;
   case CTRL_KEY('x'):
     processKey_Cx();
@@ -1267,16 +4519,19 @@ void editorProcessKeypressNormalMode() {
     E->mode = MODE_INSERT;
     break;
   case 'a':
+    for (int i = 0; i < C.n; i++) {
+      if (C.at[i].x < E->row[C.at[i].y].size)
+        C.at[i].x++;
+    }
     E->cx++; // TODO: bounds check
     E->mode = MODE_INSERT;
     break;
   case 'A':
-    if (E->cy < E->numrows)
-      E->cx = E->row[E->cy].size; // move to end of the line
+    editorCursorsMove('$', 1);
     E->mode = MODE_INSERT;
     break;
   case 'I':
-    E->cx = 0;
+    editorCursorsMove('^', 1);
     E->mode = MODE_INSERT;
     break;
   case 'o':
@@ -1292,67 +4547,71 @@ void editorProcessKeypressNormalMode() {
   case 'j':
   case 'h':
   case 'l':
-    editorMoveCursor(c);
-    break;
-  case 'w':
-    editorMoveCursorWordForward();
-    break;
-  case 'b':
-    editorMoveCursorWordBackward();
-    break;
+  case '$':
+  case '^':
+    editorCursorsMove(c, count ? count : 1);
     break;
-  case 'J':
-    editorJoinLines();
+  case 'J': {
+    int n = count > 2 ? count : 2;
+    editorJoinRows(E->cy, E->cy + n <= E->numrows ? n : E->numrows - E->cy);
+  } break;
+  case 'x': {
+    if (C.n > 0) {
+      editorCursorsReplace(0, 1, "", 0);
+      break;
+    }
+    if (E->cy >= E->numrows)
+      break;
+    erow *row = &E->row[E->cy];
+    int end = E->cx; // count characters on, as far as the end of the row
+    for (int i = 0; i < (count ? count : 1) && end < row->size; i++)
+      end = editorRowNextChar(row, end, 1);
+    int n = end - E->cx;
+    if (n > 0) {
+      editorYankRange((point){E->cy, E->cx}, (point){E->cy, E->cx + n});
+      editorDelRange((point){E->cy, E->cx}, (point){E->cy, E->cx + n});
+    }
+  } break;
+  case CTRL_KEY('n'):
+    editorCursorAddNext();
     break;
-  case 'x':
-    editorMoveCursor(ARROW_RIGHT);
-    editorDelChar();
+  case CTRL_KEY(']'):
+    editorTagUnderCursor();
     break;
-  case '$':
-    if (E->cy < E->numrows)
-      E->cx = E->row[E->cy].size; // move to end of the line
+  case '*':
+  case '#':
+    editorStar(c == '*' ? 1 : -1, count);
     break;
-  case '^':
-    E->cx = 0;
+  case 'n':
+  case 'N':
+    editorStarNext(c == 'n' ? 1 : -1, count);
     break;
+  case '\x1b': {
+    int done;
+    ST.on = 0;
+    grepCount(&done);
+    if (!done && !KF.active) { // only Esc typed at the terminal stops :grep
+      grepCancel();
+      message("Search stopped");
+    }
+    editorCursorsClear();
+  } break;
   case '/':
     editorFind();
     break;
-  case 'W': {
-    point p = point_W(*E);
-    E->cx = p.x;
-    E->cy = p.y;
-  } break;
-  case CTRL_KEY('f'): {
-    E->cy = E->rowoff + E->screenrows - 1;
-    if (E->cy > E->numrows)
-      E->cy = E->numrows; // cap to end of file
-    int times = E->screenrows;
-    while (times--)
-      editorMoveCursor(ARROW_DOWN);
-  } break;
-  case CTRL_KEY('b'): {
-    E->cy = E->rowoff;
-    int times = E->screenrows;
-    while (times--)
-      editorMoveCursor(ARROW_UP);
-  } break;
-  case 'G':
-    E->cy = E->numrows - 1;
-    E->cx = E->row[E->cy].size;
-    break;
   case 'u': {
-    E = history_undo(E);
+    editorRestore(history_undo(E));
   } break;
   case CTRL_KEY('r'): {
-    E = history_redo(E);
+    editorRestore(history_redo(E));
   } break;
   case 'H':
     // temp - manually invoke history
-    { E = history_push(E); }
+    editorHistoryPush();
     break;
   default:
-    message("%c is undefined", c);
+    if (editorMotion(c, count) == MOTION_NONE)
+      message("%c is undefined", c);
   }
 }
 
@@ -1366,6 +4625,10 @@ void editorProcessKeypressInsertMode() {
     processKeyInsertMode_j();
     break;
   case '\r':
+    if (C.n > 0) {
+      message("Can't split lines with several cursors");
+      break;
+    }
     editorInsertNewline();
     break;
   case CTRL_KEY('x'):
@@ -1374,16 +4637,11 @@ void editorProcessKeypressInsertMode() {
   case CTRL_KEY('s'):
     editorFind();
     break;
-  case CTRL_KEY('a'):
-    E->cx = 0;
-    break;
-  case CTRL_KEY('e'):
-    if (E->cy < E->numrows)
-      E->cx = E->row[E->cy].size; // move to end of the line
-    break;
   case BACKSPACE:
     editorDelChar();
     break;
+  case CTRL_KEY('a'):
+  case CTRL_KEY('e'):
   case CTRL_KEY('f'):
   case CTRL_KEY('b'):
   case CTRL_KEY('n'):
@@ -1392,7 +4650,7 @@ void editorProcessKeypressInsertMode() {
   case ARROW_DOWN:
   case ARROW_LEFT:
   case ARROW_RIGHT:
-    editorMoveCursor(c);
+    editorCursorsMove(c, 1);
     break;
   default:
     editorInsertChar(c);
@@ -1400,6 +4658,31 @@ void editorProcessKeypressInsertMode() {
   }
 }
 
+void editorProcessKeypress() {
+  switch (E->mode) {
+  case MODE_NORMAL:
+    editorProcessKeypressNormalMode();
+    break;
+  case MODE_INSERT:
+    editorProcessKeypressInsertMode();
+    break;
+  }
+}
+
+/* Run keys count times over as if they were typed in normal mode, ending back
+   in it. Nothing is drawn or highlighted until they are all done. */
+void editorRunKeys(const char *keys, int len, int count) {
+  struct keyFeed saved = KF;
+  KF = (struct keyFeed){keys, len, 0, count, 1};
+  E->mode = MODE_NORMAL;
+  editorLexDefer();
+  while (KF.pos < KF.len || KF.repeat > 1)
+    editorProcessKeypress();
+  editorLexResume();
+  E->mode = MODE_NORMAL;
+  KF = saved;
+}
+
 void initEditor(struct editorConfig *e) {
   e->cx = 0; // horizontal cursor
   e->cy = 0; // vertical cursor
@@ -1409,6 +4692,7 @@ void initEditor(struct editorConfig *e) {
   e->numrows = 0;
   e->row = NULL;
   e->dirty = 0;
+  e->edits = 0;
   e->filename = NULL;
   e->statusmsg[0] = '\0';
   e->statusmsg_time = 0;
@@ -1419,27 +4703,64 @@ void initEditor(struct editorConfig *e) {
   e->screenrows -= 2; // For the status bar and message bar
   e->undo = 0;
   e->redo = 0;
+  e->text = NULL;
+  e->patch = NULL;
+  e->npatch = 0;
 }
 
 int main(int argc, char *argv[]) {
+  E = calloc(1, sizeof(editorConfig)); // freed like any other state
+  int opt;
+  while ((opt = getopt(argc, argv, "k:w")) != -1) {
+    switch (opt) {
+    case 'k': // rows kept from a pipe
+      S.keep = atoi(optarg);
+      break;
+    case 'w': // open the file as a window whatever its size
+      W.on = 1;
+      break;
+    default:
+      fprintf(stderr, "Usage: bse [-k rows] [-w] [file]\n");
+      exit(1);
+    }
+  }
+
+  // Before any background job starts, as they all wake the UI through it.
+  if (pipe(wake_pipe) == -1)
+    die("pipe");
+  fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+  int piped = !isatty(STDIN_FILENO);
+  if (piped)
+    editorStreamOpen();
   enableRawMode();
   initEditor(E);
-
-  if (argc >= 2) {
-    editorOpen(argv[1]);
+  syntaxInit();
+  editorAttachLexers();
+
+  if (optind < argc) {
+    editorOpen(argv[optind]);
+    if (piped) { // a file was named, so the pipe only stood in for the tty
+      close(S.fd);
+      S.fd = -1;
+    }
   }
 
+  tagsStart();
+
+  signal(SIGWINCH, editorHandleResize);
+
   while (1) {
     editorRefreshScreen();
-
-    switch (E->mode) {
-    case MODE_NORMAL:
-      editorProcessKeypressNormalMode();
-      break;
-    case MODE_INSERT:
-      editorProcessKeypressInsertMode();
-      break;
-    }
+    if (!editorWaitForInput())
+      continue; // woken by a background job, just redraw
+
+    // Apply every key that has already arrived before drawing the next frame,
+    // so a paste or held key costs one redraw rather than one per byte.
+    do {
+      editorProcessKeypress();
+    } while (editorKeyPending());
   }
   return 0;
 }
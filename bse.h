@@ -1,31 +1,102 @@
 #ifndef KILO_H
 #define KILO_H
 
+#include <regex.h>
 #include <termios.h>
 #include <time.h>
 
+#include "text.h"
+
+enum editorHighlight {
+  HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_MLCOMMENT,
+  HL_KEYWORD1,
+  HL_KEYWORD2,
+  HL_STRING,
+  HL_NUMBER,
+  HL_MATCH
+};
+
+#define HL_HIGHLIGHT_NUMBERS (1 << 0)
+#define HL_HIGHLIGHT_STRINGS (1 << 1)
+
+/* Everything the lexer carries from one position to the next. */
+typedef struct lexState {
+  unsigned char in_string;   // the quote that opened the current string, or 0
+  unsigned char in_comment;  // inside a multiline comment
+  unsigned char prev_sep;    // the previous character was a separator
+  unsigned char prev_number; // the previous character was a number
+} lexState;
+
+/* Rows are lexed in chunks. Each chunk remembers where it starts in render and
+   the lexer state there, so an edit only re-lexes from the chunk it lands in
+   until the state lines up with what was there before. */
+typedef struct rowChunk {
+  int rx;      // where in render the chunk starts
+  lexState st; // the lexer state on entry to the chunk
+} rowChunk;
+
+/* A bracket the lexer left as code, where it is in render. */
+typedef struct rowBracket {
+  int rx;
+  char c;
+} rowBracket;
+
+#define BSE_LEX_STEP 128 // render bytes between lexer checkpoints
+
+struct erow;
+typedef int (*lexFn)(struct erow *row, int i, lexState st, int converge);
+
 struct editorSyntax {
   char *filetype;
   char **filematch;
-  char **keywords;
+  char **keywords; // NULL for languages loaded from definition files
   char *singleline_comment_start;
   char *multiline_comment_start;
   char *multiline_comment_end;
   int flags;
+  const struct synTable *table; // the compiled form the lexer runs on
+  lexFn lex; // a lexer specialized for the language, or NULL for the generic one
 };
 
 typedef struct erow {
   int idx;     // which row in the buffer it represents
   int size;    // the row length
-  char *chars; // the characters in the line
+  char *chars; // the characters in the line, in text
   int rsize; // the length of the "rendered" line, where eg. \t will expand to n
              // spaces
   char *render;        // the "rendered" characters in the line
   unsigned char *hl;   // the highlight property of a character
   int hl_open_comment; // whether this line begins or is part of a multiline
                        // comment
+  text *text;          // holds chars, maybe shared with registers
+  int rcap;            // bytes allocated for each of render and hl
+  int tabs;            // tabs in chars; with none, rx == cx
+  rowChunk *chunks;    // lexer checkpoints, see editorLexRow
+  int nchunks;
+  rowBracket *brackets; // brackets outside strings and comments, see bracket.c
+  int nbrackets;
+  int *idents; // the identifiers in it, in order, see ident.c
+  int nidents;
+  int *cols; // the column each byte of render is in, NULL if all ASCII, see
+             // utf8.c
+  int *wraps;   // where its screen lines after the first start, see wrap.c
+  int nwraps;
+  int wrapcols; // the width wraps was worked out for, 0 if not yet
+  int marked; // picked out by :g
+  int stale;  // edited while highlighting was deferred
 } erow;
 
+/* A search pattern: a POSIX basic regular expression, or a plain string if
+   it has no special characters, which is much faster to look for. */
+struct pattern {
+  char *s;
+  int len;
+  int literal;
+  regex_t re;
+};
+
 enum editorMode { MODE_NORMAL = 0, MODE_INSERT = 1 };
 
 typedef struct editorConfig {
@@ -38,6 +109,7 @@ typedef struct editorConfig {
   int numrows;        // size of the buffer
   erow *row;          // current row
   int dirty;          // is modified?
+  int edits;          // changes ever made, which undo doesn't take back
   char *filename;     // name of file linked to the buffer
   char statusmsg[80]; // status message displayed on at bottom of buffer
   time_t statusmsg_time;       // how long ago status message was written
@@ -47,8 +119,22 @@ typedef struct editorConfig {
   int mode;
   struct editorConfig *undo; // pointer to the previous state
   struct editorConfig *redo; // pointer to the next state
+  char *text; // an undo snapshot keeps the chars of all its rows in one block,
+              // or only those of the rows in patch
+  int *patch; // row index and size pairs, see history_push_rows
+  int npatch;
 } editorConfig;
 
 void initEditor(editorConfig *e);
+void editorFreeRow(erow *row);
+int lexStateEq(lexState a, lexState b);
+void editorRowSetChunk(erow *row, int ck, int i, lexState st);
+void message(const char *fmt, ...);
+int is_separator(int c);
+void editorWake();
+int editorPatternCompile(struct pattern *pat, char *s, int cflags);
+void editorPatternFree(struct pattern *pat);
+int editorPatternMatch(struct pattern *pat, const char *chars, int len,
+                       int from, regmatch_t *m);
 
 #endif
@@ -0,0 +1,47 @@
+/* Where bse keeps the things it can rebuild: $XDG_CACHE_HOME/bse, or
+   ~/.cache/bse. */
+
+#define _DEFAULT_SOURCE
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+/* Fill dir (PATH_MAX bytes) with the cache directory; -1 if there is none. */
+int cacheDir(char *dir) {
+  int n;
+  if (getenv("XDG_CACHE_HOME"))
+    n = snprintf(dir, PATH_MAX, "%s/bse", getenv("XDG_CACHE_HOME"));
+  else if (getenv("HOME"))
+    n = snprintf(dir, PATH_MAX, "%s/.cache/bse", getenv("HOME"));
+  else
+    return -1;
+  return n < PATH_MAX ? 0 : -1;
+}
+
+/* Create dir and any missing parents. */
+void cacheMkdirs(const char *dir) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s", dir);
+  for (char *p = path + 1; *p; p++) {
+    if (*p == '/') {
+      *p = '\0';
+      mkdir(path, 0755);
+      *p = '/';
+    }
+  }
+  mkdir(path, 0755);
+}
+
+/* 64 bit FNV-1a, continuing from h (CACHE_HASH_INIT to start). */
+uint64_t cacheHash(const void *p, size_t len, uint64_t h) {
+  const unsigned char *s = p;
+  for (size_t i = 0; i < len; i++) {
+    h ^= s[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
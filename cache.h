@@ -0,0 +1,13 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_HASH_INIT 14695981039346656037ULL
+
+int cacheDir(char *dir);
+void cacheMkdirs(const char *dir);
+uint64_t cacheHash(const void *p, size_t len, uint64_t h);
+
+#endif
@@ -0,0 +1,426 @@
+/* An index of the files under the working directory, for picking one to open
+   by typing a few letters of its path. A pool of threads walks the tree,
+   leaving out what .gitignore files say to, and appends the paths as it
+   finds them, so matching can start before the walk is done.
+
+   Each path keeps a mask of the characters it has, which rules most paths
+   out of a query with one AND in a tight loop over the masks. Only the rest
+   are scored, and while the query only grows, only the paths that matched
+   the last one are looked at again. */
+
+#define _DEFAULT_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "finder.h"
+
+#define FINDER_CHUNK 65536  // paths in each block of the index
+#define FINDER_CHUNKS 256   // blocks, which is as many paths as it holds
+#define FINDER_THREADS 8    // most threads the walk uses
+#define FINDER_BATCH 256    // paths a thread finds before adding them
+
+/* The index grows a block at a time, and a block never moves, so paths can
+   be read without the lock up to the count read with it. */
+struct finderChunk {
+  uint64_t mask[FINDER_CHUNK]; // see finderMask
+  char *path[FINDER_CHUNK];
+};
+
+typedef struct finderPattern {
+  char *s;
+  int neg;      // !pattern: include what an earlier pattern left out
+  int dir;      // pattern/: only match directories
+  int anchored; // has a / in it, so it matches the path, not just the name
+  int anywhere; // **/ before a path: it may start at any directory
+} finderPattern;
+
+/* The patterns of one .gitignore, and those of the directories above it. */
+typedef struct finderIgnore {
+  struct finderIgnore *parent;
+  char *base; // the directory it is in, with a trailing / unless it is ""
+  finderPattern *pats;
+  int npats;
+  struct finderIgnore *next; // all of them, to free when the walk is done
+} finderIgnore;
+
+typedef struct finderDir {
+  char *path; // relative to the working directory, "" for it
+  finderIgnore *ign;
+} finderDir;
+
+struct finderState {
+  pthread_mutex_t lock;
+  pthread_cond_t cond; // directories to walk were added, or the walk ended
+  finderDir *dirs;     // waiting to be walked
+  int ndirs, capdirs;
+  int busy; // threads walking a directory, which may add more
+  int started, done;
+  int nthreads;
+  struct finderChunk *chunks[FINDER_CHUNKS];
+  int npaths;
+  finderIgnore *ignores;
+
+  // the last match, for the main thread only
+  char *query;
+  int *cand; // the paths the query matched, of the first scanned
+  int ncand, capcand;
+  int scanned;
+} FD = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+/* A bit for each character, or class of them, a path contains: a to z
+   ignoring case, the digits, and a few kinds of punctuation. */
+uint64_t finderCharBit(unsigned char c) {
+  c = tolower(c);
+  if (c >= 'a' && c <= 'z')
+    return 1ULL << (c - 'a');
+  if (c >= '0' && c <= '9')
+    return 1ULL << (26 + c - '0');
+  switch (c) {
+  case '_':
+    return 1ULL << 36;
+  case '.':
+    return 1ULL << 37;
+  case '-':
+    return 1ULL << 38;
+  case '/':
+    return 1ULL << 39;
+  }
+  return 1ULL << (40 + c % 24);
+}
+
+uint64_t finderMask(const char *s) {
+  uint64_t m = 0;
+  for (; *s; s++)
+    m |= finderCharBit(*s);
+  return m;
+}
+
+/* Read dir's .gitignore, if it has one, on top of parent. */
+finderIgnore *finderReadIgnore(const char *dir, finderIgnore *parent) {
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s%s.gitignore", dir, *dir ? "/" : "") >=
+      PATH_MAX)
+    return parent;
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return parent;
+  finderIgnore *ign = calloc(1, sizeof(finderIgnore));
+  ign->parent = parent;
+  ign->base = malloc(strlen(dir) + 2);
+  sprintf(ign->base, "%s%s", dir, *dir ? "/" : "");
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t len;
+  int cap = 0;
+  while ((len = getline(&line, &linecap, fp)) != -1) {
+    while (len > 0 && isspace((unsigned char)line[len - 1]))
+      line[--len] = '\0';
+    char *s = line;
+    if (len == 0 || *s == '#')
+      continue;
+    finderPattern p = {0};
+    if (*s == '!') {
+      p.neg = 1;
+      s++;
+    }
+    len = strlen(s);
+    if (len > 0 && s[len - 1] == '/') {
+      p.dir = 1;
+      s[--len] = '\0';
+    }
+    if (!strncmp(s, "**/", 3)) {
+      s += 3; // matches at any depth, as a name without a / does
+      p.anywhere = 1;
+    }
+    if (strchr(s, '/'))
+      p.anchored = 1;
+    if (*s == '/')
+      s++;
+    if (!*s)
+      continue;
+    if (ign->npats == cap) {
+      cap = cap ? cap * 2 : 16;
+      ign->pats = realloc(ign->pats, sizeof(finderPattern) * cap);
+    }
+    p.s = strdup(s);
+    ign->pats[ign->npats++] = p;
+  }
+  free(line);
+  fclose(fp);
+  pthread_mutex_lock(&FD.lock);
+  ign->next = FD.ignores;
+  FD.ignores = ign;
+  pthread_mutex_unlock(&FD.lock);
+  return ign;
+}
+
+/* Whether path, whose last part is name, is ignored. The nearest .gitignore
+   decides, and within one the last pattern that matches. */
+int finderIgnored(finderIgnore *ign, const char *path, const char *name,
+                  int dir) {
+  for (; ign; ign = ign->parent) {
+    const char *rel = path + strlen(ign->base);
+    for (int i = ign->npats - 1; i >= 0; i--) {
+      finderPattern *p = &ign->pats[i];
+      if (p->dir && !dir)
+        continue;
+      if (!p->anchored) {
+        if (fnmatch(p->s, name, 0) == 0)
+          return !p->neg;
+        continue;
+      }
+      // the path from here, or with **/ from any directory below
+      for (const char *at = rel; at; at = strchr(at, '/')) {
+        if (*at == '/')
+          at++;
+        if (fnmatch(p->s, at, FNM_PATHNAME) == 0)
+          return !p->neg;
+        if (!p->anywhere)
+          break;
+      }
+    }
+  }
+  return 0;
+}
+
+/* Add n paths to the index, with the lock held. */
+void finderAdd(char **paths, int n) {
+  for (int i = 0; i < n; i++) {
+    int c = FD.npaths / FINDER_CHUNK, k = FD.npaths % FINDER_CHUNK;
+    if (c == FINDER_CHUNKS) { // full
+      free(paths[i]);
+      continue;
+    }
+    if (!FD.chunks[c])
+      FD.chunks[c] = malloc(sizeof(struct finderChunk));
+    FD.chunks[c]->path[k] = paths[i];
+    FD.chunks[c]->mask[k] = finderMask(paths[i]);
+    FD.npaths++;
+  }
+}
+
+void finderPush(char *path, finderIgnore *ign) {
+  if (FD.ndirs == FD.capdirs) {
+    FD.capdirs = FD.capdirs ? FD.capdirs * 2 : 64;
+    FD.dirs = realloc(FD.dirs, sizeof(finderDir) * FD.capdirs);
+  }
+  FD.dirs[FD.ndirs++] = (finderDir){path, ign};
+}
+
+/* Walk one directory: its files go in the index and its directories on the
+   stack for whichever thread is free next. */
+void finderWalkDir(finderDir d) {
+  DIR *dp = opendir(*d.path ? d.path : ".");
+  if (!dp)
+    return;
+  finderIgnore *ign = finderReadIgnore(d.path, d.ign);
+  char *batch[FINDER_BATCH], path[PATH_MAX];
+  int n = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dp)) != NULL) {
+    const char *name = ent->d_name;
+    if (!strcmp(name, ".") || !strcmp(name, "..") || !strcmp(name, ".git") ||
+        snprintf(path, sizeof(path), "%s%s%s", d.path, *d.path ? "/" : "",
+                 name) >= PATH_MAX)
+      continue;
+    int type = ent->d_type;
+    struct stat st;
+    if (type == DT_UNKNOWN && lstat(path, &st) == 0)
+      type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : 0;
+    if ((type != DT_DIR && type != DT_REG) ||
+        finderIgnored(ign, path, name, type == DT_DIR))
+      continue;
+    if (type == DT_DIR) {
+      pthread_mutex_lock(&FD.lock);
+      finderPush(strdup(path), ign);
+      pthread_cond_signal(&FD.cond);
+      pthread_mutex_unlock(&FD.lock);
+      continue;
+    }
+    batch[n++] = strdup(path);
+    if (n == FINDER_BATCH) {
+      pthread_mutex_lock(&FD.lock);
+      finderAdd(batch, n);
+      pthread_mutex_unlock(&FD.lock);
+      n = 0;
+    }
+  }
+  closedir(dp);
+  pthread_mutex_lock(&FD.lock);
+  finderAdd(batch, n);
+  pthread_mutex_unlock(&FD.lock);
+}
+
+void *finderThread(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&FD.lock);
+  for (;;) {
+    while (FD.ndirs == 0 && FD.busy > 0)
+      pthread_cond_wait(&FD.cond, &FD.lock);
+    if (FD.ndirs == 0) // and no one is walking a directory to add more
+      break;
+    finderDir d = FD.dirs[--FD.ndirs];
+    FD.busy++;
+    pthread_mutex_unlock(&FD.lock);
+    finderWalkDir(d);
+    free(d.path);
+    pthread_mutex_lock(&FD.lock);
+    FD.busy--;
+    if (FD.busy == 0 && FD.ndirs == 0)
+      pthread_cond_broadcast(&FD.cond);
+  }
+  if (--FD.nthreads == 0) { // the last one out tidies up
+    FD.done = 1;
+    while (FD.ignores) {
+      finderIgnore *ign = FD.ignores;
+      FD.ignores = ign->next;
+      for (int i = 0; i < ign->npats; i++)
+        free(ign->pats[i].s);
+      free(ign->pats);
+      free(ign->base);
+      free(ign);
+    }
+  }
+  pthread_mutex_unlock(&FD.lock);
+  return NULL;
+}
+
+/* Start indexing the working directory, the first time a file is looked
+   for. The index is kept for the rest of the session. */
+void finderStart() {
+  pthread_mutex_lock(&FD.lock);
+  if (FD.started) {
+    pthread_mutex_unlock(&FD.lock);
+    return;
+  }
+  FD.started = 1;
+  finderPush(strdup(""), NULL);
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  n = n < 1 ? 1 : n > FINDER_THREADS ? FINDER_THREADS : n;
+  for (int i = 0; i < n; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, finderThread, NULL) == 0) {
+      pthread_detach(thread);
+      FD.nthreads++;
+    }
+  }
+  if (FD.nthreads == 0)
+    FD.done = 1;
+  pthread_mutex_unlock(&FD.lock);
+}
+
+/* How many paths have been found, and whether that's all of them. */
+int finderCount(int *done) {
+  pthread_mutex_lock(&FD.lock);
+  int n = FD.npaths;
+  if (done)
+    *done = FD.done;
+  pthread_mutex_unlock(&FD.lock);
+  return n;
+}
+
+const char *finderPath(int i) {
+  return FD.chunks[i / FINDER_CHUNK]->path[i % FINDER_CHUNK];
+}
+
+/* How well path matches the lowercase query q, or -1 if it doesn't have all
+   of q's characters in order. Matching from the end keeps the characters in
+   the file name where it can, and it scores best at the start of words, in
+   runs, and in the file name, with shorter paths first on a tie. */
+int finderScore(const char *path, const char *q, int qlen) {
+  int len = strlen(path), j = qlen - 1, score = 0, prev = -2;
+  const char *slash = strrchr(path, '/');
+  int name = slash ? slash - path + 1 : 0;
+  for (int i = len - 1; i >= 0 && j >= 0; i--) {
+    if (tolower((unsigned char)path[i]) != q[j])
+      continue;
+    score++;
+    if (i == 0 || strchr("/_-. ", path[i - 1]) ||
+        (islower((unsigned char)path[i - 1]) &&
+         isupper((unsigned char)path[i])))
+      score += 8; // the start of a word
+    if (i + 1 == prev)
+      score += 4;
+    if (i >= name)
+      score += 2;
+    prev = i;
+    j--;
+  }
+  if (j >= 0)
+    return -1;
+  return score * 1024 + 1023 - (len < 1023 ? len : 1023);
+}
+
+/* Put the max best matches for query into best, best first, and the number
+   of paths it matches into *matches. Returns how many are in best. */
+int finderMatch(const char *query, int *best, int max, int *matches) {
+  int n = finderCount(NULL), qlen = strlen(query);
+  char *q = malloc(qlen + 1);
+  for (int i = 0; i <= qlen; i++)
+    q[i] = tolower((unsigned char)query[i]);
+  uint64_t qmask = finderMask(q);
+
+  // the paths to look at: those that matched the last query if this one
+  // only adds to it, and the paths found since
+  int *from = FD.cand, nfrom = FD.ncand, first = FD.scanned;
+  if (!FD.query || strncmp(query, FD.query, strlen(FD.query))) {
+    from = NULL;
+    nfrom = 0;
+    first = 0;
+  }
+  int *cand = malloc(sizeof(int) * (nfrom + n - first + 1)), ncand = 0;
+  for (int i = 0; i < nfrom; i++) {
+    int p = from[i];
+    cand[ncand] = p;
+    ncand += (FD.chunks[p / FINDER_CHUNK]->mask[p % FINDER_CHUNK] & qmask) ==
+             qmask;
+  }
+  for (int p = first; p < n;) {
+    uint64_t *mask = FD.chunks[p / FINDER_CHUNK]->mask;
+    int k = p % FINDER_CHUNK, end = FINDER_CHUNK;
+    if (end > k + n - p)
+      end = k + n - p;
+    for (; k < end; k++, p++) { // no branches, to run as fast as it can
+      cand[ncand] = p;
+      ncand += (mask[k] & qmask) == qmask;
+    }
+  }
+
+  int nbest = 0, *scores = malloc(sizeof(int) * (max + 1)), kept = 0;
+  for (int i = 0; i < ncand; i++) {
+    int s = finderScore(finderPath(cand[i]), q, qlen);
+    if (s < 0)
+      continue;
+    cand[kept++] = cand[i];
+    if (nbest == max && s <= scores[nbest - 1])
+      continue;
+    int j = nbest < max ? nbest++ : nbest - 1;
+    for (; j > 0 && scores[j - 1] < s; j--) {
+      scores[j] = scores[j - 1];
+      best[j] = best[j - 1];
+    }
+    scores[j] = s;
+    best[j] = cand[i];
+  }
+  free(scores);
+  free(q);
+
+  free(FD.cand);
+  free(FD.query);
+  FD.cand = cand;
+  FD.ncand = kept;
+  FD.query = strdup(query);
+  FD.scanned = n;
+  *matches = kept;
+  return nbest;
+}
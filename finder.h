@@ -0,0 +1,9 @@
+#ifndef FINDER_H
+#define FINDER_H
+
+void finderStart();
+int finderCount(int *done);
+int finderMatch(const char *query, int *best, int max, int *matches);
+const char *finderPath(int i);
+
+#endif
@@ -0,0 +1,153 @@
+/* Generates hl_gen.h: a lexer for each built-in language, specialized from the
+   same tables the generic lexer would use, with the delimiters inlined and the
+   keywords recognised by a switch rather than a hash lookup.
+
+   Usage: gensyntax > hl_gen.h */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "syntax.h"
+
+void message(const char *fmt, ...) { (void)fmt; }
+
+/* The filetype made safe to use in a C identifier. */
+void languageId(const char *filetype, char *id) {
+  int i;
+  for (i = 0; filetype[i] && i < SYN_NAME_MAX - 1; i++)
+    id[i] = isalnum((unsigned char)filetype[i]) ? filetype[i] : '_';
+  id[i] = '\0';
+}
+
+void emitChar(unsigned char c) {
+  if (c == '\'' || c == '\\')
+    printf("'\\%c'", c);
+  else if (isgraph(c))
+    printf("'%c'", c);
+  else
+    printf("%d", c);
+}
+
+void emitString(const char *s, int len) {
+  putchar('"');
+  for (int i = 0; i < len; i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\')
+      printf("\\%c", c);
+    else if (isgraph(c) || c == ' ')
+      putchar(c);
+    else
+      printf("\\%03o", c);
+  }
+  putchar('"');
+}
+
+/* The position that best tells the n byte keywords apart: ideally every one
+   has a different byte there, so each case of the switch is a single
+   comparison. */
+int bestPosition(const synTable *t, int n) {
+  int best = 0, bestmax = SYN_KW_SLOTS + 1;
+  for (int k = 0; k < n; k++) {
+    int count[256] = {0}, max = 0;
+    for (int s = 0; s < SYN_KW_SLOTS; s++) {
+      if (t->kw[s].len == n) {
+        int c = ++count[(unsigned char)t->kw[s].s[k]];
+        if (c > max)
+          max = c;
+      }
+    }
+    if (max < bestmax) {
+      best = k;
+      bestmax = max;
+    }
+  }
+  return best;
+}
+
+void emitKeywords(const synTable *t, const char *id) {
+  printf("int keyword_%s(const char *p, int left, int *klen) {\n", id);
+  printf("  int n = 0;\n");
+  printf("  while (n < left && !(cls_%s[(unsigned char)p[n]] & CLS_SEP)) {\n",
+         id);
+  printf("    if (++n > %d)\n      return 0;\n  }\n", t->kw_max);
+  printf("  switch (n) {\n");
+  for (int n = 1; n <= t->kw_max; n++) {
+    int seen[256] = {0}, any = 0;
+    for (int s = 0; s < SYN_KW_SLOTS; s++)
+      any |= t->kw[s].len == n;
+    if (!any)
+      continue;
+    int k = bestPosition(t, n);
+    printf("  case %d:\n    switch (p[%d]) {\n", n, k);
+    for (int s = 0; s < SYN_KW_SLOTS; s++) {
+      unsigned char c = t->kw[s].s[k];
+      if (t->kw[s].len != n || seen[c])
+        continue;
+      seen[c] = 1;
+      printf("    case ");
+      emitChar(c);
+      printf(":\n");
+      for (int r = s; r < SYN_KW_SLOTS; r++) {
+        if (t->kw[r].len != n || (unsigned char)t->kw[r].s[k] != c)
+          continue;
+        printf("      if (!memcmp(p, ");
+        emitString(t->kw[r].s, n);
+        printf(", %d)) {\n        *klen = %d;\n        return %s;\n      }\n",
+               n, n,
+               t->kw[r].type == HL_KEYWORD2 ? "HL_KEYWORD2" : "HL_KEYWORD1");
+      }
+      printf("      return 0;\n");
+    }
+    printf("    }\n    return 0;\n");
+  }
+  printf("  }\n  return 0;\n}\n\n");
+}
+
+void emitDelim(const char *name, const char *s, int len) {
+  printf("#define LEX_%s ", name);
+  emitString(s, len);
+  printf("\n#define LEX_%s_LEN %d\n", name, len);
+}
+
+void emitLanguage(struct editorSyntax *s) {
+  const synTable *t = s->table;
+  char id[SYN_NAME_MAX];
+  languageId(s->filetype, id);
+
+  printf("/* %s */\n", s->filetype);
+  printf("const unsigned char cls_%s[256] = {", id);
+  for (int c = 0; c < 256; c++)
+    printf("%s%d,", c % 16 ? " " : "\n    ", t->cls[c]);
+  printf("\n};\n\n");
+
+  emitKeywords(t, id);
+
+  printf("#define LEX_NAME editorLexRow_%s\n", id);
+  printf("#define LEX_INIT\n");
+  printf("#define LEX_CLS(c) (cls_%s[c])\n", id);
+  emitDelim("SCS", t->scs, t->scs_len);
+  emitDelim("MCS", t->mcs, t->mcs_len);
+  emitDelim("MCE", t->mce, t->mce_len);
+  printf("#define LEX_KEYWORD(p, left, klen) keyword_%s(p, left, klen)\n",
+         id);
+  printf("#include \"lexrow.h\"\n\n");
+}
+
+int main() {
+  struct editorSyntax *s;
+  char id[SYN_NAME_MAX];
+  printf("/* Generated by gensyntax from the built-in languages in syntax.c. "
+         "*/\n\n");
+  for (unsigned int j = 0; (s = syntaxBuiltin(j)) != NULL; j++)
+    emitLanguage(s);
+
+  printf("struct {\n  const char *filetype;\n  lexFn lex;\n} builtinLexers[] = "
+         "{\n");
+  for (unsigned int j = 0; (s = syntaxBuiltin(j)) != NULL; j++) {
+    languageId(s->filetype, id);
+    printf("    {\"%s\", editorLexRow_%s},\n", s->filetype, id);
+  }
+  printf("    {NULL, NULL},\n};\n");
+  return 0;
+}
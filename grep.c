@@ -0,0 +1,364 @@
+/* :grep searches every file under a directory with a pool of threads. Each
+   thread keeps a deque of directories and files to search: it takes from the
+   back of its own, where what it found last is, and when that runs dry it
+   steals from the front of another's, where the oldest and usually biggest
+   work is. Files are mapped rather than read, and searched with the same
+   patterns as / and :s. Matches are added as each file is done, so they can
+   be gone through while the rest are searched. */
+
+#define _DEFAULT_SOURCE
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bse.h"
+#include "grep.h"
+
+#define GREP_THREADS 8   // most threads a search uses
+#define GREP_TEXT 160    // most bytes of a matching line kept to show
+#define GREP_BINARY 8192 // bytes looked at for a NUL, which means binary
+
+typedef struct grepItem {
+  char *path;
+  int dir;
+} grepItem;
+
+typedef struct grepDeque {
+  pthread_mutex_t lock;
+  grepItem *items; // [head, tail) are waiting
+  int head, tail, cap;
+} grepDeque;
+
+struct grepState {
+  pthread_mutex_t lock;
+  pthread_cond_t cond; // work was pushed, or the last of it was done
+  pthread_t threads[GREP_THREADS];
+  int nthreads;
+  grepDeque deques[GREP_THREADS]; // one for each thread asked for
+  int ndeques;
+  int pending; // items pushed and not done yet
+  int pushes;  // times work was pushed, for idle threads to wait on
+  int started, cancel, done;
+  char *pattern;
+  grepMatch *matches;
+  int nmatches, cap;
+  char **files; // the paths the matches point to
+  int nfiles, capfiles;
+} GR = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+/* Add n items to the back of thread self's deque. */
+void grepPush(int self, grepItem *items, int n) {
+  if (n == 0)
+    return;
+  grepDeque *d = &GR.deques[self];
+  pthread_mutex_lock(&GR.lock);
+  pthread_mutex_lock(&d->lock);
+  if (d->tail + n > d->cap) {
+    memmove(d->items, &d->items[d->head], sizeof(grepItem) * (d->tail - d->head));
+    d->tail -= d->head;
+    d->head = 0;
+    if (d->tail + n > d->cap) {
+      d->cap = (d->tail + n) * 2;
+      d->items = realloc(d->items, sizeof(grepItem) * d->cap);
+    }
+  }
+  memcpy(&d->items[d->tail], items, sizeof(grepItem) * n);
+  d->tail += n;
+  pthread_mutex_unlock(&d->lock);
+  GR.pending += n;
+  GR.pushes++;
+  pthread_cond_broadcast(&GR.cond);
+  pthread_mutex_unlock(&GR.lock);
+}
+
+/* Take the next item for thread self: its own newest, or another thread's
+   oldest. */
+int grepTake(int self, grepItem *it) {
+  for (int k = 0; k < GR.ndeques; k++) {
+    grepDeque *d = &GR.deques[(self + k) % GR.ndeques];
+    int found = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail > d->head) {
+      *it = k == 0 ? d->items[--d->tail] : d->items[d->head++];
+      found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    if (found)
+      return 1;
+  }
+  return 0;
+}
+
+/* Push what is in directory path for searching. */
+void grepDir(int self, const char *path) {
+  DIR *dp = opendir(path);
+  if (!dp)
+    return;
+  grepItem *items = NULL;
+  int n = 0, cap = 0;
+  char child[PATH_MAX];
+  struct dirent *ent;
+  while ((ent = readdir(dp)) != NULL) {
+    const char *name = ent->d_name;
+    if (!strcmp(name, ".") || !strcmp(name, "..") || !strcmp(name, ".git"))
+      continue;
+    if (snprintf(child, sizeof(child), "%s/%s", path, name) >= PATH_MAX)
+      continue;
+    int type = ent->d_type;
+    struct stat st;
+    if (type == DT_UNKNOWN && lstat(child, &st) == 0)
+      type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : 0;
+    if (type != DT_DIR && type != DT_REG) // links could go round in circles
+      continue;
+    if (n == cap) {
+      cap = cap ? cap * 2 : 64;
+      items = realloc(items, sizeof(grepItem) * cap);
+    }
+    // paths under the working directory are kept without the "./"
+    items[n++] = (grepItem){strdup(strcmp(path, ".") ? child : name),
+                            type == DT_DIR};
+  }
+  closedir(dp);
+  grepPush(self, items, n);
+  free(items);
+}
+
+/* The line in [s, s + len) as it is shown in the list of matches. */
+char *grepText(const char *s, int len) {
+  while (len > 0 && (*s == ' ' || *s == '\t')) {
+    s++;
+    len--;
+  }
+  if (len > GREP_TEXT)
+    len = GREP_TEXT;
+  char *text = malloc(len + 1);
+  for (int i = 0; i < len; i++)
+    text[i] = (unsigned char)s[i] < ' ' ? ' ' : s[i];
+  text[len] = '\0';
+  return text;
+}
+
+/* Search the file at path, one line at a time for a regular expression into
+   the buffer *line, or all of it at once for a plain string. */
+void grepFile(struct pattern *pat, const char *path, char **line, int *cap) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0 || st.st_size >= INT_MAX) {
+    close(fd);
+    return;
+  }
+  int size = st.st_size;
+  char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return;
+
+  grepMatch *found = NULL;
+  int nfound = 0, capfound = 0;
+  if (!memchr(map, '\0', size < GREP_BINARY ? size : GREP_BINARY)) {
+    regmatch_t m[10];
+    int lineno = 0, at = 0; // at is where line lineno starts
+    while (at < size) {
+      int col = 0;
+      if (pat->literal) {
+        if (!editorPatternMatch(pat, map, size, at, m))
+          break;
+        char *nl;
+        while ((nl = memchr(map + at, '\n', m[0].rm_so - at)) != NULL) {
+          lineno++;
+          at = nl - map + 1;
+        }
+        col = m[0].rm_so - at;
+      }
+      char *eol = memchr(map + at, '\n', size - at);
+      int len = (eol ? eol - map : size) - at;
+      if (!pat->literal) {
+        if (len + 1 > *cap) {
+          *cap = (len + 1) * 2;
+          *line = realloc(*line, *cap);
+        }
+        memcpy(*line, map + at, len);
+        (*line)[len] = '\0';
+        if (editorPatternMatch(pat, *line, len, 0, m))
+          col = m[0].rm_so;
+        else
+          col = -1;
+      }
+      if (col >= 0) {
+        if (nfound == capfound) {
+          capfound = capfound ? capfound * 2 : 16;
+          found = realloc(found, sizeof(grepMatch) * capfound);
+        }
+        found[nfound++] = (grepMatch){NULL, lineno, col, grepText(map + at, len)};
+      }
+      at += len + 1;
+      lineno++;
+    }
+  }
+  munmap(map, size);
+  if (nfound == 0)
+    return;
+
+  pthread_mutex_lock(&GR.lock);
+  if (GR.nfiles == GR.capfiles) {
+    GR.capfiles = GR.capfiles ? GR.capfiles * 2 : 64;
+    GR.files = realloc(GR.files, sizeof(char *) * GR.capfiles);
+  }
+  char *file = GR.files[GR.nfiles++] = strdup(path);
+  if (GR.nmatches + nfound > GR.cap) {
+    GR.cap = (GR.nmatches + nfound) * 2;
+    GR.matches = realloc(GR.matches, sizeof(grepMatch) * GR.cap);
+  }
+  for (int i = 0; i < nfound; i++) {
+    found[i].file = file;
+    GR.matches[GR.nmatches++] = found[i];
+  }
+  pthread_mutex_unlock(&GR.lock);
+  free(found);
+  editorWake(); // show them
+}
+
+void *grepThread(void *arg) {
+  int self = (intptr_t)arg, cancel = 0;
+  struct pattern pat; // a regex_t each, as regexec would take turns on one
+  editorPatternCompile(&pat, GR.pattern, 0);
+  char *line = NULL;
+  int cap = 0;
+  for (;;) {
+    grepItem it;
+    if (!grepTake(self, &it)) {
+      // look again with the count of pushes in hand, so a push made after
+      // this look is sure to wake the wait
+      pthread_mutex_lock(&GR.lock);
+      int pushes = GR.pushes;
+      pthread_mutex_unlock(&GR.lock);
+      if (!grepTake(self, &it)) {
+        pthread_mutex_lock(&GR.lock);
+        while (GR.pending > 0 && GR.pushes == pushes)
+          pthread_cond_wait(&GR.cond, &GR.lock);
+        int finished = GR.pending == 0;
+        pthread_mutex_unlock(&GR.lock);
+        if (finished)
+          break;
+        continue;
+      }
+    }
+    if (!cancel) { // once cancelled, what is left is only thrown away
+      if (it.dir)
+        grepDir(self, it.path);
+      else
+        grepFile(&pat, it.path, &line, &cap);
+    }
+    free(it.path);
+    pthread_mutex_lock(&GR.lock);
+    int done = --GR.pending == 0;
+    if (done) {
+      GR.done = 1;
+      pthread_cond_broadcast(&GR.cond);
+    }
+    cancel = GR.cancel;
+    pthread_mutex_unlock(&GR.lock);
+    if (done)
+      editorWake();
+  }
+  free(line);
+  editorPatternFree(&pat);
+  return NULL;
+}
+
+/* Stop the search and wait for its threads, then forget its matches. */
+void grepReset() {
+  grepCancel();
+  for (int i = 0; i < GR.nthreads; i++)
+    pthread_join(GR.threads[i], NULL);
+  for (int i = 0; i < GR.ndeques; i++) {
+    free(GR.deques[i].items);
+    pthread_mutex_destroy(&GR.deques[i].lock);
+  }
+  for (int i = 0; i < GR.nmatches; i++)
+    free((char *)GR.matches[i].text);
+  for (int i = 0; i < GR.nfiles; i++)
+    free(GR.files[i]);
+  free(GR.matches);
+  free(GR.files);
+  free(GR.pattern);
+  pthread_mutex_lock(&GR.lock);
+  memset(GR.deques, 0, sizeof(GR.deques));
+  GR.nthreads = GR.ndeques = 0;
+  GR.pending = GR.pushes = GR.cancel = GR.done = 0;
+  GR.matches = NULL;
+  GR.nmatches = GR.cap = 0;
+  GR.files = NULL;
+  GR.nfiles = GR.capfiles = 0;
+  GR.pattern = NULL;
+  pthread_mutex_unlock(&GR.lock);
+}
+
+/* Start searching the files under dir for pattern, in place of the last
+   search. Returns -1 if the pattern is no good. */
+int grepStart(char *pattern, const char *dir) {
+  struct pattern pat;
+  if (editorPatternCompile(&pat, pattern, 0) == -1)
+    return -1;
+  editorPatternFree(&pat);
+  grepReset();
+
+  GR.pattern = strdup(pattern);
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  n = n < 1 ? 1 : n > GREP_THREADS ? GREP_THREADS : n;
+  for (int i = 0; i < n; i++)
+    pthread_mutex_init(&GR.deques[i].lock, NULL);
+  GR.ndeques = n;
+  GR.started = 1;
+
+  char *root = strdup(dir);
+  int len = strlen(root);
+  while (len > 1 && root[len - 1] == '/')
+    root[--len] = '\0';
+  struct stat st;
+  grepItem it = {root, stat(root, &st) == 0 && S_ISDIR(st.st_mode)};
+  grepPush(0, &it, 1);
+
+  for (int i = 0; i < n; i++) {
+    if (pthread_create(&GR.threads[GR.nthreads], NULL, grepThread,
+                       (void *)(intptr_t)i) == 0)
+      GR.nthreads++;
+  }
+  if (GR.nthreads == 0) // then search here and now
+    grepThread((void *)0);
+  return 0;
+}
+
+/* Stop the search, keeping the matches found so far. */
+void grepCancel() {
+  pthread_mutex_lock(&GR.lock);
+  GR.cancel = 1;
+  pthread_mutex_unlock(&GR.lock);
+}
+
+/* How many matches have been found, and whether the search is over. */
+int grepCount(int *done) {
+  pthread_mutex_lock(&GR.lock);
+  int n = GR.nmatches;
+  *done = !GR.started || GR.done;
+  pthread_mutex_unlock(&GR.lock);
+  return n;
+}
+
+grepMatch grepGet(int i) {
+  pthread_mutex_lock(&GR.lock);
+  grepMatch m = GR.matches[i];
+  pthread_mutex_unlock(&GR.lock);
+  return m;
+}
@@ -0,0 +1,17 @@
+#ifndef GREP_H
+#define GREP_H
+
+/* A line that matched, and where in it the match starts. */
+typedef struct grepMatch {
+  const char *file; // a path that can be opened from the working directory
+  int line;         // counting from 0
+  int col;          // a byte offset into the line
+  const char *text; // the line, without its indent and cut short
+} grepMatch;
+
+int grepStart(char *pattern, const char *dir);
+void grepCancel();
+int grepCount(int *done);
+grepMatch grepGet(int i);
+
+#endif
@@ -6,7 +6,8 @@
 
 history H;
 
-editorConfig *copyEditorConfig(editorConfig *old) {
+/* A snapshot of old's state without any of its text. */
+editorConfig *copyEditorState(editorConfig *old) {
   editorConfig *new = malloc(sizeof(editorConfig));
 
   new->cx = old->cx;
@@ -17,6 +18,7 @@ editorConfig *copyEditorConfig(editorConfig *old) {
   new->screenrows = old->screenrows;
   new->screencols = old->screencols;
   new->dirty = old->dirty;
+  new->edits = old->edits;
   new->numrows = old->numrows;
   new->filename = old->filename;
   new->statusmsg_time = old->statusmsg_time;
@@ -24,36 +26,93 @@ editorConfig *copyEditorConfig(editorConfig *old) {
   new->orig_termios = old->orig_termios;
   new->mode = old->mode;
   new->statusmsg[0] = *old->statusmsg;
+  new->undo = NULL;
+  new->redo = NULL;
+  new->row = NULL;
+  new->text = NULL;
+  new->patch = NULL;
+  new->npatch = 0;
+  return new;
+}
 
-  // copy row
-  new->row = malloc(sizeof(erow) * (old->numrows));
-  int i;
-  for (i = 0; i < new->numrows; i++) {
-    new->row[i].idx = old->row[i].idx;
-    new->row[i].size = old->row[i].size;
-    new->row[i].rsize = old->row[i].rsize;
-    new->row[i].hl_open_comment = old->row[i].hl_open_comment;
+editorConfig *copyEditorConfig(editorConfig *old) {
+  editorConfig *new = copyEditorState(old);
 
-    new->row[i].chars = malloc(old->row[i].size);
-    memcpy(new->row[i].chars, old->row[i].chars, old->row[i].size);
+  // Only the text is kept: the length of each row, then the rows one after
+  // another. The rows are rebuilt from it if the snapshot is ever restored
+  // (see history_packed).
+  size_t total = sizeof(int) * old->numrows;
+  int i;
+  for (i = 0; i < old->numrows; i++)
+    total += old->row[i].size;
+  new->text = malloc(total ? total : 1);
+  int *sizes = (int *)new->text;
+  char *text = new->text + sizeof(int) * old->numrows;
+  for (i = 0; i < old->numrows; i++) {
+    sizes[i] = old->row[i].size;
+    memcpy(text, old->row[i].chars, sizes[i]);
+    text += sizes[i];
+  }
+  return new;
+}
 
-    new->row[i].render = malloc(old->row[i].rsize);
-    memcpy(new->row[i].render, old->row[i].render, old->row[i].rsize);
+/* Free a state taken off the history, with its rows or packed text. */
+void history_free(editorConfig *e) {
+  if (history_packed(e) || history_patched(e)) {
+    free(e->patch);
+    free(e->text);
+  } else {
+    for (int j = 0; j < e->numrows; j++)
+      editorFreeRow(&e->row[j]);
+    free(e->row);
+  }
+  free(e);
+}
 
-    new->row[i].hl = malloc(old->row[i].rsize);
-    memcpy(new->row[i].hl, old->row[i].hl, old->row[i].rsize);
-    /* memset(new->row[i].hl, 0, old->row[i].rsize); // HL_NORMAL */
+/* Put snapshot in the history just before e. */
+void history_link(editorConfig *e, editorConfig *snapshot) {
+  // A new change starts a new line of history, so the states that could be
+  // redone can never be reached again.
+  for (editorConfig *r = e->redo, *next; r; r = next) {
+    next = r->redo;
+    history_free(r);
   }
-  return new;
+  snapshot->undo = e->undo;
+  if (e->undo)
+    e->undo->redo = snapshot;
+  snapshot->redo = e;
+  e->undo = snapshot;
+  e->redo = NULL;
 }
 
-struct editorConfig *history_push(struct editorConfig *snapshot) {
-  editorConfig *new_e = copyEditorConfig(snapshot);
-  snapshot->redo = new_e;
-  new_e->undo = snapshot;
-  return new_e;
+/* Save a copy of the buffer as it is now to undo back to. The live buffer
+   stays where it is, so nothing has to be rebuilt to keep editing. */
+struct editorConfig *history_push(struct editorConfig *e) {
+  history_link(e, copyEditorConfig(e));
+  return e;
 }
 
+/* Like history_push, for a change to the text of a few rows that leaves the
+   rest alone, so only theirs is kept: patch holds the index and old size of
+   each in turn, and text their old chars one after another. The snapshot
+   takes both. */
+editorConfig *history_push_rows(editorConfig *e, int *patch, int n,
+                                char *text) {
+  editorConfig *snapshot = copyEditorState(e);
+  snapshot->patch = patch;
+  snapshot->npatch = n;
+  snapshot->text = text;
+  history_link(e, snapshot);
+  return e;
+}
+
+/* Whether e is a snapshot that has to be unpacked before it is edited. */
+int history_packed(editorConfig *e) { return e->text && !e->patch; }
+
+/* Whether e is a snapshot of only the rows a change made to its neighbour on
+   the way to the live buffer, which it is restored from. */
+int history_patched(editorConfig *e) { return e->patch != NULL; }
+
 struct editorConfig *history_undo(struct editorConfig *e) {
   if (e->undo) {
     return e->undo;
@@ -9,7 +9,12 @@ typedef struct history {
 } history;
 
 editorConfig *history_push(editorConfig *e);
+editorConfig *history_push_rows(editorConfig *e, int *patch, int n,
+                                char *text);
+void history_free(editorConfig *e);
 editorConfig *history_undo(editorConfig *e);
 editorConfig *history_redo(editorConfig *e);
+int history_packed(editorConfig *e);
+int history_patched(editorConfig *e);
 
 #endif
@@ -0,0 +1,425 @@
+/* An index of the identifiers in the buffer, for completing words in insert
+   mode and for * and #. Each row keeps the identifiers the lexer left as code,
+   as numbers: a hash table gives a spelling its number, and a trie over the
+   spellings finds the ones that start with a prefix. Each identifier keeps the
+   blocks of rows it is in, so the rows with it are found without looking at
+   the others. Blocks are known by their keys, which stay the same as rows
+   are added and deleted around them, so only the rows edited are counted
+   again. */
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blocks.h"
+#include "ident.h"
+
+/* The rows of a block an identifier is in. */
+typedef struct identBlock {
+  long long key;
+  int rows;
+} identBlock;
+
+/* An identifier keeps its number while it is out of the buffer, as the rows
+   of undo states still hold it, but leaves the live list. */
+typedef struct identEntry {
+  char *s;
+  int len;
+  int rows;           // rows it is in
+  identBlock *blocks; // in order
+  int nblocks, cap;
+  int live; // where it is in ID.live, -1 if in no rows
+} identEntry;
+
+/* A trie node: the children of a node are a list in order of c. */
+typedef struct identNode {
+  char c;
+  int child, next; // 0 for none, as node 0 is the root
+  int word;        // the identifier spelled out down to here, or -1
+} identNode;
+
+struct identIndex {
+  identEntry *words;
+  int nwords, capwords;
+  int *hash; // word + 1 in each slot, or 0
+  int hashcap;
+  identNode *nodes;
+  int nnodes, capnodes;
+  int *scratch; // the words of the row being scanned
+  int capscratch;
+  int *live; // the words in at least one row
+  int nlive, caplive;
+  rowBlocks blocks;
+  int labels; // blocks.labels when the keys in the words were last good
+} ID;
+
+int identChar(int c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_';
+}
+
+unsigned identHash(const char *s, int len) {
+  unsigned h = 2166136261u;
+  for (int i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  return h;
+}
+
+/* The slot in the hash table for s, with hash h, which holds it or is
+   empty. */
+int *identSlot(const char *s, int len, unsigned h) {
+  unsigned i = h & (ID.hashcap - 1);
+  for (;; i = (i + 1) & (ID.hashcap - 1)) {
+    int w = ID.hash[i] - 1;
+    if (w == -1 ||
+        (ID.words[w].len == len && !memcmp(ID.words[w].s, s, len)))
+      return &ID.hash[i];
+  }
+}
+
+/* The child of node spelled with c, added if add is set, or 0. */
+int identChild(int node, char c, int add) {
+  int *link = &ID.nodes[node].child;
+  while (*link && ID.nodes[*link].c < c)
+    link = &ID.nodes[*link].next;
+  if (*link && ID.nodes[*link].c == c)
+    return *link;
+  if (!add)
+    return 0;
+  if (ID.nnodes == ID.capnodes) {
+    ID.capnodes *= 2;
+    ptrdiff_t at = (char *)link - (char *)ID.nodes;
+    ID.nodes = realloc(ID.nodes, sizeof(identNode) * ID.capnodes);
+    link = (int *)((char *)ID.nodes + at);
+  }
+  int n = ID.nnodes++;
+  ID.nodes[n] = (identNode){c, 0, *link, -1};
+  *link = n;
+  return n;
+}
+
+/* The number of the identifier s, with hash h, given one the first time it
+   is seen. */
+int identIntern(const char *s, int len, unsigned h) {
+  if (ID.hashcap == 0) {
+    ID.hashcap = 1024;
+    ID.hash = calloc(ID.hashcap, sizeof(int));
+    ID.capnodes = 1024;
+    ID.nodes = malloc(sizeof(identNode) * ID.capnodes);
+    ID.nodes[0] = (identNode){0, 0, 0, -1};
+    ID.nnodes = 1;
+  }
+  int *slot = identSlot(s, len, h);
+  if (*slot)
+    return *slot - 1;
+
+  int w = ID.nwords++;
+  if (w == ID.capwords) {
+    ID.capwords = ID.capwords ? ID.capwords * 2 : 256;
+    ID.words = realloc(ID.words, sizeof(identEntry) * ID.capwords);
+  }
+  identEntry *e = &ID.words[w];
+  memset(e, 0, sizeof(*e));
+  e->live = -1;
+  e->s = malloc(len + 1);
+  memcpy(e->s, s, len);
+  e->s[len] = '\0';
+  e->len = len;
+  *slot = w + 1;
+  int node = 0;
+  for (int i = 0; i < len; i++)
+    node = identChild(node, s[i], 1);
+  ID.nodes[node].word = w;
+
+  if (ID.nwords * 2 > ID.hashcap) { // keep it at most half full
+    free(ID.hash);
+    ID.hashcap *= 2;
+    ID.hash = calloc(ID.hashcap, sizeof(int));
+    for (int i = 0; i < ID.nwords; i++)
+      *identSlot(ID.words[i].s, ID.words[i].len,
+                 identHash(ID.words[i].s, ID.words[i].len)) = i + 1;
+  }
+  return w;
+}
+
+/* The index of the block with key in the blocks of e, or where it would
+   go. */
+int identBlockAt(identEntry *e, long long key) {
+  int lo = 0, hi = e->nblocks;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (e->blocks[mid].key < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Take word off the live list, now that it is in no rows. */
+void identUnlive(int word) {
+  identEntry *e = &ID.words[word];
+  int last = ID.live[--ID.nlive];
+  ID.live[e->live] = last;
+  ID.words[last].live = e->live;
+  e->live = -1;
+  free(e->blocks);
+  e->blocks = NULL;
+  e->nblocks = e->cap = 0;
+}
+
+/* Count a row with word in it in the block with key. */
+void identAdd(int word, long long key) {
+  identEntry *e = &ID.words[word];
+  int i = e->nblocks > 0 && e->blocks[e->nblocks - 1].key < key
+              ? e->nblocks // the common case, adding rows in order
+              : identBlockAt(e, key);
+  if (i == e->nblocks || e->blocks[i].key != key) {
+    if (e->nblocks == e->cap) {
+      e->cap = e->cap ? e->cap * 2 : 4;
+      e->blocks = realloc(e->blocks, sizeof(identBlock) * e->cap);
+    }
+    memmove(&e->blocks[i + 1], &e->blocks[i],
+            sizeof(identBlock) * (e->nblocks - i));
+    e->blocks[i] = (identBlock){key, 0};
+    e->nblocks++;
+  }
+  e->blocks[i].rows++;
+  if (e->rows++ == 0) {
+    if (ID.nlive == ID.caplive) {
+      ID.caplive = ID.caplive ? ID.caplive * 2 : 256;
+      ID.live = realloc(ID.live, sizeof(int) * ID.caplive);
+    }
+    e->live = ID.nlive;
+    ID.live[ID.nlive++] = word;
+  }
+}
+
+void identRemove(int word, long long key) {
+  identEntry *e = &ID.words[word];
+  int i = identBlockAt(e, key);
+  if (i == e->nblocks || e->blocks[i].key != key)
+    return;
+  if (--e->blocks[i].rows == 0) {
+    e->nblocks--;
+    memmove(&e->blocks[i], &e->blocks[i + 1],
+            sizeof(identBlock) * (e->nblocks - i));
+  }
+  if (--e->rows == 0)
+    identUnlive(word);
+}
+
+int identCompare(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+/* Note the identifiers in a row that has just been lexed: runs of letters,
+   digits and underscores not starting with a digit, outside of strings and
+   comments. */
+void identScan(editorConfig *e, erow *row) {
+  int n = 0;
+  for (int j = 0; j < row->rsize; j++) {
+    if (!identChar(row->render[j]))
+      continue;
+    int start = j;
+    unsigned h = 2166136261u; // identHash, as it goes
+    for (; j < row->rsize && identChar(row->render[j]); j++)
+      h = (h ^ (unsigned char)row->render[j]) * 16777619u;
+    unsigned char hl = row->hl[start];
+    if ((row->render[start] >= '0' && row->render[start] <= '9') ||
+        hl == HL_STRING || hl == HL_COMMENT || hl == HL_MLCOMMENT)
+      continue;
+    if (n == ID.capscratch) {
+      ID.capscratch = ID.capscratch ? ID.capscratch * 2 : 64;
+      ID.scratch = realloc(ID.scratch, sizeof(int) * ID.capscratch);
+    }
+    ID.scratch[n++] = identIntern(&row->render[start], j - start, h);
+  }
+  // rows have few identifiers, so an insertion sort dropping repeats is quick
+  int *ids = ID.scratch, u = 0;
+  for (int i = 0; i < n; i++) {
+    int w = ids[i], k = u;
+    while (k > 0 && ids[k - 1] > w)
+      k--;
+    if (k > 0 && ids[k - 1] == w)
+      continue;
+    memmove(&ids[k + 1], &ids[k], sizeof(int) * (u - k));
+    ids[k] = w;
+    u++;
+  }
+  n = u;
+  if (n == row->nidents &&
+      (n == 0 || !memcmp(ids, row->idents, sizeof(int) * n)))
+    return;
+
+  // rows yet to be laid out in blocks are counted when they are
+  int block = blocksOf(&ID.blocks, row->idx);
+  if (block != -1 && &e->row[row->idx] == row) {
+    long long key = ID.blocks.key[block];
+    int i = 0, k = 0;
+    while (i < row->nidents || k < n) {
+      if (k == n || (i < row->nidents && row->idents[i] < ids[k]))
+        identRemove(row->idents[i++], key);
+      else if (i == row->nidents || ids[k] < row->idents[i])
+        identAdd(ids[k++], key);
+      else {
+        i++;
+        k++;
+      }
+    }
+  }
+  if (n > row->nidents)
+    row->idents = realloc(row->idents, sizeof(int) * n);
+  if (n > 0)
+    memcpy(row->idents, ids, sizeof(int) * n);
+  row->nidents = n;
+}
+
+/* Rows from at on were moved in a way that can't be followed, so the blocks
+   from there on have to be laid out and counted again. */
+void identRowsMoved(int at) { blocksMoved(&ID.blocks, at); }
+
+/* n rows are about to be added at at, or -n deleted from there. The rows
+   deleted are taken out of the counts while they are still there; the rest
+   stay in the blocks they were counted in. */
+void identRowsShifted(editorConfig *e, int at, int n) {
+  for (int y = at; y < at - n; y++) {
+    int block = blocksOf(&ID.blocks, y);
+    if (block == -1)
+      break;
+    for (int i = 0; i < e->row[y].nidents; i++)
+      identRemove(e->row[y].idents[i], ID.blocks.key[block]);
+  }
+  blocksShift(&ID.blocks, at, n);
+}
+
+/* Take the blocks with keys from key on out of the counts. */
+void identDrop(long long key) {
+  for (int i = ID.nlive - 1; i >= 0; i--) {
+    int w = ID.live[i];
+    identEntry *ent = &ID.words[w];
+    while (ent->nblocks > 0 && ent->blocks[ent->nblocks - 1].key >= key)
+      ent->rows -= ent->blocks[--ent->nblocks].rows;
+    if (ent->rows == 0)
+      identUnlive(w);
+  }
+}
+
+/* Count the rows of block. */
+void identCount(editorConfig *e, int block) {
+  long long key = ID.blocks.key[block];
+  for (int y = ID.blocks.start[block]; y < ID.blocks.start[block + 1]; y++)
+    for (int i = 0; i < e->row[y].nidents; i++)
+      identAdd(e->row[y].idents[i], key);
+}
+
+/* Count the rows laid out in blocks again, and move the rows of blocks that
+   were cut up into their new blocks. */
+void identUpdate(editorConfig *e) {
+  rowBlocks *b = &ID.blocks;
+  int first = blocksLayout(b, e->numrows), block;
+  if (first != -1) {
+    identDrop(b->cut);
+    for (block = first; block < b->n; block++)
+      identCount(e, block);
+  }
+  int recount = 0;
+  while ((block = blocksTouched(b)) != -1) {
+    long long key = b->key[block];
+    int pieces = blocksSplit(b, block);
+    recount |= b->labels != ID.labels;
+    for (int i = block + 1; !recount && i < block + pieces; i++) {
+      for (int y = b->start[i]; y < b->start[i + 1]; y++) {
+        erow *row = &e->row[y];
+        for (int j = 0; j < row->nidents; j++) {
+          identRemove(row->idents[j], key);
+          identAdd(row->idents[j], b->key[i]);
+        }
+      }
+    }
+  }
+  if (recount) { // the keys were all numbered again
+    ID.labels = b->labels;
+    identDrop(LLONG_MIN);
+    for (block = 0; block < b->n; block++)
+      identCount(e, block);
+  }
+}
+
+/* The number of identifier s, or -1 if it has never been in the buffer. */
+int identFind(const char *s, int len) {
+  if (ID.hashcap == 0)
+    return -1;
+  return *identSlot(s, len, identHash(s, len)) - 1;
+}
+
+const char *identWord(int word) { return ID.words[word].s; }
+
+int identRowHas(erow *row, int word) {
+  return bsearch(&word, row->idents, row->nidents, sizeof(int),
+                 identCompare) != NULL;
+}
+
+/* How many rows word is in. */
+int identRows(editorConfig *e, int word) {
+  identUpdate(e);
+  return ID.words[word].rows;
+}
+
+/* The first row in block from row from on going in direction dir with word
+   in it, or -1. */
+int identRowIn(editorConfig *e, int word, int block, int from, int dir) {
+  int first = ID.blocks.start[block], last = ID.blocks.start[block + 1] - 1;
+  for (int y = from; y >= first && y <= last; y += dir)
+    if (identRowHas(&e->row[y], word))
+      return y;
+  return -1;
+}
+
+/* The next row after y with word in it going in direction dir, wrapping
+   around the ends of the buffer, or -1 if no row has it. */
+int identNextRow(editorConfig *e, int word, int y, int dir) {
+  identUpdate(e);
+  identEntry *ent = &ID.words[word];
+  if (ent->nblocks == 0)
+    return -1;
+  int n = ent->nblocks, block = blocksFind(&ID.blocks, y);
+  int y_at = identBlockAt(ent, ID.blocks.key[block]);
+  int own = y_at < n && ent->blocks[y_at].key == ID.blocks.key[block];
+  int r = own ? identRowIn(e, word, block, y + dir, dir) : -1;
+  // then the other blocks in turn, and y's own again from its other end
+  int i = dir > 0 ? y_at + own : y_at - 1;
+  for (int k = 0; r == -1 && k < n; k++, i += dir) {
+    i = (i + n) % n;
+    int b = blocksByKey(&ID.blocks, ent->blocks[i].key);
+    int from = dir > 0 ? ID.blocks.start[b] : ID.blocks.start[b + 1] - 1;
+    r = identRowIn(e, word, b, from, dir);
+  }
+  return r;
+}
+
+void identCollect(int node, int *words, int max, int *n) {
+  for (int c = ID.nodes[node].child; c && *n < max; c = ID.nodes[c].next) {
+    int w = ID.nodes[c].word;
+    if (w != -1 && ID.words[w].rows > 0)
+      words[(*n)++] = w;
+    identCollect(c, words, max, n);
+  }
+}
+
+/* Put up to max of the identifiers in the buffer that start with prefix, and
+   are longer, into words in order. Returns how many there are. */
+int identComplete(editorConfig *e, const char *prefix, int len, int *words,
+                  int max) {
+  if (ID.hashcap == 0)
+    return 0;
+  identUpdate(e);
+  int node = 0, n = 0;
+  for (int i = 0; i < len; i++)
+    if ((node = identChild(node, prefix[i], 0)) == 0)
+      return 0;
+  identCollect(node, words, max, &n);
+  return n;
+}
@@ -0,0 +1,18 @@
+#ifndef IDENT_H
+#define IDENT_H
+
+#include "bse.h"
+
+int identChar(int c);
+void identScan(editorConfig *e, erow *row);
+void identRowsMoved(int at);
+void identRowsShifted(editorConfig *e, int at, int n);
+int identFind(const char *s, int len);
+const char *identWord(int word);
+int identRowHas(erow *row, int word);
+int identRows(editorConfig *e, int word);
+int identNextRow(editorConfig *e, int word, int y, int dir);
+int identComplete(editorConfig *e, const char *prefix, int len, int *words,
+                  int max);
+
+#endif
@@ -0,0 +1,150 @@
+/* The body of a row lexer. It is included once for the generic lexer in bse.c
+   and once per built-in language in the generated hl_gen.h, with these macros
+   describing the language:
+
+     LEX_NAME                   the name of the function
+     LEX_INIT                   declarations the other macros rely on
+     LEX_CLS(c)                 the CLS_* bits of byte c
+     LEX_SCS, LEX_SCS_LEN       the single line comment start
+     LEX_MCS, LEX_MCS_LEN       the multiline comment start
+     LEX_MCE, LEX_MCE_LEN       the multiline comment end
+     LEX_KEYWORD(p, left, klen) the highlight of the keyword at p, or 0
+
+   A language without some delimiter leaves its CLS_* bit clear, so the
+   comparison is never reached. */
+
+/* Highlight row->render from index i onwards, starting in state st.
+
+   The state is saved at the first token boundary after every BSE_LEX_STEP
+   bytes. When converge is not -1, lexing stops at the first old checkpoint at
+   or after converge whose state matches the current one, since everything
+   from there on highlights the same as it did before. Returns 1 if it stopped
+   early. */
+int LEX_NAME(erow *row, int i, lexState st, int converge) {
+  LEX_INIT
+  char *render = row->render;
+
+  int prev_sep = st.prev_sep;
+  int in_string = st.in_string;
+  int in_comment = st.in_comment;
+
+  int ck = 0; // the next checkpoint after i
+  while (ck < row->nchunks && row->chunks[ck].rx <= i)
+    ck++;
+  int last = i; // where the last checkpoint was taken
+
+  while (i < row->rsize) {
+    if ((ck < row->nchunks && i >= row->chunks[ck].rx) ||
+        i - last >= BSE_LEX_STEP) {
+      lexState now = {in_string, in_comment, prev_sep,
+                      i > 0 && row->hl[i - 1] == HL_NUMBER};
+      if (converge != -1 && i >= converge && ck < row->nchunks &&
+          i == row->chunks[ck].rx && lexStateEq(now, row->chunks[ck].st))
+        return 1;
+      if (i - last < BSE_LEX_STEP / 2 && ck < row->nchunks &&
+          i >= row->chunks[ck].rx) {
+        // deletions have crowded the checkpoints together, thin them out
+        memmove(&row->chunks[ck], &row->chunks[ck + 1],
+                sizeof(rowChunk) * (row->nchunks - ck - 1));
+        row->nchunks--;
+        continue;
+      }
+      editorRowSetChunk(row, ck++, i, now);
+      last = i;
+    }
+
+    unsigned char c = render[i];
+    unsigned char cls = LEX_CLS(c);
+    int left = row->rsize - i;
+
+    if (in_comment) {
+      row->hl[i] = HL_MLCOMMENT;
+      if ((cls & CLS_MCE) && left >= LEX_MCE_LEN &&
+          !memcmp(&render[i], LEX_MCE, LEX_MCE_LEN)) {
+        memset(&row->hl[i], HL_MLCOMMENT, LEX_MCE_LEN);
+        i += LEX_MCE_LEN;
+        in_comment = 0;
+        prev_sep = 1;
+      } else {
+        i++;
+      }
+      continue;
+    }
+
+    if (in_string) {
+      row->hl[i] = HL_STRING;
+      // backslashes should keep this as a string
+      if (c == '\\' && i + 1 < row->rsize) {
+        row->hl[i + 1] = HL_STRING;
+        i += 2;
+        continue;
+      }
+      if (c == in_string)
+        in_string = 0; // this is the closing quote
+      i++;
+      prev_sep = 1;
+      continue;
+    }
+
+    if ((cls & CLS_SCS) && left >= LEX_SCS_LEN &&
+        !memcmp(&render[i], LEX_SCS, LEX_SCS_LEN)) {
+      memset(&row->hl[i], HL_COMMENT, left);
+      break;
+    }
+
+    if ((cls & CLS_MCS) && left >= LEX_MCS_LEN &&
+        !memcmp(&render[i], LEX_MCS, LEX_MCS_LEN)) {
+      memset(&row->hl[i], HL_MLCOMMENT, LEX_MCS_LEN);
+      i += LEX_MCS_LEN;
+      in_comment = 1;
+      continue;
+    }
+
+    if (cls & CLS_QUOTE) {
+      in_string = c;
+      row->hl[i] = HL_STRING;
+      i++;
+      continue;
+    }
+
+    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+    if (((cls & CLS_DIGIT) && (prev_sep || prev_hl == HL_NUMBER)) ||
+        ((cls & CLS_DOT) && prev_hl == HL_NUMBER)) {
+      row->hl[i] = HL_NUMBER;
+      i++;
+      prev_sep = 0; // it wasn't a separator because we know it was number
+      continue;
+    }
+
+    if (prev_sep && (cls & CLS_KW)) {
+      int klen;
+      int type = LEX_KEYWORD(&render[i], left, &klen);
+      if (type) {
+        memset(&row->hl[i], type, klen);
+        i += klen;
+        prev_sep = 0;
+        continue;
+      }
+    }
+
+    row->hl[i] = HL_NORMAL; // may be stale when re-lexing part of a row
+    prev_sep = (cls & CLS_SEP) != 0;
+    i++;
+  }
+
+  row->nchunks = ck; // checkpoints past the end are stale
+
+  row->hl_open_comment = in_comment;
+  return 0;
+}
+
+#undef LEX_NAME
+#undef LEX_INIT
+#undef LEX_CLS
+#undef LEX_SCS
+#undef LEX_SCS_LEN
+#undef LEX_MCS
+#undef LEX_MCS_LEN
+#undef LEX_MCE
+#undef LEX_MCE_LEN
+#undef LEX_KEYWORD
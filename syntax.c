@@ -0,0 +1,472 @@
+/* Syntax definitions: the built-in languages, definition files loaded at
+   startup, and the tables they are compiled into for the lexer.
+
+   Definition files live in $BSE_SYNTAX_DIR (default ~/.config/bse/syntax) and
+   end in ".syn". Each line is a directive followed by its arguments:
+
+     filetype pascal
+     match .pas .pp
+     comment //
+     multiline (* *)
+     numbers
+     strings
+     keyword begin end if then else while do var
+     type integer boolean string
+
+   "keyword" words are highlighted as HL_KEYWORD1, "type" words as
+   HL_KEYWORD2. The compiled tables are cached in ~/.cache/bse/syntax.bin and
+   mapped straight back in while the definition files are unchanged. */
+
+#define _DEFAULT_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "syntax.h"
+
+#define SYN_MAGIC "BSESYN1"
+#define SYN_VERSION 1
+
+char *C_HL_extensions[] = {".c", ".h", ".cpp", ".hpp", NULL};
+char *C_HL_keywords[] = {
+    "switch", "if",      "while",  "for",     "break",     "continue",
+    "return", "else",    "struct", "union",   "typedef",   "static",
+    "enum",   "class",   "case",   "#define", "#include",  "int|",
+    "long|",  "double|", "float|", "char|",   "unsigned|", "signed|",
+    "void|",  NULL};
+
+char *BC_HL_extensions[] = {".bc", ".bh", NULL};
+char *BC_HL_keywords[] = {
+    "switch", "if",      "while",  "for",     "break",     "continue",
+    "return", "else",    "struct", "union",   "typedef",   "static",
+    "enum",   "class",   "case",   "#define", "#include",  "int|",
+    "long|",  "double|", "float|", "char|",   "unsigned|", "signed|",
+    "void|",  "string|", NULL};
+
+char *Go_HL_extensions[] = {".go", NULL};
+char *Go_HL_keywords[] = {
+    "const", "var", "func", "type", "import", "package",
+    "chan", "interface", "map", "struct",
+    "break", "case", "continue", "default", "else", "fallthrough", "for",
+    "goto", "if", "range", "return", "select", "switch",
+    "defer", "go", NULL};
+
+struct editorSyntax HLDB[] = {
+     {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/",
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS, NULL, NULL},
+     {"ben-c", BC_HL_extensions, BC_HL_keywords, "//", "/*", "*/",
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS, NULL, NULL},
+     {"go", Go_HL_extensions, Go_HL_keywords, "//", "/*", "*/",
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS, NULL, NULL},
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+synTable builtin[HLDB_ENTRIES]; // HLDB compiled at startup
+
+struct synCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t count; // synTables following the header
+  uint64_t fingerprint;
+};
+
+struct editorSyntax *loaded = NULL; // languages from definition files
+int nloaded = 0;
+
+int is_separator(int c) {
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+uint32_t syntaxHash(const char *s, int len) {
+  uint32_t h = 2166136261u; // FNV-1a
+  for (int i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/* Look up the word starting at s, which is at most len bytes long. Returns its
+   highlight and sets *klen, or returns 0 if it isn't a keyword. */
+int syntaxKeyword(const synTable *t, const char *s, int len, int *klen) {
+  int n = 0;
+  while (n < len && !(t->cls[(unsigned char)s[n]] & CLS_SEP)) {
+    if (++n > t->kw_max)
+      return 0;
+  }
+  uint32_t slot = syntaxHash(s, n) & (SYN_KW_SLOTS - 1);
+  while (t->kw[slot].len) {
+    if (t->kw[slot].len == n && !memcmp(t->kw[slot].s, s, n)) {
+      *klen = n;
+      return t->kw[slot].type;
+    }
+    slot = (slot + 1) & (SYN_KW_SLOTS - 1);
+  }
+  return 0;
+}
+
+void syntaxCopyName(char *dst, const char *src, int size) {
+  strncpy(dst, src, size - 1);
+  dst[size - 1] = '\0';
+}
+
+/* Copy a comment delimiter into the table, marking its first byte. */
+int syntaxCompileDelim(synTable *t, char *dst, const char *src, int cls) {
+  if (src == NULL)
+    return 0;
+  int len = strlen(src);
+  if (len == 0 || len >= SYN_DELIM_MAX)
+    return 0;
+  memcpy(dst, src, len);
+  t->cls[(unsigned char)src[0]] |= cls;
+  if (len > t->lookahead)
+    t->lookahead = len;
+  return len;
+}
+
+/* Compile a language description into the tables the lexer runs on. */
+void syntaxCompile(struct editorSyntax *s, synTable *t) {
+  memset(t, 0, sizeof(*t));
+  syntaxCopyName(t->filetype, s->filetype, SYN_NAME_MAX);
+  for (int i = 0; i < SYN_MATCH_MAX && s->filematch[i]; i++)
+    syntaxCopyName(t->filematch[i], s->filematch[i], SYN_NAME_MAX);
+  t->flags = s->flags;
+  t->lookahead = 2; // a backslash escape covers two characters
+
+  for (int c = 0; c < 256; c++) {
+    if (is_separator(c))
+      t->cls[c] |= CLS_SEP;
+    if ((s->flags & HL_HIGHLIGHT_NUMBERS) && isdigit(c))
+      t->cls[c] |= CLS_DIGIT;
+  }
+  if (s->flags & HL_HIGHLIGHT_NUMBERS)
+    t->cls['.'] |= CLS_DOT;
+  if (s->flags & HL_HIGHLIGHT_STRINGS) {
+    t->cls['"'] |= CLS_QUOTE;
+    t->cls['\''] |= CLS_QUOTE;
+  }
+
+  t->scs_len = syntaxCompileDelim(t, t->scs, s->singleline_comment_start,
+                                  CLS_SCS);
+  // multiline comments need both ends
+  if (s->multiline_comment_start && s->multiline_comment_end) {
+    t->mcs_len = syntaxCompileDelim(t, t->mcs, s->multiline_comment_start,
+                                    CLS_MCS);
+    t->mce_len =
+        syntaxCompileDelim(t, t->mce, s->multiline_comment_end, CLS_MCE);
+    if (!t->mcs_len || !t->mce_len)
+      t->mcs_len = t->mce_len = 0;
+  }
+
+  int nkw = 0;
+  for (int j = 0; s->keywords && s->keywords[j]; j++) {
+    int len = strlen(s->keywords[j]);
+    int kw2 = len > 0 && s->keywords[j][len - 1] == '|';
+    if (kw2)
+      len--;
+    // keep the table at most half full so probes stay short
+    if (len == 0 || len > SYN_KW_MAX || nkw >= SYN_KW_SLOTS / 2)
+      continue;
+    uint32_t slot = syntaxHash(s->keywords[j], len) & (SYN_KW_SLOTS - 1);
+    while (t->kw[slot].len)
+      slot = (slot + 1) & (SYN_KW_SLOTS - 1);
+    t->kw[slot].len = len;
+    t->kw[slot].type = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+    memcpy(t->kw[slot].s, s->keywords[j], len);
+    t->cls[(unsigned char)s->keywords[j][0]] |= CLS_KW;
+    if (len > t->kw_max)
+      t->kw_max = len;
+    nkw++;
+  }
+  if (t->kw_max + 1 > t->lookahead)
+    t->lookahead = t->kw_max + 1; // the separator after a keyword
+}
+
+/* Append the whitespace separated words of args to a NULL terminated list,
+   each followed by suffix. */
+char **syntaxAddWords(char **list, int *n, char *args, const char *suffix) {
+  char *word;
+  while ((word = strsep(&args, " \t")) != NULL) {
+    if (*word == '\0')
+      continue;
+    list = realloc(list, sizeof(char *) * (*n + 2));
+    list[*n] = malloc(strlen(word) + strlen(suffix) + 1);
+    strcpy(list[*n], word);
+    strcat(list[*n], suffix);
+    list[++*n] = NULL;
+  }
+  return list;
+}
+
+void syntaxFreeWords(char **list) {
+  for (int i = 0; list && list[i]; i++)
+    free(list[i]);
+  free(list);
+}
+
+/* Parse a definition file and compile it into t. Returns -1 if the file
+   can't be read or names no filetype. */
+int syntaxParseFile(const char *path, synTable *t) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+
+  struct editorSyntax s = {NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL};
+  int nmatch = 0, nkw = 0;
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    while (linelen > 0 && isspace((unsigned char)line[linelen - 1]))
+      line[--linelen] = '\0';
+    char *args = line;
+    char *cmd = strsep(&args, " \t");
+    if (*cmd == '\0' || *cmd == '#')
+      continue;
+    if (args == NULL)
+      args = "";
+
+    if (!strcmp(cmd, "filetype")) {
+      free(s.filetype);
+      s.filetype = strdup(args);
+    } else if (!strcmp(cmd, "match")) {
+      s.filematch = syntaxAddWords(s.filematch, &nmatch, args, "");
+    } else if (!strcmp(cmd, "comment")) {
+      free(s.singleline_comment_start);
+      s.singleline_comment_start = strdup(args);
+    } else if (!strcmp(cmd, "multiline")) {
+      char *end = args;
+      char *start = strsep(&end, " \t");
+      free(s.multiline_comment_start);
+      free(s.multiline_comment_end);
+      s.multiline_comment_start = strdup(start);
+      s.multiline_comment_end = end ? strdup(end) : NULL;
+    } else if (!strcmp(cmd, "numbers")) {
+      s.flags |= HL_HIGHLIGHT_NUMBERS;
+    } else if (!strcmp(cmd, "strings")) {
+      s.flags |= HL_HIGHLIGHT_STRINGS;
+    } else if (!strcmp(cmd, "keyword")) {
+      s.keywords = syntaxAddWords(s.keywords, &nkw, args, "");
+    } else if (!strcmp(cmd, "type")) {
+      s.keywords = syntaxAddWords(s.keywords, &nkw, args, "|");
+    }
+  }
+  free(line);
+  fclose(fp);
+
+  int ok = s.filetype != NULL && s.filematch != NULL;
+  if (ok)
+    syntaxCompile(&s, t);
+
+  free(s.filetype);
+  syntaxFreeWords(s.filematch);
+  syntaxFreeWords(s.keywords);
+  free(s.singleline_comment_start);
+  free(s.multiline_comment_start);
+  free(s.multiline_comment_end);
+  return ok ? 0 : -1;
+}
+
+/* Build the directory and cache paths from the environment. */
+int syntaxPaths(char *dir, char *cache, char *cachedir) {
+  const char *home = getenv("HOME");
+  const char *env = getenv("BSE_SYNTAX_DIR");
+  if (env)
+    snprintf(dir, PATH_MAX, "%s", env);
+  else if (getenv("XDG_CONFIG_HOME"))
+    snprintf(dir, PATH_MAX, "%s/bse/syntax", getenv("XDG_CONFIG_HOME"));
+  else if (home)
+    snprintf(dir, PATH_MAX, "%s/.config/bse/syntax", home);
+  else
+    return -1;
+
+  if (cacheDir(cachedir) == -1)
+    return -1;
+  snprintf(cache, PATH_MAX, "%s/syntax.bin", cachedir);
+  return 0;
+}
+
+int syntaxCompareNames(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Map the cache if it was built from the same files. */
+synTable *syntaxMapCache(const char *cache, uint64_t fingerprint,
+                         uint32_t count) {
+  int fd = open(cache, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+  struct stat st;
+  size_t size = sizeof(struct synCacheHeader) + sizeof(synTable) * count;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size == size)
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  struct synCacheHeader *h = map;
+  if (memcmp(h->magic, SYN_MAGIC, sizeof(h->magic)) ||
+      h->version != SYN_VERSION || h->count != count ||
+      h->fingerprint != fingerprint) {
+    munmap(map, size);
+    return NULL;
+  }
+  return (synTable *)(h + 1);
+}
+
+/* Write the compiled tables out, replacing the old cache atomically. */
+void syntaxWriteCache(const char *cache, const char *cachedir,
+                      uint64_t fingerprint, synTable *tables, int count) {
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.%d", cache, (int)getpid());
+  cacheMkdirs(cachedir);
+
+  struct synCacheHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, SYN_MAGIC, sizeof(h.magic));
+  h.version = SYN_VERSION;
+  h.count = count;
+  h.fingerprint = fingerprint;
+
+  FILE *fp = fopen(tmp, "w");
+  if (!fp)
+    return;
+  int ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+           fwrite(tables, sizeof(synTable), count, fp) == (size_t)count;
+  if (fclose(fp) == 0 && ok)
+    rename(tmp, cache);
+  else
+    unlink(tmp);
+}
+
+/* Load the definition files, from the cache when nothing has changed. */
+void syntaxLoad() {
+  char dir[PATH_MAX], cache[PATH_MAX], cachedir[PATH_MAX];
+  if (syntaxPaths(dir, cache, cachedir) == -1)
+    return;
+  DIR *d = opendir(dir);
+  if (!d)
+    return;
+
+  char **names = NULL;
+  int count = 0;
+  struct dirent *ent;
+  while ((ent = readdir(d)) != NULL) {
+    int len = strlen(ent->d_name);
+    if (len > 4 && !strcmp(&ent->d_name[len - 4], ".syn")) {
+      names = realloc(names, sizeof(char *) * (count + 1));
+      names[count++] = strdup(ent->d_name);
+    }
+  }
+  closedir(d);
+  if (count == 0)
+    return;
+  qsort(names, count, sizeof(char *), syntaxCompareNames);
+
+  // The cache is valid for exactly this set of files as they are now.
+  uint64_t fingerprint = SYN_VERSION;
+  char path[PATH_MAX];
+  for (int i = 0; i < count; i++) {
+    struct stat st;
+    if (snprintf(path, sizeof(path), "%s/%s", dir, names[i]) >= PATH_MAX ||
+        stat(path, &st) == -1)
+      continue;
+    uint64_t stamp[2] = {(uint64_t)st.st_size, (uint64_t)st.st_mtime};
+    fingerprint = fingerprint * 31 + syntaxHash(names[i], strlen(names[i]));
+    fingerprint = fingerprint * 31 + syntaxHash((char *)stamp, sizeof(stamp));
+  }
+
+  synTable *tables = syntaxMapCache(cache, fingerprint, count);
+  int ntables = count;
+  if (tables == NULL) {
+    tables = malloc(sizeof(synTable) * count);
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+      if (snprintf(path, sizeof(path), "%s/%s", dir, names[i]) < PATH_MAX &&
+          syntaxParseFile(path, &tables[n]) == 0)
+        n++;
+      else
+        message("Bad syntax definition %s", path);
+    }
+    // a short count no longer matches the fingerprint, so bad files are
+    // retried until they are fixed
+    syntaxWriteCache(cache, cachedir, fingerprint, tables, n);
+    ntables = n;
+  }
+  for (int i = 0; i < count; i++)
+    free(names[i]);
+  free(names);
+  count = ntables;
+
+  loaded = calloc(count, sizeof(struct editorSyntax));
+  for (int i = 0; i < count; i++) {
+    synTable *t = &tables[i];
+    struct editorSyntax *s = &loaded[i];
+    int n = 0;
+    s->filematch = calloc(SYN_MATCH_MAX + 1, sizeof(char *));
+    while (n < SYN_MATCH_MAX && t->filematch[n][0]) {
+      s->filematch[n] = t->filematch[n];
+      n++;
+    }
+    s->filetype = t->filetype;
+    s->singleline_comment_start = t->scs_len ? t->scs : NULL;
+    s->multiline_comment_start = t->mcs_len ? t->mcs : NULL;
+    s->multiline_comment_end = t->mce_len ? t->mce : NULL;
+    s->flags = t->flags;
+    s->table = t;
+  }
+  nloaded = count;
+}
+
+/* The j-th built-in language, or NULL past the last one. */
+struct editorSyntax *syntaxBuiltin(unsigned int j) {
+  if (j >= HLDB_ENTRIES)
+    return NULL;
+  if (HLDB[j].table == NULL) {
+    syntaxCompile(&HLDB[j], &builtin[j]);
+    HLDB[j].table = &builtin[j];
+  }
+  return &HLDB[j];
+}
+
+void syntaxInit() {
+  for (unsigned int j = 0; syntaxBuiltin(j); j++)
+    ;
+  syntaxLoad();
+}
+
+int syntaxMatches(struct editorSyntax *s, const char *filename) {
+  const char *ext = strrchr(filename, '.');
+  for (int i = 0; s->filematch[i]; i++) {
+    int is_ext = (s->filematch[i][0] == '.');
+    if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+        (!is_ext && strstr(filename, s->filematch[i])))
+      return 1;
+  }
+  return 0;
+}
+
+/* The language for filename. Definition files take precedence over the
+   built-in languages. */
+struct editorSyntax *syntaxFind(const char *filename) {
+  for (int j = 0; j < nloaded; j++) {
+    if (syntaxMatches(&loaded[j], filename))
+      return &loaded[j];
+  }
+  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+    if (syntaxMatches(&HLDB[j], filename))
+      return &HLDB[j];
+  }
+  return NULL;
+}
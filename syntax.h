@@ -0,0 +1,51 @@
+#ifndef SYNTAX_H
+#define SYNTAX_H
+
+#include <stdint.h>
+
+#include "bse.h"
+
+#define SYN_KW_SLOTS 256   // keyword hash table size, a power of two
+#define SYN_KW_MAX 31      // longest keyword that can be recognised
+#define SYN_DELIM_MAX 8    // longest comment delimiter
+#define SYN_MATCH_MAX 8    // filename patterns per language
+#define SYN_NAME_MAX 24    // longest filetype name or filename pattern
+
+// character classes, one byte per character in synTable.cls
+#define CLS_SEP (1 << 0)   // separates words
+#define CLS_DIGIT (1 << 1) // starts or continues a number
+#define CLS_DOT (1 << 2)   // continues a number
+#define CLS_QUOTE (1 << 3) // opens a string
+#define CLS_SCS (1 << 4)   // first byte of the single line comment start
+#define CLS_MCS (1 << 5)   // first byte of the multiline comment start
+#define CLS_MCE (1 << 6)   // first byte of the multiline comment end
+#define CLS_KW (1 << 7)    // first byte of some keyword
+
+typedef struct synKeyword {
+  unsigned char len;  // 0 for an empty slot
+  unsigned char type; // HL_KEYWORD1 or HL_KEYWORD2
+  char s[SYN_KW_MAX + 1];
+} synKeyword;
+
+/* A language compiled for the lexer. It holds no pointers, so an array of
+   them can be written to disk and mapped straight back in. */
+typedef struct synTable {
+  char filetype[SYN_NAME_MAX];
+  char filematch[SYN_MATCH_MAX][SYN_NAME_MAX];
+  char scs[SYN_DELIM_MAX];
+  char mcs[SYN_DELIM_MAX];
+  char mce[SYN_DELIM_MAX];
+  uint8_t scs_len, mcs_len, mce_len;
+  uint8_t kw_max;    // length of the longest keyword
+  int32_t lookahead; // how far past a position the lexer may read
+  int32_t flags;
+  unsigned char cls[256];
+  synKeyword kw[SYN_KW_SLOTS];
+} synTable;
+
+void syntaxInit();
+struct editorSyntax *syntaxBuiltin(unsigned int j);
+struct editorSyntax *syntaxFind(const char *filename);
+int syntaxKeyword(const synTable *t, const char *s, int len, int *klen);
+
+#endif
@@ -0,0 +1,628 @@
+/* An index of where functions, types and macros are defined in the project,
+   for Ctrl-] and :tag. A worker thread lexes every file it has a language
+   for, with the same lexer tables as the editor, and picks definitions out of
+   the code the lexer leaves. The index is kept in the cache directory, so a
+   file that hasn't changed since the last run isn't lexed again, and a file
+   is indexed again whenever it is saved.
+
+   The project is the nearest directory up from the working directory with a
+   .git in it, or else just the files in the working directory. */
+
+#define _DEFAULT_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "syntax.h"
+#include "tags.h"
+
+#define TAGS_MAGIC "BSETAG1"
+#define TAGS_VERSION 1
+#define TAGS_FILE_MAX (8 << 20) // bigger files are generated, not written
+
+/* The cache file is this header, then for each file a tagsFileHeader, its
+   path, its tagSyms and the names they point into. */
+struct tagsHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t nfiles;
+};
+
+struct tagsFileHeader {
+  uint64_t size;
+  uint64_t mtime_sec;
+  uint64_t mtime_nsec;
+  uint64_t syntax; // hash of the syntax table the file was lexed with
+  uint32_t pathlen;
+  uint32_t nsyms;
+  uint32_t namelen;
+  uint32_t pad;
+};
+
+typedef struct tagSym {
+  uint32_t hash; // of the name, to skip most of the others quickly
+  int32_t line;
+  int32_t name; // where the name starts in the file's names
+  int32_t len;
+} tagSym;
+
+typedef struct tagFile {
+  struct tagsFileHeader h;
+  char *path; // relative to the project root
+  tagSym *syms;
+  char *names;
+  int seen; // found again by this run's walk of the project
+} tagFile;
+
+struct tagsState {
+  pthread_mutex_t lock; // guards files and pending, which the worker changes
+  tagFile *files;       // only the worker adds or removes them
+  int nfiles, cap;
+  int *slots; // files by the hash of their path: index + 1, or 0 if empty
+  int nslots; // a power of two, at least twice nfiles
+  char **pending; // saved files waiting to be indexed again
+  int npending;
+  int running; // a worker is running
+  int walked;  // the whole project has been indexed once
+  char root[PATH_MAX];
+  int recursive;            // the root is a repository, not just a directory
+  int here;                 // the root is the working directory
+  char cachefile[PATH_MAX]; // or "" for none
+} TG = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* The generic lexer, for the worker: it lexes files in other languages than
+   the open one, so it takes its table from tagTable rather than E->syntax. */
+const synTable *tagTable;
+
+#define LEX_NAME tagsLexRowTable
+#define LEX_INIT const synTable *t = tagTable;
+#define LEX_CLS(c) (t->cls[c])
+#define LEX_SCS (t->scs)
+#define LEX_SCS_LEN (t->scs_len)
+#define LEX_MCS (t->mcs)
+#define LEX_MCS_LEN (t->mcs_len)
+#define LEX_MCE (t->mce)
+#define LEX_MCE_LEN (t->mce_len)
+#define LEX_KEYWORD(p, left, klen) syntaxKeyword(t, p, left, klen)
+#include "lexrow.h"
+
+uint32_t tagsHash(const char *s, int len) {
+  return (uint32_t)cacheHash(s, len, CACHE_HASH_INIT);
+}
+
+int tagsCode(erow *row, int i) {
+  return i < row->rsize && row->hl[i] != HL_STRING &&
+         row->hl[i] != HL_COMMENT && row->hl[i] != HL_MLCOMMENT;
+}
+
+int tagsWordChar(erow *row, int i) {
+  return i >= 0 && tagsCode(row, i) &&
+         (isalnum((unsigned char)row->render[i]) || row->render[i] == '_');
+}
+
+/* The length of the identifier at i, 0 if there is none. */
+int tagsWord(erow *row, int i) {
+  int n = 0;
+  while (tagsWordChar(row, i + n))
+    n++;
+  return n && !isdigit((unsigned char)row->render[i]) ? n : 0;
+}
+
+int tagsSkipSpace(erow *row, int i) {
+  while (i < row->rsize && isspace((unsigned char)row->render[i]))
+    i++;
+  return i;
+}
+
+int tagsIs(erow *row, int i, int len, const char *word) {
+  return len == (int)strlen(word) && !memcmp(&row->render[i], word, len);
+}
+
+void tagsAdd(tagFile *f, erow *row, int line, int i, int len, int *cap,
+             int *namecap) {
+  if (row->hl[i] != HL_NORMAL) // a keyword, not a name
+    return;
+  if (f->h.nsyms == (uint32_t)*cap) {
+    *cap = *cap ? *cap * 2 : 16;
+    f->syms = realloc(f->syms, sizeof(tagSym) * *cap);
+  }
+  if (f->h.namelen + len > (uint32_t)*namecap) {
+    *namecap = (f->h.namelen + len) * 2;
+    f->names = realloc(f->names, *namecap);
+  }
+  memcpy(&f->names[f->h.namelen], &row->render[i], len);
+  f->syms[f->h.nsyms++] =
+      (tagSym){tagsHash(&row->render[i], len), line, f->h.namelen, len};
+  f->h.namelen += len;
+}
+
+/* Add what a lexed row defines, going by how definitions are laid out in C
+   and Go: they start at the left margin, where statements don't. */
+void tagsScanRow(tagFile *f, erow *row, int line, int *cap, int *namecap) {
+  char *p = row->render;
+  int end = row->rsize; // the end of the code on the row
+  while (end > 0 &&
+         (!tagsCode(row, end - 1) || isspace((unsigned char)p[end - 1])))
+    end--;
+  if (end == 0 || isspace((unsigned char)p[0]))
+    return;
+  char last = p[end - 1];
+  int i, len, name;
+
+  if (p[0] == '#') {
+    i = tagsSkipSpace(row, 1);
+    len = tagsWord(row, i);
+    if (tagsIs(row, i, len, "define")) {
+      i = tagsSkipSpace(row, i + len);
+      if ((len = tagsWord(row, i)))
+        tagsAdd(f, row, line, i, len, cap, namecap);
+    }
+    return;
+  }
+  if (p[0] == '}') { // the end of typedef struct { ... } name;
+    i = tagsSkipSpace(row, 1);
+    len = tagsWord(row, i);
+    if (len && p[tagsSkipSpace(row, i + len)] == ';')
+      tagsAdd(f, row, line, i, len, cap, namecap);
+    return;
+  }
+  if (!(len = tagsWord(row, 0)))
+    return;
+
+  if (tagsIs(row, 0, len, "func")) { // Go: func name( or func (r T) name(
+    i = tagsSkipSpace(row, len);
+    if (p[i] == '(') {
+      while (i < end && p[i] != ')')
+        i++;
+      i = tagsSkipSpace(row, i + 1);
+    }
+    if ((len = tagsWord(row, i)))
+      tagsAdd(f, row, line, i, len, cap, namecap);
+    return;
+  }
+  if (tagsIs(row, 0, len, "type")) { // Go: type name ...
+    i = tagsSkipSpace(row, len);
+    if ((len = tagsWord(row, i)))
+      tagsAdd(f, row, line, i, len, cap, namecap);
+    return;
+  }
+
+  i = 0;
+  if (tagsIs(row, 0, len, "typedef")) {
+    if (last == ';' && !memchr(p, '{', end)) {
+      // typedef int (*name)(int); or typedef struct x name;
+      char *fp = memchr(p, '(', end);
+      if (fp && fp[1] == '*')
+        i = fp + 2 - p;
+      else
+        for (i = end - 1; tagsWordChar(row, i - 1); i--)
+          ;
+      if ((len = tagsWord(row, i)))
+        tagsAdd(f, row, line, i, len, cap, namecap);
+      return;
+    }
+    i = tagsSkipSpace(row, len);
+    len = tagsWord(row, i);
+  }
+  if (tagsIs(row, i, len, "struct") || tagsIs(row, i, len, "union") ||
+      tagsIs(row, i, len, "enum") || tagsIs(row, i, len, "class")) {
+    name = tagsSkipSpace(row, i + len);
+    int nlen = tagsWord(row, name);
+    int after = tagsSkipSpace(row, name + nlen);
+    if (nlen && (after >= end || p[after] == '{' || p[after] == ':')) {
+      tagsAdd(f, row, line, name, nlen, cap, namecap);
+      return;
+    }
+  }
+
+  // A function: words and pointers up to the name, then its parameters, and
+  // no ; after them as a prototype would have.
+  if (last == ';')
+    return;
+  for (i = 0; i < end && p[i] != '('; i++) {
+    if (!tagsCode(row, i) ||
+        !(isalnum((unsigned char)p[i]) || (p[i] && strchr("_*& :", p[i]))))
+      return;
+  }
+  if (i == end)
+    return;
+  for (name = i; name > 0 && isspace((unsigned char)p[name - 1]); name--)
+    ;
+  for (len = 0; tagsWordChar(row, name - 1); name--, len++)
+    ;
+  if (tagsWord(row, name) == len && len)
+    tagsAdd(f, row, line, name, len, cap, namecap);
+}
+
+/* Lex the file at path and collect its definitions into f. */
+void tagsIndexFile(tagFile *f, const char *path, struct editorSyntax *s) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return;
+  erow row;
+  memset(&row, 0, sizeof(row));
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t len;
+  int n = 0, cap = 0, namecap = 0, hlcap = 0;
+  lexState st = {0, 0, 1, 0};
+  lexFn lex = s->lex ? s->lex : tagsLexRowTable;
+  tagTable = s->table;
+  while ((len = getline(&line, &linecap, fp)) != -1) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      len--;
+    if (len > hlcap) {
+      hlcap = len * 2;
+      row.hl = realloc(row.hl, hlcap);
+    }
+    row.render = line;
+    row.rsize = len;
+    row.nchunks = 0;
+    lex(&row, 0, st, -1);
+    st.in_comment = row.hl_open_comment;
+    tagsScanRow(f, &row, n++, &cap, &namecap);
+  }
+  free(line);
+  free(row.hl);
+  free(row.chunks);
+  fclose(fp);
+}
+
+void tagsFreeFile(tagFile *f) {
+  free(f->path);
+  free(f->syms);
+  free(f->names);
+}
+
+/* The slot path is in, or the empty one it would go in. */
+int tagsSlot(const char *path) {
+  int i = cacheHash(path, strlen(path), CACHE_HASH_INIT) & (TG.nslots - 1);
+  while (TG.slots[i] && strcmp(TG.files[TG.slots[i] - 1].path, path))
+    i = (i + 1) & (TG.nslots - 1);
+  return i;
+}
+
+/* Fill in the slots again, after files were removed or to make room. */
+void tagsRehash() {
+  while (TG.nslots < TG.nfiles * 2 + 2)
+    TG.nslots = TG.nslots ? TG.nslots * 2 : 64;
+  TG.slots = realloc(TG.slots, sizeof(int) * TG.nslots);
+  memset(TG.slots, 0, sizeof(int) * TG.nslots);
+  for (int j = 0; j < TG.nfiles; j++)
+    TG.slots[tagsSlot(TG.files[j].path)] = j + 1;
+}
+
+int tagsFindFile(const char *path) {
+  return TG.nslots ? TG.slots[tagsSlot(path)] - 1 : -1;
+}
+
+/* Put f in the index, in place of what was there for its path. */
+void tagsInstall(tagFile *f) {
+  pthread_mutex_lock(&TG.lock);
+  int j = tagsFindFile(f->path);
+  if (j == -1) {
+    if (TG.nfiles == TG.cap) {
+      TG.cap = TG.cap ? TG.cap * 2 : 64;
+      TG.files = realloc(TG.files, sizeof(tagFile) * TG.cap);
+    }
+    j = TG.nfiles++;
+    TG.files[j] = *f;
+    if (TG.nslots < TG.nfiles * 2)
+      tagsRehash();
+    else
+      TG.slots[tagsSlot(f->path)] = j + 1;
+  } else {
+    tagsFreeFile(&TG.files[j]);
+    TG.files[j] = *f;
+  }
+  pthread_mutex_unlock(&TG.lock);
+}
+
+/* Index the file at path, relative to the root, unless the index already
+   has it as it is on disk. Returns 1 if the index changed. */
+int tagsRefresh(const char *path) {
+  char full[PATH_MAX];
+  struct stat st;
+  struct editorSyntax *s = syntaxFind(path);
+  if (!s || snprintf(full, sizeof(full), "%s/%s", TG.root, path) >= PATH_MAX)
+    return 0;
+  int j = tagsFindFile(path);
+  if (stat(full, &st) == -1 || !S_ISREG(st.st_mode) ||
+      st.st_size > TAGS_FILE_MAX) {
+    if (j == -1)
+      return 0;
+    pthread_mutex_lock(&TG.lock); // it has gone
+    tagsFreeFile(&TG.files[j]);
+    TG.files[j] = TG.files[--TG.nfiles];
+    tagsRehash();
+    pthread_mutex_unlock(&TG.lock);
+    return 1;
+  }
+
+  tagFile f;
+  memset(&f, 0, sizeof(f));
+  f.h.size = st.st_size;
+  f.h.mtime_sec = st.st_mtim.tv_sec;
+  f.h.mtime_nsec = st.st_mtim.tv_nsec;
+  f.h.syntax = cacheHash(s->table, sizeof(synTable), CACHE_HASH_INIT);
+  f.seen = 1;
+  if (j != -1) {
+    TG.files[j].seen = 1;
+    if (!memcmp(&TG.files[j].h, &f.h, offsetof(struct tagsFileHeader, pathlen)))
+      return 0;
+  }
+  f.path = strdup(path);
+  f.h.pathlen = strlen(path);
+  tagsIndexFile(&f, full, s);
+  tagsInstall(&f);
+  return 1;
+}
+
+/* Index everything under dir, relative to the root. */
+int tagsWalk(const char *dir) {
+  char full[PATH_MAX], path[PATH_MAX];
+  if (snprintf(full, sizeof(full), "%s%s%s", TG.root, *dir ? "/" : "", dir) >=
+      PATH_MAX)
+    return 0;
+  DIR *d = opendir(full);
+  if (!d)
+    return 0;
+  int changed = 0;
+  struct dirent *ent;
+  while ((ent = readdir(d)) != NULL) {
+    if (ent->d_name[0] == '.' || // also .git and the like
+        snprintf(path, sizeof(path), "%s%s%s", dir, *dir ? "/" : "",
+                 ent->d_name) >= PATH_MAX)
+      continue;
+    if (ent->d_type == DT_DIR) {
+      if (TG.recursive)
+        changed |= tagsWalk(path);
+    } else if (ent->d_type == DT_REG) {
+      changed |= tagsRefresh(path);
+    }
+  }
+  closedir(d);
+  return changed;
+}
+
+/* Whether every name of f is inside its names, so a cache that is cut short
+   or corrupt can't send tagsFind reading past them. */
+int tagsSymsValid(tagFile *f) {
+  for (uint32_t i = 0; i < f->h.nsyms; i++) {
+    tagSym *s = &f->syms[i];
+    if (s->name < 0 || s->len < 0 ||
+        (int64_t)s->name + s->len > (int64_t)f->h.namelen)
+      return 0;
+  }
+  return 1;
+}
+
+/* Read the index left by an earlier run. */
+void tagsLoad() {
+  FILE *fp = TG.cachefile[0] ? fopen(TG.cachefile, "r") : NULL;
+  if (!fp)
+    return;
+  struct tagsHeader h;
+  if (fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, TAGS_MAGIC, 8) ||
+      h.version != TAGS_VERSION) {
+    fclose(fp);
+    return;
+  }
+  for (uint32_t j = 0; j < h.nfiles; j++) {
+    tagFile f;
+    memset(&f, 0, sizeof(f));
+    if (fread(&f.h, sizeof(f.h), 1, fp) != 1 || f.h.pathlen >= PATH_MAX ||
+        f.h.nsyms > TAGS_FILE_MAX || f.h.namelen > TAGS_FILE_MAX)
+      break;
+    f.path = malloc(f.h.pathlen + 1);
+    f.syms = malloc(sizeof(tagSym) * (f.h.nsyms ? f.h.nsyms : 1));
+    f.names = malloc(f.h.namelen ? f.h.namelen : 1);
+    if (fread(f.path, 1, f.h.pathlen, fp) != f.h.pathlen ||
+        fread(f.syms, sizeof(tagSym), f.h.nsyms, fp) != f.h.nsyms ||
+        fread(f.names, 1, f.h.namelen, fp) != f.h.namelen) {
+      tagsFreeFile(&f);
+      break;
+    }
+    f.path[f.h.pathlen] = '\0';
+    if (!tagsSymsValid(&f)) {
+      tagsFreeFile(&f); // the file is indexed again when the walk reaches it
+      continue;
+    }
+    tagsInstall(&f);
+  }
+  fclose(fp);
+}
+
+/* Write the index out, replacing the old one atomically. */
+void tagsSave() {
+  if (!TG.cachefile[0])
+    return;
+  char dir[PATH_MAX], tmp[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s", TG.cachefile);
+  *strrchr(dir, '/') = '\0';
+  cacheMkdirs(dir);
+  if (snprintf(tmp, sizeof(tmp), "%s.%d", TG.cachefile, (int)getpid()) >=
+      PATH_MAX)
+    return;
+  FILE *fp = fopen(tmp, "w");
+  if (!fp)
+    return;
+  struct tagsHeader h = {TAGS_MAGIC, TAGS_VERSION, TG.nfiles};
+  int ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+  for (int j = 0; ok && j < TG.nfiles; j++) {
+    tagFile *f = &TG.files[j];
+    ok = fwrite(&f->h, sizeof(f->h), 1, fp) == 1 &&
+         fwrite(f->path, 1, f->h.pathlen, fp) == f->h.pathlen &&
+         fwrite(f->syms, sizeof(tagSym), f->h.nsyms, fp) == f->h.nsyms &&
+         fwrite(f->names, 1, f->h.namelen, fp) == f->h.namelen;
+  }
+  if (fclose(fp) == 0 && ok)
+    rename(tmp, TG.cachefile);
+  else
+    unlink(tmp);
+}
+
+void *tagsThread(void *arg) {
+  (void)arg;
+  int changed = 0;
+  if (!TG.walked) {
+    tagsLoad();
+    changed = tagsWalk("");
+    pthread_mutex_lock(&TG.lock);
+    for (int j = 0; j < TG.nfiles; j++) { // the files that have gone
+      if (!TG.files[j].seen) {
+        tagsFreeFile(&TG.files[j]);
+        TG.files[j--] = TG.files[--TG.nfiles];
+        changed = 1;
+      }
+    }
+    tagsRehash();
+    TG.walked = 1;
+    pthread_mutex_unlock(&TG.lock);
+  }
+  for (;;) {
+    pthread_mutex_lock(&TG.lock);
+    char *path = TG.npending ? TG.pending[--TG.npending] : NULL;
+    if (!path && !changed)
+      TG.running = 0;
+    pthread_mutex_unlock(&TG.lock);
+    if (path) {
+      changed |= tagsRefresh(path);
+      free(path);
+    } else if (changed) {
+      tagsSave();
+      changed = 0;
+    } else {
+      return NULL;
+    }
+  }
+}
+
+/* Start the worker, unless it is still running and will get to the work. */
+void tagsRun() {
+  if (TG.running)
+    return;
+  pthread_t thread;
+  TG.running = 1;
+  if (pthread_create(&thread, NULL, tagsThread, NULL) == 0)
+    pthread_detach(thread);
+  else
+    TG.running = 0;
+}
+
+/* Find the project and index it in the background. */
+void tagsStart() {
+  char cwd[PATH_MAX], git[PATH_MAX], dir[PATH_MAX];
+  struct stat st;
+  if (!getcwd(cwd, sizeof(cwd)))
+    return;
+  snprintf(TG.root, sizeof(TG.root), "%s", cwd);
+  for (;;) {
+    if (snprintf(git, sizeof(git), "%s/.git", TG.root) < PATH_MAX &&
+        stat(git, &st) == 0) {
+      TG.recursive = 1;
+      break;
+    }
+    char *slash = strrchr(TG.root, '/');
+    if (!slash || slash == TG.root) { // not in a repository after all
+      snprintf(TG.root, sizeof(TG.root), "%s", cwd);
+      break;
+    }
+    *slash = '\0';
+  }
+  TG.here = !strcmp(TG.root, cwd);
+  TG.cachefile[0] = '\0';
+  if (cacheDir(dir) == 0 &&
+      snprintf(TG.cachefile, sizeof(TG.cachefile), "%s/tags/%016llx.tags", dir,
+               (unsigned long long)cacheHash(TG.root, strlen(TG.root),
+                                             CACHE_HASH_INIT)) >= PATH_MAX)
+    TG.cachefile[0] = '\0';
+  pthread_mutex_lock(&TG.lock);
+  tagsRun();
+  pthread_mutex_unlock(&TG.lock);
+}
+
+/* The path of filename relative to the root, or NULL if it is outside it.
+   The caller frees it. */
+char *tagsRelative(const char *filename) {
+  char *path = realpath(filename, NULL), *rel = NULL;
+  int n = strlen(TG.root);
+  if (path && !strncmp(path, TG.root, n) && path[n] == '/')
+    rel = strdup(&path[n + 1]);
+  free(path);
+  return rel;
+}
+
+/* Index filename again, now that it has been saved. */
+void tagsUpdate(const char *filename) {
+  if (!TG.root[0])
+    return;
+  char *rel = tagsRelative(filename);
+  if (!rel || (!TG.recursive && strchr(rel, '/'))) {
+    free(rel);
+    return;
+  }
+  pthread_mutex_lock(&TG.lock);
+  TG.pending = realloc(TG.pending, sizeof(char *) * (TG.npending + 1));
+  TG.pending[TG.npending++] = rel;
+  tagsRun();
+  pthread_mutex_unlock(&TG.lock);
+}
+
+/* Where name is defined, those in the file prefer first. Returns how many
+   places, with *matches for the caller to free with tagsFree. */
+int tagsFind(const char *name, const char *prefer, tagMatch **matches) {
+  int len = strlen(name), n = 0, first = 0;
+  uint32_t hash = tagsHash(name, len);
+  char *rel = prefer ? tagsRelative(prefer) : NULL;
+  *matches = NULL;
+  pthread_mutex_lock(&TG.lock);
+  for (int j = 0; j < TG.nfiles; j++) {
+    tagFile *f = &TG.files[j];
+    for (uint32_t k = 0; k < f->h.nsyms; k++) {
+      tagSym *s = &f->syms[k];
+      if (s->hash != hash || s->len != len ||
+          memcmp(&f->names[s->name], name, len))
+        continue;
+      char file[PATH_MAX];
+      if (snprintf(file, sizeof(file), "%s%s%s", TG.here ? "" : TG.root,
+                   TG.here ? "" : "/", f->path) >= PATH_MAX)
+        continue;
+      *matches = realloc(*matches, sizeof(tagMatch) * (n + 1));
+      (*matches)[n] = (tagMatch){strdup(file), s->line};
+      if (rel && !strcmp(rel, f->path)) {
+        tagMatch t = (*matches)[first];
+        (*matches)[first++] = (*matches)[n];
+        (*matches)[n] = t;
+      }
+      n++;
+    }
+  }
+  pthread_mutex_unlock(&TG.lock);
+  free(rel);
+  return n;
+}
+
+void tagsFree(tagMatch *matches, int n) {
+  for (int j = 0; j < n; j++)
+    free(matches[j].file);
+  free(matches);
+}
+
+/* Whether the first walk of the project is still going. */
+int tagsIndexing() {
+  pthread_mutex_lock(&TG.lock);
+  int indexing = TG.running && !TG.walked;
+  pthread_mutex_unlock(&TG.lock);
+  return indexing;
+}
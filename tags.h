@@ -0,0 +1,16 @@
+#ifndef TAGS_H
+#define TAGS_H
+
+/* Where a symbol is defined. */
+typedef struct tagMatch {
+  char *file; // a path that can be opened from the working directory
+  int line;   // counting from 0
+} tagMatch;
+
+void tagsStart();
+void tagsUpdate(const char *filename);
+int tagsFind(const char *name, const char *prefer, tagMatch **matches);
+void tagsFree(tagMatch *matches, int n);
+int tagsIndexing();
+
+#endif
@@ -0,0 +1,48 @@
+/* Row text that rows and registers can share without copying it. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "text.h"
+
+/* A text holding a copy of the len bytes at s, null terminated. */
+text *textNew(const char *s, int len) {
+  text *t = malloc(sizeof(text) + len + 1);
+  t->refs = 1;
+  t->cap = len + 1;
+  memcpy(t->chars, s, len);
+  t->chars[len] = '\0';
+  return t;
+}
+
+text *textRef(text *t) {
+  t->refs++;
+  return t;
+}
+
+void textUnref(text *t) {
+  if (t && --t->refs == 0)
+    free(t);
+}
+
+/* Make *t safe to write and big enough for n bytes and a null byte, keeping
+   its first len bytes and terminator. A shared text is left to its other
+   holders and replaced by a copy. */
+void textReserve(text **t, int len, int n) {
+  if ((*t)->refs > 1) {
+    text *copy = malloc(sizeof(text) + (n > len ? n : len) + 1);
+    copy->refs = 1;
+    copy->cap = (n > len ? n : len) + 1;
+    memcpy(copy->chars, (*t)->chars, len + 1);
+    (*t)->refs--;
+    *t = copy;
+    return;
+  }
+  if (n < (*t)->cap)
+    return;
+  int newcap = (*t)->cap + (*t)->cap / 2;
+  if (newcap < n + 1)
+    newcap = n + 1;
+  *t = realloc(*t, sizeof(text) + newcap);
+  (*t)->cap = newcap;
+}
@@ -0,0 +1,24 @@
+#ifndef TEXT_H
+#define TEXT_H
+
+/* Reference-counted text. With one reference it belongs to its holder, who can
+   write it in place; once shared it is immutable, and is copied before it's
+   written. */
+typedef struct text {
+  int refs;
+  int cap; // bytes allocated for chars
+  char chars[];
+} text;
+
+/* len bytes of a text from off. */
+typedef struct slice {
+  text *t;
+  int off, len;
+} slice;
+
+text *textNew(const char *s, int len);
+text *textRef(text *t);
+void textUnref(text *t);
+void textReserve(text **t, int len, int n);
+
+#endif
@@ -0,0 +1,211 @@
+/* UTF-8 text on screen. A row that is all ASCII, which is nearly every row of
+   code or logs, takes a column per byte and needs nothing more. Any other row
+   gets the column each byte of its render starts at worked out once when it
+   is rendered. A character and the marks that combine with it are one unit,
+   so every unit takes at least one column and the columns only go up from one
+   unit to the next. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utf8.h"
+
+/* Ranges of code points, sorted. */
+struct utf8Range {
+  int first, last;
+};
+
+/* Marks that combine with the character before them, and characters that
+   take no room of their own. */
+const struct utf8Range utf8Zero[] = {
+    {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+    {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+    {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+    {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0711, 0x0711}, {0x0730, 0x074A},
+    {0x07A6, 0x07B0}, {0x07EB, 0x07F3}, {0x0816, 0x082D}, {0x0859, 0x085B},
+    {0x08D3, 0x0902}, {0x093A, 0x093A}, {0x093C, 0x093C}, {0x0941, 0x0948},
+    {0x094D, 0x094D}, {0x0951, 0x0957}, {0x0962, 0x0963}, {0x0E31, 0x0E31},
+    {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x0EB1, 0x0EB1}, {0x0EB4, 0x0EBC},
+    {0x0EC8, 0x0ECD}, {0x1160, 0x11FF}, {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF},
+    {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064}, {0x20D0, 0x20FF},
+    {0x302A, 0x302D}, {0x3099, 0x309A}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F},
+    {0xFEFF, 0xFEFF}, {0x1F3FB, 0x1F3FF}, {0xE0000, 0xE0FFF},
+};
+
+/* East Asian wide and fullwidth characters, and emoji, which take two
+   columns. */
+const struct utf8Range utf8Wide[] = {
+    {0x1100, 0x115F},   {0x231A, 0x231B},   {0x2329, 0x232A},
+    {0x23E9, 0x23EC},   {0x23F0, 0x23F0},   {0x23F3, 0x23F3},
+    {0x25FD, 0x25FE},   {0x2614, 0x2615},   {0x2648, 0x2653},
+    {0x267F, 0x267F},   {0x2693, 0x2693},   {0x26A1, 0x26A1},
+    {0x26AA, 0x26AB},   {0x26BD, 0x26BE},   {0x26C4, 0x26C5},
+    {0x26CE, 0x26CE},   {0x26D4, 0x26D4},   {0x26EA, 0x26EA},
+    {0x26F2, 0x26F3},   {0x26F5, 0x26F5},   {0x26FA, 0x26FA},
+    {0x26FD, 0x26FD},   {0x2705, 0x2705},   {0x270A, 0x270B},
+    {0x2728, 0x2728},   {0x274C, 0x274C},   {0x274E, 0x274E},
+    {0x2753, 0x2755},   {0x2757, 0x2757},   {0x2795, 0x2797},
+    {0x27B0, 0x27B0},   {0x27BF, 0x27BF},   {0x2B1B, 0x2B1C},
+    {0x2B50, 0x2B50},   {0x2B55, 0x2B55},   {0x2E80, 0x3029},
+    {0x302E, 0x303E},   {0x3041, 0x3098},   {0x309B, 0xA4CF},
+    {0xA960, 0xA97F},   {0xAC00, 0xD7A3},   {0xF900, 0xFAFF},
+    {0xFE10, 0xFE19},   {0xFE30, 0xFE6F},   {0xFF00, 0xFF60},
+    {0xFFE0, 0xFFE6},   {0x16FE0, 0x16FE4}, {0x17000, 0x18AFF},
+    {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF},
+    {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F251},
+    {0x1F300, 0x1F3FA}, {0x1F400, 0x1F64F}, {0x1F680, 0x1F6FF},
+    {0x1F900, 0x1F9FF}, {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD},
+    {0x30000, 0x3FFFD},
+};
+
+int utf8InRanges(const struct utf8Range *r, int n, int cp) {
+  int lo = 0, hi = n - 1;
+  if (cp < r[0].first || cp > r[n - 1].last)
+    return 0;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (cp > r[mid].last)
+      lo = mid + 1;
+    else if (cp < r[mid].first)
+      hi = mid - 1;
+    else
+      return 1;
+  }
+  return 0;
+}
+
+/* Whether s has no byte with the top bit set. Eight bytes are tested at a
+   time, and the loop has no branch for the compiler to keep it from turning
+   it into vector instructions. */
+int utf8IsAscii(const char *s, int len) {
+  uint64_t bits = 0;
+  int i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, &s[i], 8);
+    bits |= w;
+  }
+  for (; i < len; i++)
+    bits |= (unsigned char)s[i];
+  return (bits & 0x8080808080808080ull) == 0;
+}
+
+/* Decode the character at s, of at most len bytes, into *cp. Returns its
+   length, or 1 with *cp set to -1 if it isn't valid UTF-8. */
+int utf8Decode(const char *s, int len, int *cp) {
+  const unsigned char *u = (const unsigned char *)s;
+  int n, c;
+  if (u[0] < 0x80) {
+    *cp = u[0];
+    return 1;
+  } else if (u[0] >= 0xC2 && u[0] <= 0xDF) {
+    n = 2;
+    c = u[0] & 0x1F;
+  } else if ((u[0] & 0xF0) == 0xE0) {
+    n = 3;
+    c = u[0] & 0x0F;
+  } else if (u[0] >= 0xF0 && u[0] <= 0xF4) {
+    n = 4;
+    c = u[0] & 0x07;
+  } else {
+    *cp = -1;
+    return 1;
+  }
+  if (n > len) {
+    *cp = -1;
+    return 1;
+  }
+  for (int i = 1; i < n; i++) {
+    if ((u[i] & 0xC0) != 0x80) {
+      *cp = -1;
+      return 1;
+    }
+    c = c << 6 | (u[i] & 0x3F);
+  }
+  // overlong forms, surrogates and what is past the last code point
+  if ((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || c > 0x10FFFF)) ||
+      (c >= 0xD800 && c <= 0xDFFF)) {
+    *cp = -1;
+    return 1;
+  }
+  *cp = c;
+  return n;
+}
+
+/* The columns cp takes. What can't be shown as it is, such as a control
+   character or a byte that isn't UTF-8, is drawn as one symbol. */
+int utf8Width(int cp) {
+  if (cp < 0xA0)
+    return 1;
+  if (utf8InRanges(utf8Zero, sizeof(utf8Zero) / sizeof(*utf8Zero), cp))
+    return 0;
+  if (utf8InRanges(utf8Wide, sizeof(utf8Wide) / sizeof(*utf8Wide), cp))
+    return 2;
+  return 1;
+}
+
+/* Work out the column each byte of the render of row starts at, or nothing if
+   it is all ASCII. The bytes of a unit all get the column it starts at, and
+   cols[rsize] is the width of the row. */
+void utf8Columns(erow *row) {
+  if (utf8IsAscii(row->render, row->rsize)) {
+    free(row->cols);
+    row->cols = NULL;
+    return;
+  }
+  int *cols = realloc(row->cols, sizeof(int) * (row->rsize + 1));
+  int col = 0, i = 0;
+  while (i < row->rsize) {
+    int cp, n = utf8Decode(&row->render[i], row->rsize - i, &cp);
+    int w = utf8Width(cp), at = col;
+    if (w == 0 && i > 0)
+      at = cols[i - 1]; // a mark goes with the character before it
+    else
+      col += w > 0 ? w : 1; // or stands on its own at the start
+    for (int k = 0; k < n; k++)
+      cols[i + k] = at;
+    i += n;
+  }
+  cols[row->rsize] = col;
+  row->cols = cols;
+}
+
+/* The column render byte rx of row is drawn in, from the start of the row. */
+int utf8Column(erow *row, int rx) { return row->cols ? row->cols[rx] : rx; }
+
+/* Where in render the first unit of row starting at or after column col
+   is, or rsize if none does. */
+int utf8Rx(erow *row, int col) {
+  if (!row->cols)
+    return col < row->rsize ? col : row->rsize;
+  int lo = 0, hi = row->rsize;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (row->cols[mid] < col)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* The end of the units from render byte from on that fit in width columns. */
+int utf8Fit(erow *row, int from, int width) {
+  if (!row->cols)
+    return from + width < row->rsize ? from + width : row->rsize;
+  int limit = row->cols[from] + width;
+  if (row->cols[row->rsize] <= limit)
+    return row->rsize;
+  // the last byte that starts at or before limit is in the first unit that
+  // doesn't fit, or starts right at limit
+  int lo = from, hi = row->rsize;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (row->cols[mid] <= limit)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return utf8Rx(row, row->cols[lo - 1]);
+}
@@ -0,0 +1,14 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include "bse.h"
+
+int utf8IsAscii(const char *s, int len);
+int utf8Decode(const char *s, int len, int *cp);
+int utf8Width(int cp);
+void utf8Columns(erow *row);
+int utf8Column(erow *row, int rx);
+int utf8Rx(erow *row, int col);
+int utf8Fit(erow *row, int from, int width);
+
+#endif
@@ -0,0 +1,206 @@
+/* Soft wrapping: each row is cut into lines as wide as the screen. Where the
+   lines of a row start is worked out once and kept with the row until it
+   changes or the screen does. A Fenwick tree over how many lines each block
+   of rows takes finds the screen line a row starts on, and the row a screen
+   line is in, in O(log n) and a walk along one block rather than by adding up
+   the rows above. */
+
+#include <stdlib.h>
+
+#include "blocks.h"
+#include "utf8.h"
+#include "wrap.h"
+
+struct wrapIndex {
+  int cols;         // the width rows are wrapped at, 0 while wrapping is off
+  rowBlocks blocks; // each with the lines its rows take
+  int *tree; // tree[i] is the lines of blocks [i - (i & -i), i), from 1
+  int cap;
+  int leaves; // blocks the tree was built over
+} WR = {.blocks.size = sizeof(int)};
+
+/* Wrap rows at cols columns, or not at all if cols is 0. */
+void wrapSet(int cols) {
+  WR.cols = cols;
+  blocksMoved(&WR.blocks, 0);
+}
+
+int wrapCols() { return WR.cols; }
+
+/* Where the lines of row after the first start, into wraps unless it is
+   NULL. Returns how many there are. Lines break between characters, and a
+   wide one that doesn't fit on the end of a line goes on the next. */
+int wrapBreaks(erow *row, int *wraps) {
+  int n = 0;
+  if (!row->cols) { // all ASCII, so a column per byte
+    for (int at = WR.cols; at < row->rsize; at += WR.cols, n++)
+      if (wraps)
+        wraps[n] = at;
+    return n;
+  }
+  int at = 0, end;
+  while ((end = utf8Fit(row, at, WR.cols)) < row->rsize) {
+    if (end == at) // wider than the screen, so it has a line to itself
+      end = utf8Rx(row, utf8Column(row, at) + 1);
+    if (wraps)
+      wraps[n] = end;
+    n++;
+    at = end;
+  }
+  return n;
+}
+
+/* Work out where the lines of row start, unless that is already known for
+   the current width. */
+void wrapLayout(erow *row) {
+  if (row->wrapcols == WR.cols)
+    return;
+  int n = wrapBreaks(row, NULL);
+  if (n > row->nwraps)
+    row->wraps = realloc(row->wraps, sizeof(int) * n);
+  wrapBreaks(row, row->wraps);
+  row->nwraps = n;
+  row->wrapcols = WR.cols;
+}
+
+/* Add d to the lines of block in the tree. */
+void wrapAdd(int block, int d) {
+  for (int i = block + 1; d && i <= WR.leaves; i += i & -i)
+    WR.tree[i] += d;
+}
+
+/* The render of row changed. If its block is counted, its new number of
+   lines goes straight in. */
+void wrapRowChanged(editorConfig *e, erow *row) {
+  int old = row->wrapcols == WR.cols ? row->nwraps + 1 : -1;
+  row->wrapcols = 0;
+  int block = WR.cols ? blocksOf(&WR.blocks, row->idx) : -1;
+  if (block == -1 || &e->row[row->idx] != row)
+    return;
+  if (old == -1) {
+    blocksTouch(&WR.blocks, block);
+    return;
+  }
+  if (WR.blocks.touched[block]) // it is counted again anyway
+    return;
+  int d = wrapHeight(row) - old;
+  *(int *)blocksData(&WR.blocks, block) += d;
+  if (WR.leaves == WR.blocks.n)
+    wrapAdd(block, d);
+}
+
+/* Rows from at on were moved in a way that can't be followed. */
+void wrapRowsMoved(int at) { blocksMoved(&WR.blocks, at); }
+
+/* n rows are about to be added at at, or -n deleted from there. */
+void wrapRowsShifted(int at, int n) { blocksShift(&WR.blocks, at, n); }
+
+/* Count the lines the rows of block take. Returns how many more that is. */
+int wrapBlock(editorConfig *e, int block) {
+  int *lines = blocksData(&WR.blocks, block), old = *lines;
+  *lines = 0;
+  for (int y = WR.blocks.start[block]; y < WR.blocks.start[block + 1]; y++)
+    *lines += wrapHeight(&e->row[y]);
+  return *lines - old;
+}
+
+/* Bring the blocks whose rows have changed up to date, and the tree with
+   them. It is built again if blocks were cut up or dropped. Each entry is
+   its own block plus the entries just below it that it covers, which is
+   O(1) on average. */
+void wrapUpdate(editorConfig *e) {
+  rowBlocks *b = &WR.blocks;
+  int first = blocksLayout(b, e->numrows), block;
+  int rebuild = first != -1 || WR.leaves != b->n;
+  for (block = first; block != -1 && block < b->n; block++)
+    wrapBlock(e, block);
+  while ((block = blocksTouched(b)) != -1) {
+    int pieces = blocksSplit(b, block), d = 0;
+    for (int i = block; i < block + pieces; i++)
+      d = wrapBlock(e, i);
+    if (pieces != 1)
+      rebuild = 1;
+    else if (!rebuild)
+      wrapAdd(block, d);
+  }
+  if (!rebuild)
+    return;
+  if (b->n + 1 > WR.cap) {
+    WR.cap = b->n + 1 + b->n / 2;
+    WR.tree = realloc(WR.tree, sizeof(int) * WR.cap);
+  }
+  for (int i = 1; i <= b->n; i++) {
+    int lines = *(int *)blocksData(b, i - 1);
+    for (int k = 1; k < (i & -i); k <<= 1)
+      lines += WR.tree[i - k];
+    WR.tree[i] = lines;
+  }
+  WR.leaves = b->n;
+}
+
+/* How many screen lines row takes. */
+int wrapHeight(erow *row) {
+  wrapLayout(row);
+  return row->nwraps + 1;
+}
+
+/* Which of the lines of row render column rx is on. The end of a row that
+   exactly fills its last line stays on that line. */
+int wrapLineOf(erow *row, int rx) {
+  wrapLayout(row);
+  int lo = 0, hi = row->nwraps; // the last line starting at or before rx
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (row->wraps[mid - 1] <= rx)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+/* Where in render line of row starts; past the last line, the end. */
+int wrapLineStart(erow *row, int line) {
+  wrapLayout(row);
+  if (line == 0)
+    return 0;
+  return line <= row->nwraps ? row->wraps[line - 1] : row->rsize;
+}
+
+/* How many screen lines the rows before y take: the blocks before its own,
+   and the rows before it in that. */
+int wrapLinesBefore(editorConfig *e, int y) {
+  wrapUpdate(e);
+  if (WR.leaves == 0)
+    return 0;
+  int block = y < e->numrows ? blocksFind(&WR.blocks, y) : WR.leaves, lines = 0;
+  for (int i = block; i > 0; i -= i & -i)
+    lines += WR.tree[i];
+  for (int r = WR.blocks.start[block]; r < y; r++)
+    lines += wrapHeight(&e->row[r]);
+  return lines;
+}
+
+/* The row screen line line is in, counting from the top of the buffer, and
+   in *skip how many of its lines come before it. Past the end, numrows. */
+int wrapRowAt(editorConfig *e, int line, int *skip) {
+  wrapUpdate(e);
+  int pos = 0, bit = 1;
+  while (bit * 2 <= WR.leaves)
+    bit *= 2;
+  for (; bit > 0 && WR.leaves > 0; bit /= 2) {
+    if (pos + bit <= WR.leaves && WR.tree[pos + bit] <= line) {
+      pos += bit;
+      line -= WR.tree[pos];
+    }
+  }
+  int y = WR.leaves > 0 ? WR.blocks.start[pos] : 0;
+  for (; y < e->numrows; y++) {
+    int lines = wrapHeight(&e->row[y]);
+    if (line < lines)
+      break;
+    line -= lines;
+  }
+  *skip = line;
+  return y;
+}
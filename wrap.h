@@ -0,0 +1,17 @@
+#ifndef WRAP_H
+#define WRAP_H
+
+#include "bse.h"
+
+void wrapSet(int cols);
+int wrapCols();
+void wrapRowChanged(editorConfig *e, erow *row);
+void wrapRowsMoved(int at);
+void wrapRowsShifted(int at, int n);
+int wrapHeight(erow *row);
+int wrapLineOf(erow *row, int rx);
+int wrapLineStart(erow *row, int line);
+int wrapLinesBefore(editorConfig *e, int y);
+int wrapRowAt(editorConfig *e, int line, int *skip);
+
+#endif